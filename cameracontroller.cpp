@@ -20,6 +20,15 @@
 #include <dlfcn.h>
 
 #include <pthread.h>
+#ifdef __linux__
+    #include <semaphore.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+    #include <arm_neon.h>
+#endif
 
 #include <Processing.NDI.Lib.h>
 
@@ -60,6 +69,7 @@ void *runPWMThread(void *argIgnored);
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #ifdef USE_AVAHI
     #include <avahi-client/client.h>
@@ -91,6 +101,8 @@ void *runPWMThread(void *argIgnored);
     #include <linux/input.h>
     #include <sys/mman.h>
     #include <sys/user.h>
+    #include <sys/auxv.h>
+    #include <sys/epoll.h>
 
     #include "LEDConfiguration.h"
 
@@ -105,15 +117,36 @@ void *runPWMThread(void *argIgnored);
     #import <AppKit/AppKit.h>
     #import <CoreServices/CoreServices.h>
     #import <ImageIO/ImageIO.h>
+    #include <poll.h>
 
     #define ENABLE_FILES_FOR_BUTTON_TESTING
 #endif  // __linux__
 
 #include "ioexpander.c"
 
+// How a frame whose shape doesn't match the screen is fitted to it.
+typedef enum {
+    kFitStretch,       // Scale to fill the whole screen, distorting if necessary.
+    kFitLetterbox,     // Scale to fit, preserving the aspect ratio, with black borders.
+    kFitCrop           // Show pixels 1:1, centered, cropping or bordering as needed.
+} fitMode_t;
+
+typedef enum {
+    kCornerTopLeft,
+    kCornerTopRight,
+    kCornerBottomLeft,
+    kCornerBottomRight
+} screenCorner_t;
+
 int monitor_bytes_per_pixel = 4;
 bool monitor_flipped = false;  // Controlled by the -F flag.
+int monitor_rotation = 0;      // Controlled by the -r flag.  0, 90, 180, or 270 degrees clockwise.
 bool force_slow_path = false;  // For debugging.
+bool use_box_filter = false;   // Controlled by the -b flag.
+bool disable_page_flipping = false;  // Controlled by the -C flag.
+fitMode_t fit_mode = kFitStretch;    // Controlled by the -L and -K flags.
+bool receive_yuv = false;      // Controlled by the -Y flag.
+int render_thread_count = 0;   // Controlled by the -T flag.  Zero means one per core.
 
 #if __linux__
 // Always false in macOS.
@@ -128,6 +161,40 @@ bool g_use_on_screen_lights = false;
  */
 bool use_low_res_preview = false;
 
+/*
+ * Controlled by the -A (--adaptive_bandwidth) flag.
+ *
+ * If true, this tool switches between the high- and low-quality streams on its own,
+ * depending on whether it can keep up.  The -f flag then picks the starting stream.
+ */
+bool adaptive_bandwidth = false;
+
+/*
+ * Controlled by the -l (--low_latency) flag.
+ *
+ * If true, any video frames that queue up inside NDI while a frame is being handled are
+ * thrown away unseen, so the picture is never more than a frame behind the camera.
+ */
+bool low_latency_mode = false;
+
+/*
+ * Controlled by the -S (--smooth) flag.
+ *
+ * If true, each frame is scheduled for a particular vertical blank based on its NDI
+ * timestamp, so that frames are shown at an even pace (and dropped or repeated at
+ * predictable points) when the camera's frame rate doesn't match the panel's refresh.
+ */
+bool frame_pacing = false;
+
+/*
+ * Controlled by the -W (--pip) and -w (--pip_corner) flags.
+ *
+ * If set, the named camera is shown at low bandwidth in an inset in one corner of the
+ * picture, for keeping an eye on the program feed or another camera while framing a shot.
+ */
+char *pip_stream_name = NULL;
+screenCorner_t pip_corner = kCornerBottomRight;
+
 /* Enable debugging (controlled by the -d / --debug flag). */
 bool enable_debugging = false;
 
@@ -170,6 +237,8 @@ uint8_t base_duty_cycle = 255;
 
 #endif // __linux__
 
+#define MAX_MULTIVIEW_SOURCES 9  // A 3x3 grid.
+
 #define MAX_BUTTONS 5  // Theoretically, 9, but I don't want to build that much hardware.  Numbered 1 to 5.
 #define BUTTON_SET 0   // If the set button is held down, we store a value for that button instead of retrieving it.
 
@@ -191,8 +260,11 @@ typedef struct {
 
 typedef struct receiver_thread_data {
     const NDIlib_v3 *p_NDILib;
-    NDIlib_recv_instance_t pNDI_recv;
+    NDIlib_recv_instance_t pNDI_recv;  // Replaced by the receive thread when it changes bandwidth.
+    NDIlib_source_t source;            // Owned copies of the source's name and URL.
     char *stream_name;
+    int tileIndex;                     // The receiver's multiviewer tile, or -1 for the whole screen.
+    bool pictureInPicture;             // True for the inset's receiver (-W).
     std::atomic<bool> running; //(true);
 } *receiver_thread_data_t;
 
@@ -204,6 +276,102 @@ typedef struct receiver_array_item {
     receiver_thread_data_t thread_data;
 } *receiver_array_item_t;
 
+// How a scaler plan maps source pixels onto the screen.
+typedef enum {
+    kScaleIdentity,    // Same size.  Rows are copied (or converted) straight across.
+    kScaleInteger,     // A whole-number upscale in both directions (e.g. 960x540 on 1920x1080).
+    kScaleArbitrary,   // Any other upscale, using the columnStart/rowStart spans.
+    kScaleDownscale,   // Smaller than the source, using the sourceColumn/sourceRow tables.
+    kScaleRotated      // Turned 90 or 270 degrees, any size, using the same tables in tiles.
+} scaleMode_t;
+
+struct renderSlice;
+typedef void (*blitRowsFunc)(struct renderSlice *slice);
+
+#define TRANSPOSE_BLOCK_SIZE 8  // Rotated frames are drawn in 8x8 tiles.
+
+// Integer lookup tables for scaling NDI frames onto the screen.  scalerPlanForFrame picks
+// one for each frame from a small LRU cache, keyed on the frame's size, stride, and FourCC
+// and the screen's size, depth, stride, orientation, fit mode, and magnification, and
+// builds a new one only on a miss.  The source and screen sizes describe the part of the
+// frame that is shown and the part of the screen that it is drawn into; with cropping or
+// letterboxing, these are smaller than the whole.
+typedef struct scalerPlan {
+    int frameXRes, frameYRes;      // The whole NDI frame.
+    int displayXRes, displayYRes;  // The whole screen.
+    int sourceXRes, sourceYRes;
+    int screenXRes, screenYRes;    // In the picture's orientation.
+    int outputXRes, outputYRes;    // The same rectangle in the screen's orientation.
+    int bytesPerPixel;
+    int sourceBytesPerPixel;  // 4 for BGRX, 2 for UYVY.
+    int sourceStride;      // Bytes per NDI frame row.
+    int screenStride;      // Bytes per screen row.
+    ssize_t sourceOffset;  // Bytes from the start of the frame to the first pixel shown.
+    ssize_t screenOffset;  // Bytes from the start of the screen to the first pixel drawn.
+    int fourCC;            // The NDI pixel format that the plan was built for.
+    bool flipped;
+    int rotation;          // 0, 90, or 270 degrees clockwise.  (180 degrees is flipped.)
+    fitMode_t fitMode;
+    int magnification;     // Screen pixels per source pixel when punched in, or zero.
+    uint64_t lastUsed;     // For evicting the least recently used cached plan.
+    scaleMode_t scaleMode;
+    int xFactor, yFactor;  // Screen pixels per source pixel in kScaleInteger mode.
+    blitRowsFunc blitRows; // Specialized for this plan's bpp, flip, and scale mode.
+    int *columnStart;      // sourceXRes + 1 entries.
+    int *rowStart;         // sourceYRes + 1 entries.
+    uint32_t *scratchRow;  // screenXRes entries.
+    unsigned char *packedRow;  // One row in the screen's pixel format.
+    uint32_t *reversedRow; // sourceXRes entries.
+    uint32_t *decodedRow;  // sourceXRes entries.
+    uint32_t *bandRows;    // TRANSPOSE_BLOCK_SIZE rows of bandStride entries, when rotated.
+    int bandStride;        // outputXRes, rounded up to a whole block.
+
+    // Downscaling is driven by the output instead: each screen pixel samples only the
+    // source pixels that it needs.  These tables already account for flipping.
+    bool downscale;
+    int *sourceColumn;     // screenXRes entries.
+    int *sourceRow;        // screenYRes entries.
+} scalerPlan_t;
+
+// A horizontal band of one frame, rendered by a single thread.  The rows are source
+// rows when upscaling and screen rows when downscaling or rotating; either way, no two
+// bands write to the same screen rows.
+typedef struct renderSlice {
+    NDIlib_video_frame_v2_t *video_recv;
+    unsigned char *outBuf;
+    scalerPlan_t *plan;
+    int firstRow, endRow;
+    uint32_t *scratchRow;      // Per-thread scratch, screenXRes entries.
+    unsigned char *packedRow;  // Per-thread scratch, one row in the screen's pixel format.
+    uint32_t *reversedRow;     // Per-thread scratch, sourceXRes entries.
+    uint32_t *decodedRow;      // Per-thread scratch, sourceXRes entries.
+    uint32_t *bandRows;        // Per-thread scratch, TRANSPOSE_BLOCK_SIZE * bandStride entries.
+
+    // Copies finished rows to the output: streaming stores for the framebuffer itself,
+    // or a plain memcpy for an offscreen buffer that will be read back.
+    void (*copyRow)(void *destination, const void *source, size_t bytes);
+} renderSlice_t;
+
+#ifdef __linux__
+// One framebuffer device that frames are drawn to.
+typedef struct framebufferOutput {
+    const char *devicePath;
+    int fileHandle;
+    struct fb_var_screeninfo initialConfiguration;
+    struct fb_var_screeninfo activeConfiguration;
+    struct fb_fix_screeninfo fixedConfiguration;
+    unsigned char *memory;
+    unsigned char *base;             // The visible page (the first one), once configured.
+    unsigned char *activeMemory;     // Back page (page flipping only).
+    int xres, yres;
+    int bytesPerPixel;
+    int stride;                      // Bytes per row.
+    bool pageFlipping;
+    unsigned char *offscreenBuffer;  // Drawn into when not page flipping.
+    bool otherPageNeedsClear;        // Clear the page on screen once it becomes the back page.
+} framebufferOutput_t;
+#endif  // __linux__
+
 enum {
     kPTZAxisX = 1,
     kPTZAxisY,
@@ -215,19 +383,21 @@ enum {
 #if __linux__
     ioexpander_t *io_expander = NULL;
 
-    // Linux framebuffer
-    int g_framebufferFileHandle = -1;
-    struct fb_var_screeninfo g_initialFramebufferConfiguration;
-    struct fb_var_screeninfo g_framebufferActiveConfiguration;
-    struct fb_fix_screeninfo g_framebufferFixedConfiguration;
-    unsigned char *g_framebufferMemory = NULL;
-    unsigned char *g_framebufferBase = NULL;
-    unsigned char *g_framebufferActiveMemory = NULL;
+    // Linux framebuffer.  The primary output is /dev/fb0; any others (-X) mirror it.
+    framebufferOutput_t g_primaryOutput = { "/dev/fb0", -1 };
 
     int g_pig;
 
-    int g_framebufferXRes = 0, g_framebufferYRes = 0, g_NDIXRes = 0, g_NDIYRes = 0;
-    double g_xScaleFactor = 0.0, g_yScaleFactor = 0.0;
+    int g_NDIXRes = 0, g_NDIYRes = 0;
+    // Recently used scaler plans, so that switching cameras or bandwidths back and forth
+    // costs a lookup instead of a rebuild.
+    #define SCALER_PLAN_CACHE_SIZE 4
+    scalerPlan_t g_scalerPlanCache[SCALER_PLAN_CACHE_SIZE];
+    scalerPlan_t *g_scalerPlan = NULL;  // The plan for the current frame.
+    uint64_t g_scalerPlanClock = 0;
+
+    // Multiviewer mode (-M).  Zero tiles means that one camera fills the screen.
+    int g_multiviewTileCount = 0;
 
 #else  // ! __linux__
     NSWindow *g_mainWindow = nil;
@@ -258,9 +428,9 @@ int8_t g_manual_gain = 0;
 bool g_set_manual_shutter = false;
 int8_t g_manual_shutter = 0;
 
-bool g_camera_active = false;
-bool g_camera_preview = false;
-bool g_camera_malfunctioning = false;
+std::atomic<bool> g_camera_active(false);
+std::atomic<bool> g_camera_preview(false);
+std::atomic<bool> g_camera_malfunctioning(false);
 
 
 // Specs are for Marshall cameras.  Other cameras may differ.
@@ -334,6 +504,7 @@ bool g_camera_malfunctioning = false;
 struct in_addr g_visca_custom_ip;
 bool visca_use_custom_ip = false;
 int g_visca_sock = -1;
+char *g_visca_source_name = NULL;  // The NDI source whose camera g_visca_sock controls.
 int g_visca_port = 0;
 struct sockaddr_in g_visca_addr;
 bool g_visca_use_udp = false;
@@ -362,8 +533,31 @@ static void sigint_handler(int)
 
 void runUnitTests(void);
 void runLightTests(void);
+#ifdef __linux__
+void runFramebufferCopyBenchmark(void);
+#endif  // __linux__
+void selectPixelConversionKernels(void);
 bool configureScreen(NDIlib_video_frame_v2_t *video_recv);
+bool configureScreenOnce(NDIlib_video_frame_v2_t *video_recv);
+#ifdef __linux__
+bool openFramebufferOutput(framebufferOutput_t *output);
+bool addMirrorOutput(const char *spec);
+#endif  // __linux__
 bool drawFrame(NDIlib_video_frame_v2_t *video_recv);
+#ifdef __linux__
+bool renderFrame(NDIlib_video_frame_v2_t *video_recv, bool *rendered);
+void presentRenderedFrame(framebufferOutput_t *output, bool waitForVsync);
+#endif  // __linux__
+#ifdef __linux__
+void buildScalerPlan(scalerPlan_t *plan, int frameXRes, int frameYRes, int sourceStride, int fourCC,
+                     int displayXRes, int displayYRes, int bytesPerPixel, int screenStride);
+bool scalerPlanMatches(scalerPlan_t *plan, int frameXRes, int frameYRes, int sourceStride, int fourCC,
+                       int displayXRes, int displayYRes, int bytesPerPixel, int screenStride);
+bool updateScalerPlanForFrame(NDIlib_video_frame_v2_t *video_recv);
+void clearFramebufferPages(framebufferOutput_t *output);
+void freeScalerPlan(scalerPlan_t *plan);
+blitRowsFunc selectBlitter(scalerPlan_t *plan);
+#endif  // __linux__
 void *runPTZThread(void *argIgnored);
 void sendPTZUpdates(NDIlib_recv_instance_t pNDI_recv);
 motionData_t getMotionData(void);
@@ -376,11 +570,32 @@ bool source_name_compare(const char *name1, const char *name2, bool use_fallback
 bool sourceIsActiveForName(const char *source_name, receiver_array_item_t array);
 receiver_array_item_t new_receiver_array_item(void);
 void free_receiver_item(receiver_array_item_t receiver_item);
+void copySource(NDIlib_source_t *destination, const NDIlib_source_t *source);
+NDIlib_recv_instance_t createReceiver(const NDIlib_source_t *source, bool lowBandwidth);
 void *runNDIRunLoop(void *receiver_thread_data_ref);
-char *fmtbuf(uint8_t *buf, ssize_t size);
-void drawOnScreenLights(unsigned char *framebuffer_base, int xres, int yres, int bytes_per_pixel);
+#ifdef __linux__
+void startPresenterThread(void);
+void stopPresenterThread(void);
+bool submitFrameForPresentation(NDIlib_recv_instance_t receiver, NDIlib_video_frame_v2_t *video_recv);
+void retireFramesFromReceiver(NDIlib_recv_instance_t receiver);
+bool renderMultiviewTile(int tileIndex, NDIlib_video_frame_v2_t *video_recv);
+void submitPictureInPictureFrame(NDIlib_recv_instance_t receiver, NDIlib_video_frame_v2_t *video_recv);
+void renderPictureInPicture(unsigned char *renderTarget, bool outputIsFramebuffer);
+void *runMultiviewPresenterThread(void *argIgnored);
+#endif  // __linux__
+double monotonicSeconds(void);
+const char *fmtbuf(const uint8_t *buf, ssize_t size);
+void drawOnScreenLights(unsigned char *framebuffer_base, int xres, int yres, int bytes_per_pixel,
+                        ssize_t bytes_per_row, int rotation);
+#ifdef __linux__
+void drawMagnificationIndicator(unsigned char *framebuffer_base, int xres, int yres, int bytes_per_pixel,
+                                ssize_t bytes_per_row);
+#endif  // __linux__
 
 bool connectVISCA(char *stream_name, const char *context);
+void setVISCASocket(int sock);
+void resyncVISCA(void);
+void reportVISCAStats(void);
 void sendVISCALoadPreset(uint8_t presetNumber, int sock);
 void sendVISCASavePreset(uint8_t presetNumber, int sock);
 
@@ -397,6 +612,50 @@ void sendVISCASavePreset(uint8_t presetNumber, int sock);
     bool configureGPIO(void);
 #endif  // __linux__
 
+#ifdef __linux__
+// Punch-in for checking focus.  At zero, the whole frame is fitted to the screen (per -L
+// and -K).  At 1, 2, or 4, a window into the frame is shown at that many screen pixels per
+// camera pixel, and only that window is read.  The window starts in the middle of the
+// frame, and while magnified, the joystick moves it instead of the camera.
+#define MAGNIFIED_PAN_RATE 0.5          // Frame widths per second at full tilt, at 1:1.
+#define SET_BUTTON_MAGNIFY_SECONDS 1.0  // Holding the set button this long steps the level.
+
+std::atomic<int> g_magnification(0);
+std::atomic<float> g_magnifiedCenterX(0.5f), g_magnifiedCenterY(0.5f);  // Fractions of the frame.
+
+// Off, then 1:1, 2:1, and 4:1, then off again.
+int nextMagnification(int magnification) {
+    return (magnification == 0) ? 1 : (magnification >= 4) ? 0 : magnification * 2;
+}
+
+// Safe to call from a signal handler.
+void stepMagnification(void) {
+    int magnification = g_magnification;
+    if (magnification == 0) {
+        g_magnifiedCenterX = 0.5f;
+        g_magnifiedCenterY = 0.5f;
+    }
+    g_magnification = nextMagnification(magnification);
+}
+
+static void sigusr1_handler(int)
+{    stepMagnification();
+}
+
+// Moves the window with the joystick, the way the camera would pan and tilt.  (Positive
+// X is left and positive Y is up, as with NDI PTZ.)  Slower at higher magnifications.
+void panMagnifiedRegion(float xAxisPosition, float yAxisPosition) {
+    static double lastPanTime = 0;
+    double now = monotonicSeconds();
+    double elapsed = MIN(now - lastPanTime, 0.1);
+    lastPanTime = now;
+
+    double distance = elapsed * MAGNIFIED_PAN_RATE / MAX((int)g_magnification, 1);
+    g_magnifiedCenterX = (float)MIN(MAX(g_magnifiedCenterX - xAxisPosition * distance, 0.0), 1.0);
+    g_magnifiedCenterY = (float)MIN(MAX(g_magnifiedCenterY - yAxisPosition * distance, 0.0), 1.0);
+}
+#endif  // __linux__
+
 // Define to enable a hack that connects to a VISCA device at 127.0.0.1 for
 // testing custom VISCA receive code.
 #undef PTZ_TESTING
@@ -408,6 +667,13 @@ int connectToVISCAPortWithAddress(const struct sockaddr *address);
 int main(int argc, char *argv[]) {
     runUnitTests();
 
+#ifdef __linux__
+    if (argc > 1 && !strcmp(argv[1], "--benchmark")) {
+        runFramebufferCopyBenchmark();
+        return 0;
+    }
+#endif  // __linux__
+
 #ifdef USE_MRAA
     pthread_t newSoftPWMThread;
     if (pthread_create(&newSoftPWMThread, NULL, runPWMThread, NULL)) {
@@ -438,7 +704,7 @@ int main(int argc, char *argv[]) {
     address.sin_family = AF_INET;
     address.sin_port = 0;  // Set in connect method.
     inet_aton("127.0.0.1", &address.sin_addr);
-    g_visca_sock = connectToVISCAPortWithAddress((struct sockaddr *)&address);
+    setVISCASocket(connectToVISCAPortWithAddress((struct sockaddr *)&address));
 
     fprintf(stderr, "SOCK: %d\n", g_visca_sock);
 
@@ -468,6 +734,10 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Known sources (polling for 5 seconds):\n");
         stream_name = NULL;
     }
+    // The camera named last is the one that is controlled.  -M adds more to show.
+    char *stream_names[MAX_MULTIVIEW_SOURCES] = { stream_name };
+    int stream_count = 1;
+    int mirror_count = 0;
     for (int i = 1; i < argc - 1; i++) {
         if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
             fprintf(stderr, "Enabling debugging (slow).\n");
@@ -515,10 +785,113 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Using low-res mode.\n");
             use_low_res_preview = true;
         }
+        if (!strcmp(argv[i], "-l") || !strcmp(argv[i], "--low_latency")) {
+            fprintf(stderr, "Skipping stale frames for low latency.\n");
+            low_latency_mode = true;
+        }
+#if __linux__
+        if (!strcmp(argv[i], "-S") || !strcmp(argv[i], "--smooth")) {
+            fprintf(stderr, "Pacing frames to the display refresh.\n");
+            frame_pacing = true;
+        }
+#endif // __linux__
+        if (!strcmp(argv[i], "-A") || !strcmp(argv[i], "--adaptive_bandwidth")) {
+            fprintf(stderr, "Adapting the stream bandwidth to the load.\n");
+            adaptive_bandwidth = true;
+        }
+        if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--box_filter")) {
+            fprintf(stderr, "Using box filter for downscaling.\n");
+            use_box_filter = true;
+        }
+        if (!strcmp(argv[i], "-C") || !strcmp(argv[i], "--copy_frames")) {
+            fprintf(stderr, "Disabling page flipping.\n");
+            disable_page_flipping = true;
+        }
+#if __linux__
+        if (!strcmp(argv[i], "-Y") || !strcmp(argv[i], "--yuv")) {
+            fprintf(stderr, "Receiving UYVY video.\n");
+            receive_yuv = true;
+        }
+#endif // __linux__
+        if (!strcmp(argv[i], "-L") || !strcmp(argv[i], "--letterbox")) {
+            fprintf(stderr, "Preserving the aspect ratio.\n");
+            fit_mode = kFitLetterbox;
+        }
+        if (!strcmp(argv[i], "-K") || !strcmp(argv[i], "--crop")) {
+            fprintf(stderr, "Showing pixels 1:1, cropped to the screen.\n");
+            fit_mode = kFitCrop;
+        }
+        if (!strcmp(argv[i], "-T") || !strcmp(argv[i], "--render_threads")) {
+            if (argc > i + 1) {
+                render_thread_count = atoi(argv[i+1]);
+                i++;
+            }
+            fprintf(stderr, "Using %d render threads.\n", render_thread_count);
+        }
+#if __linux__
+        if (!strcmp(argv[i], "-W") || !strcmp(argv[i], "--pip")) {
+            if (argc > i + 2) {
+                pip_stream_name = argv[i+1];
+                fprintf(stderr, "Showing \"%s\" picture-in-picture.\n", pip_stream_name);
+                i++;
+            }
+        }
+        if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--pip_corner")) {
+            if (argc > i + 1) {
+                const char *corner_names[] = { "tl", "tr", "bl", "br" };
+                bool valid = false;
+                for (int corner = kCornerTopLeft; corner <= kCornerBottomRight; corner++) {
+                    if (!strcmp(argv[i+1], corner_names[corner])) {
+                        pip_corner = (screenCorner_t)corner;
+                        valid = true;
+                    }
+                }
+                if (!valid) {
+                    fprintf(stderr, "Invalid corner %s.  (Valid values: tl, tr, bl, br)\n", argv[i+1]);
+                }
+                i++;
+            }
+        }
+        if (!strcmp(argv[i], "-X") || !strcmp(argv[i], "--mirror")) {
+            if (argc > i + 1) {
+                if (addMirrorOutput(argv[i+1])) {
+                    fprintf(stderr, "Mirroring to %s.\n", argv[i+1]);
+                    mirror_count++;
+                }
+                i++;
+            }
+        }
+        if (!strcmp(argv[i], "-M") || !strcmp(argv[i], "--multiview")) {
+            if (argc > i + 2) {
+                if (stream_count < MAX_MULTIVIEW_SOURCES) {
+                    stream_names[stream_count++] = argv[i+1];
+                    fprintf(stderr, "Also showing \"%s\".\n", argv[i+1]);
+                } else {
+                    fprintf(stderr, "Too many cameras.  Not showing \"%s\".\n", argv[i+1]);
+                }
+                i++;
+            }
+        }
+#endif // __linux__
         if (!strcmp(argv[i], "-F") || !strcmp(argv[i], "--flipped")) {
             fprintf(stderr, "Flipping output\n");
             monitor_flipped = true;
         }
+#if __linux__
+        if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--rotate")) {
+            if (argc > i + 1) {
+                int requested_rotation = atoi(argv[i+1]);
+                if (requested_rotation == 0 || requested_rotation == 90 ||
+                    requested_rotation == 180 || requested_rotation == 270) {
+                    monitor_rotation = requested_rotation;
+                    fprintf(stderr, "Rotating output %d degrees.\n", monitor_rotation);
+                } else {
+                    fprintf(stderr, "Invalid rotation %d.  (Valid values: 0, 90, 180, 270)\n", requested_rotation);
+                }
+                i++;
+            }
+        }
+#endif // __linux__
         if (!strcmp(argv[i], "-V") || !strcmp(argv[i], "--enable_visca")) {
             fprintf(stderr, "Enabling VISCA-over-IP control.\n");
             enable_visca = true;
@@ -619,6 +992,8 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    selectPixelConversionKernels();
+
 #ifdef __linux__
 #ifndef DEMO_MODE
 fprintf(stderr, "Opening I/O Expander at %s\n", PIMORONI_I2C_FILENAME);
@@ -638,6 +1013,25 @@ fprintf(stderr, "Opening I/O Expander at %s\n", PIMORONI_I2C_FILENAME);
     pthread_t motionThread;
     pthread_create(&motionThread, NULL, runPTZThread, NULL);
 
+    bool multiview = (stream_count > 1);
+#ifdef __linux__
+    if (multiview) {
+        g_multiviewTileCount = stream_count;
+        if (frame_pacing) {
+            fprintf(stderr, "Frame pacing is not available in multiviewer mode.\n");
+            frame_pacing = false;
+        }
+        if (pip_stream_name != NULL) {
+            fprintf(stderr, "Picture-in-picture is not available in multiviewer mode.\n");
+            pip_stream_name = NULL;
+        }
+        if (mirror_count > 0) {
+            fprintf(stderr, "Mirror outputs are not available in multiviewer mode.\n");
+        }
+    }
+    startPresenterThread();
+#endif  // __linux__
+
 #ifndef __linux__
     dispatch_queue_t queue = dispatch_queue_create("ndi run loop", 0);
     dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(1.0 * NSEC_PER_SEC)), queue, ^{
@@ -678,6 +1072,10 @@ fprintf(stderr, "Opening I/O Expander at %s\n", PIMORONI_I2C_FILENAME);
         // Catch SIGINT so that this tool can close NDI streams properly if the user presses control-C.
         signal(SIGINT, sigint_handler);
         signal(SIGTERM, sigint_handler);
+#ifdef __linux__
+        // kill -USR1 steps through the magnification levels.
+        signal(SIGUSR1, sigusr1_handler);
+#endif  // __linux__
 
         // First, search for NDI sources on the network.
         const NDIlib_find_create_t NDI_find_create_desc = { true, NULL };
@@ -690,8 +1088,8 @@ fprintf(stderr, "Opening I/O Expander at %s\n", PIMORONI_I2C_FILENAME);
         int source_number = -1;
         time_t scanStartTime = time(NULL);
 
-        if (stream_name) {
-            fprintf(stderr, "Searching for stream \"%s\"\n", stream_name);
+        for (int stream_index = 0; stream_name != NULL && stream_index < stream_count; stream_index++) {
+            fprintf(stderr, "Searching for stream \"%s\"\n", stream_names[stream_index]);
         }
         do {
             if (enable_debugging) fprintf(stderr, "Waiting for source.\n");
@@ -700,15 +1098,22 @@ fprintf(stderr, "Opening I/O Expander at %s\n", PIMORONI_I2C_FILENAME);
             p_NDILib->NDIlib_find_wait_for_sources(pNDI_find, 1000);
             p_sources = p_NDILib->NDIlib_find_get_current_sources(pNDI_find, &no_sources);
 
-            // If the user provided the name of a stream to display, search for it specifically.
-            // Otherwise, just show a list of valid sources and exit.  Either way, iterate
-            // through the sources.
-            source_number = find_named_source(p_sources, no_sources, stream_name, false);
-            if (stream_name != NULL && source_number == -1) {
-                source_number = find_named_source(p_sources, no_sources, stream_name, true);
-            }
+            // The picture-in-picture camera, if any, comes after the others.
+            int receiver_count = stream_count + ((stream_name != NULL && pip_stream_name != NULL) ? 1 : 0);
+            for (int stream_index = 0; stream_index < receiver_count; stream_index++) {
+                bool is_pip = (stream_index == stream_count);
+                char *this_stream_name = is_pip ? pip_stream_name : stream_names[stream_index];
+
+                // If the user provided the name of a stream to display, search for it specifically.
+                // Otherwise, just show a list of valid sources and exit.  Either way, iterate
+                // through the sources.
+                source_number = find_named_source(p_sources, no_sources, this_stream_name, false);
+                if (this_stream_name != NULL && source_number == -1) {
+                    source_number = find_named_source(p_sources, no_sources, this_stream_name, true);
+                }
+
+                if (p_sources == NULL || source_number == -1) continue;
 
-            if (p_sources != NULL && source_number != -1) {
                 // See if there is already an active receiver for the exact
                 // NDI source name (which includes the IP, typically).
                 // If so, don't connect again to the same camera.  If not,
@@ -717,15 +1122,10 @@ fprintf(stderr, "Opening I/O Expander at %s\n", PIMORONI_I2C_FILENAME);
                 bool is_active = sourceIsActiveForName(found_source_name, g_active_receivers);
 
                 if (!is_active) {
-                    // Create the receiver
-                    NDIlib_recv_create_v3_t NDI_recv_create_desc = {
-                        p_sources[source_number],
-                        NDIlib_recv_color_format_BGRX_BGRA,
-                        use_low_res_preview ? NDIlib_recv_bandwidth_lowest : NDIlib_recv_bandwidth_highest,
-                        false,
-                        "NDIRec"
-                    };
-                    NDIlib_recv_instance_t pNDI_recv = NDIlib_recv_create_v3(&NDI_recv_create_desc);
+                    // Create the receiver.  Multiviewer tiles and the inset are small, so
+                    // they use the low-bandwidth streams.
+                    NDIlib_recv_instance_t pNDI_recv = createReceiver(&p_sources[source_number],
+                                                                      use_low_res_preview || multiview || is_pip);
                     if (pNDI_recv) {
                         receiver_array_item_t receiver_item = new_receiver_array_item();
                         receiver_item->receiver = pNDI_recv;
@@ -734,18 +1134,32 @@ fprintf(stderr, "Opening I/O Expander at %s\n", PIMORONI_I2C_FILENAME);
                         receiver_thread_data_t thread_data = (receiver_thread_data_t)malloc(sizeof(*thread_data));
                         thread_data->p_NDILib = p_NDILib;
                         thread_data->pNDI_recv = receiver_item->receiver;
-                        safe_asprintf(&thread_data->stream_name, "%s", stream_name);
+                        copySource(&thread_data->source, &p_sources[source_number]);
+                        safe_asprintf(&thread_data->stream_name, "%s", this_stream_name);
+                        thread_data->tileIndex = multiview ? stream_index : -1;
+                        thread_data->pictureInPicture = is_pip;
                         thread_data->running = true;
                         receiver_item->thread_data = thread_data;
                         if (pthread_create(&receiver_item->receiver_thread, NULL, runNDIRunLoop, thread_data) == 0) {
                             g_active_receivers = receiver_item;
                             fprintf(stderr, "Connected.\n");
-                            if (g_visca_sock != -1) {
-                                close(g_visca_sock);
-                                g_visca_sock = -1;
-                            }
-                            if (enable_visca) {
-                                visca_running = connectVISCA(stream_name, "1");
+                            if (stream_index == 0) {
+                                if (g_visca_sock != -1 && g_visca_use_udp && g_visca_source_name != NULL &&
+                                        !strcmp(g_visca_source_name, found_source_name)) {
+                                    // The same camera came back (after a network outage, say).
+                                    // Keep its socket, and just resynchronize sequence numbers
+                                    // instead of rediscovering it.
+                                    resyncVISCA();
+                                } else {
+                                    if (g_visca_sock != -1) {
+                                        setVISCASocket(-1);
+                                    }
+                                    if (enable_visca) {
+                                        visca_running = connectVISCA(stream_name, "1");
+                                    }
+                                    free(g_visca_source_name);
+                                    safe_asprintf(&g_visca_source_name, "%s", found_source_name);
+                                }
                             }
                         } else {
                             free_receiver_item(receiver_item);
@@ -757,6 +1171,8 @@ fprintf(stderr, "Opening I/O Expander at %s\n", PIMORONI_I2C_FILENAME);
             while (receiver_item != NULL) {
                 receiver_array_item_t next_receiver = receiver_item->next;
                 if (!receiver_item->thread_data->running) {
+                    // The receive thread may have replaced the receiver to change bandwidth.
+                    receiver_item->receiver = receiver_item->thread_data->pNDI_recv;
                     if (receiver_item->receiver != nullptr) {
                         // Clean up the NDI receiver (stops packet transmission).
 
@@ -789,6 +1205,12 @@ fprintf(stderr, "Opening I/O Expander at %s\n", PIMORONI_I2C_FILENAME);
              receiver_item != NULL; receiver_item = receiver_item->next) {
             pthread_join(receiver_item->receiver_thread, NULL);
         }
+#ifdef __linux__
+        stopPresenterThread();
+#endif  // __linux__
+        if (enable_debugging) {
+            reportVISCAStats();
+        }
 
         // Destroy the NDI finder. We needed to have access to the pointers to p_sources[0]
         p_NDILib->NDIlib_find_destroy(pNDI_find);
@@ -817,290 +1239,2800 @@ receiver_array_item_t new_receiver_array_item(void) {
     return receiver_item;
 }
 
-#pragma mark - Video rendering
+#pragma mark - Frame pacing
 
-void *runNDIRunLoop(void *receiver_thread_data_ref) {
-    receiver_thread_data_t thread_data = (receiver_thread_data_t)receiver_thread_data_ref;
-    const NDIlib_v3 *p_NDILib = thread_data->p_NDILib;
-    NDIlib_recv_instance_t pNDI_recv = thread_data->pNDI_recv;
-    char *stream_name = stream_name;
+// The presenter's view of time is CLOCK_MONOTONIC, in seconds.  NDI timestamps are in
+// 100 ns units on the sender's clock, so a frame's presentation time is its timestamp
+// plus an offset that maps the sender's clock onto ours.  The offset is the smallest
+// transit delay seen recently, so the frames that arrive soonest define the schedule
+// and the later ones are absorbed by the scheduling margin.
+#define PACING_OFFSET_WINDOW 120        // Frames per window of the minimum transit delay.
+#define PACING_MAX_TIMESTAMP_JUMP 1.0   // Seconds.  A bigger jump restarts the schedule.
+#define PACING_DEFAULT_VSYNC_PERIOD (1.0 / 60.0)
 
-    bool exit_loop = false;
-    while(!exit_loop && !exit_app) {
-        NDIlib_video_frame_v2_t video_recv;
-#ifdef ENABLE_AUDIO
-        NDIlib_audio_frame_v3_t audio_recv;
-#endif
-        NDIlib_frame_type_e frameType =
-            NDIlib_recv_capture_v3(pNDI_recv, &video_recv,
-#ifdef ENABLE_AUDIO
-                                   &audio_recv,
-#else
-                                   nullptr,
-#endif
-                                   nullptr, 1500);
-        switch(frameType) {
-            case NDIlib_frame_type_error:
-                exit_loop = true;
-                break;
-            case NDIlib_frame_type_video:
-                clock_gettime(CLOCK_REALTIME, &last_frame_time);
-                if (enable_debugging) {
-                    fprintf(stderr, "Video frame\n");
-                }
-                if (!drawFrame(&video_recv)) {
-                    // The framebuffer configuration failed.  We can't do anything.
-                    exit_loop = true;
-                }
-                NDIlib_recv_free_video_v2(pNDI_recv, &video_recv);
-                break;
-            case NDIlib_frame_type_status_change:
-                g_ptzEnabled = NDIlib_recv_ptz_is_supported(pNDI_recv);
-                break;
-#ifdef ENABLE_AUDIO
-            case NDIlib_frame_type_audio:
-                // Do something with the audio here.
-                NDIlib_recv_free_audio_v2(pNDI_recv, &audio_recv);
-#endif
-            default:
-                if (enable_debugging) {
-                    fprintf(stderr, "Unknown frame type %d.\n", frameType);
-                }
-        }
-        if (g_ptzEnabled || enable_visca) {
-#ifdef USE_AVAHI
-            if (enable_visca && !visca_use_custom_ip) {
-                int avahi_error = -1;
-                pthread_mutex_lock(&g_avahiMutex);
-                if (g_avahi_simple_poll != NULL) {
-                    avahi_error = avahi_simple_poll_iterate(g_avahi_simple_poll, 0);
-                }
-                pthread_mutex_unlock(&g_avahiMutex);
-                if (avahi_error != 0) {
-                    // Something went horribly wrong.  Just null out the references and start over.
-                    g_avahi_simple_poll = NULL;
-                    g_avahi_client = NULL;
-                    g_avahi_service_browser = NULL;
+typedef struct {
+    const void *receiver;     // The receiver whose clock this is.  Another one resets it.
+    bool valid;
+    double lastSourceTime;
+    double previousWindowMinimum;
+    double currentWindowMinimum;
+    int currentWindowCount;
+} pacingClock_t;
 
-                    visca_running = connectVISCA(stream_name, "2");
-                }
-            }
-#else
-            if (g_browseRef != NULL) {
-                DNSServiceProcessResult(g_browseRef);
-            }
-            if (g_resolveRef != NULL) {
-                DNSServiceProcessResult(g_resolveRef);
-            }
-            if (g_lookupRef != NULL) {
-                DNSServiceProcessResult(g_lookupRef);
-            }
-#endif
-            sendPTZUpdates(pNDI_recv);
-        } else {
-            if (enable_debugging) {
-                fprintf(stderr, "PTZ Disabled\n");
-            }
-        }
-    }
-    return NULL;
+typedef struct {
+    uint64_t framesShown;
+    uint64_t framesDropped;
+    uint64_t vsyncsRepeated;
+    uint64_t intervals;       // Pairs of consecutive frames that the statistics cover.
+    double sumAbsoluteError;
+    double sumSquaredError;
+    double maxAbsoluteError;
+    double lastDisplayTime;
+    double lastSourceTime;
+    bool haveLastFrame;
+} pacingStats_t;
+
+void resetPacingClock(pacingClock_t *clock) {
+    memset(clock, 0, sizeof(*clock));
 }
 
-bool configureScreen(NDIlib_video_frame_v2_t *video_recv) {
-    static bool configured = false;
-    if (configured) return true;
-    configured = true;
+// Picks the time on the sender's clock for a frame: its timestamp if the sender set
+// one, then its timecode, and otherwise the time it arrived (no pacing).
+double frameSourceTime(int64_t timestamp, int64_t timecode, double arrivalTime) {
+    if (timestamp != NDIlib_recv_timestamp_undefined && timestamp != 0) {
+        return timestamp / 10000000.0;
+    }
+    if (timecode != INT64_MAX && timecode != 0) {
+        return timecode / 10000000.0;
+    }
+    return arrivalTime;
+}
 
-#ifdef __linux__
-    // Read the current framebuffer settings so that we can restore them later.
-    int framebufferMemoryOffset = 0;
-    int zero = 0;
-    g_framebufferFileHandle = open("/dev/fb0", O_RDWR);
-    if (g_framebufferFileHandle == -1) {
-        perror("cameracontroller: open");
-        goto fail;
+// Feeds one frame into the clock and returns the offset from the sender's clock to ours.
+double updatePacingClock(pacingClock_t *clock, const void *receiver, double sourceTime, double arrivalTime) {
+    double delay = arrivalTime - sourceTime;
+    if (!clock->valid || clock->receiver != receiver || sourceTime < clock->lastSourceTime ||
+        sourceTime - clock->lastSourceTime > PACING_MAX_TIMESTAMP_JUMP) {
+        clock->valid = true;
+        clock->receiver = receiver;
+        clock->previousWindowMinimum = delay;
+        clock->currentWindowMinimum = delay;
+        clock->currentWindowCount = 0;
     }
-    if (ioctl(g_framebufferFileHandle, FBIOGET_VSCREENINFO, &g_initialFramebufferConfiguration) == -1) {
-        perror("cameracontroller: FBIOGET_VSCREENINFO");
-        goto fail;
+    clock->lastSourceTime = sourceTime;
+
+    // Keep the minimum over the current and previous windows, so that a change in the
+    // network path (or drift between the two clocks) is picked up within two windows.
+    if (delay < clock->currentWindowMinimum) {
+        clock->currentWindowMinimum = delay;
     }
-    if (ioctl(g_framebufferFileHandle, FBIOGET_FSCREENINFO, &g_framebufferFixedConfiguration) == -1) {
-        perror("cameracontroller: FBIOGET_FSCREENINFO");
-        goto fail;
+    if (++clock->currentWindowCount >= PACING_OFFSET_WINDOW) {
+        clock->previousWindowMinimum = clock->currentWindowMinimum;
+        clock->currentWindowMinimum = delay;
+        clock->currentWindowCount = 0;
     }
-    if (g_framebufferFixedConfiguration.type != FB_TYPE_PACKED_PIXELS) {
-        fprintf(stderr, "Error: Only packed pixel framebuffers are supported.\n");
-        goto fail;
+    return fmin(clock->previousWindowMinimum, clock->currentWindowMinimum);
+}
+
+// Frames are due one and a half refreshes after the soonest they could have arrived,
+// so a frame is picked at the first vertical blank at least half a refresh after that.
+// That lets frames arrive up to half a refresh late without disturbing the schedule.
+// Compared with drawing each frame as it arrives, it adds half a refresh of latency on
+// average, and never more than one.
+double pacedPresentationTime(double sourceTime, double offset, double vsyncPeriod) {
+    return sourceTime + offset + (vsyncPeriod * 1.5);
+}
+
+// Returns the index of the newest frame that is due by the deadline (the time at which
+// the next refresh starts), or -1 to repeat the frame that is already on the screen.
+// Frames are in arrival order, and any due frames before the chosen one are dropped.
+int choosePacedFrame(const double *presentationTimes, int count, double deadline) {
+    int chosen = -1;
+    for (int i = 0; i < count; i++) {
+        if (presentationTimes[i] <= deadline) {
+            chosen = i;
+        }
     }
+    return chosen;
+}
 
-    framebufferMemoryOffset = (unsigned long)(g_framebufferFixedConfiguration.smem_start) & (~PAGE_MASK);
-    g_framebufferMemory = (unsigned char *)mmap(NULL, g_framebufferFixedConfiguration.smem_len + framebufferMemoryOffset, PROT_READ | PROT_WRITE, MAP_SHARED, g_framebufferFileHandle, 0);
-    if ((long)g_framebufferMemory == -1L) {
-        perror("cameracontroller: mmap");
-        goto fail;
+// Estimates the refresh period from the display timings, for use until there are
+// vertical blanks to measure.
+double vsyncPeriodForTimings(uint32_t pixclock, uint32_t xres, uint32_t left_margin, uint32_t right_margin,
+                             uint32_t hsync_len, uint32_t yres, uint32_t upper_margin, uint32_t lower_margin,
+                             uint32_t vsync_len) {
+    // pixclock is in picoseconds.  Many drivers leave the timings zeroed.
+    double pixelsPerFrame = (double)(xres + left_margin + right_margin + hsync_len) *
+                            (double)(yres + upper_margin + lower_margin + vsync_len);
+    double period = pixclock * pixelsPerFrame / 1e12;
+    if (pixclock == 0 || period < 1.0 / 240.0 || period > 1.0 / 20.0) {
+        return PACING_DEFAULT_VSYNC_PERIOD;
     }
+    return period;
+}
 
-    g_framebufferActiveConfiguration = g_initialFramebufferConfiguration;
-    g_framebufferActiveConfiguration.xoffset = 0;
-    g_framebufferActiveConfiguration.yoffset = 0;
+// Refines the refresh period from the time between two vertical blank waits.  A wait
+// that spans several refreshes (because drawing ran long) still counts, divided by the
+// number of refreshes that it covered.
+double updateVsyncPeriodEstimate(double period, double interval) {
+    double refreshes = round(interval / period);
+    if (refreshes < 1 || refreshes > 4) {
+        return period;
+    }
+    double sample = interval / refreshes;
+    if (fabs(sample - period) > period * 0.1) {
+        return period;
+    }
+    return period + (sample - period) / 32;
+}
 
-    monitor_bytes_per_pixel = g_framebufferActiveConfiguration.bits_per_pixel / 8;
-    g_framebufferXRes = g_framebufferActiveConfiguration.xres;
-    g_framebufferYRes = g_framebufferActiveConfiguration.yres;
-    g_NDIXRes = video_recv->xres;
-    g_NDIYRes = video_recv->yres;
+// Records that the frame with the given source time will be shown at displayTime.
+// The error is how far the time between it and the previous frame on the screen
+// differs from the time between them at the camera, and any refreshes in between
+// (within the same stream) count as repeats.
+void recordPacedFrame(pacingStats_t *stats, double sourceTime, double displayTime, double vsyncPeriod) {
+    stats->framesShown++;
+    if (stats->haveLastFrame) {
+        double sourceInterval = sourceTime - stats->lastSourceTime;
+        if (sourceInterval > 0 && sourceInterval < PACING_MAX_TIMESTAMP_JUMP) {
+            double displayInterval = displayTime - stats->lastDisplayTime;
+            double refreshes = round(displayInterval / vsyncPeriod);
+            if (refreshes > 1) {
+                stats->vsyncsRepeated += (uint64_t)refreshes - 1;
+            }
+            double error = fabs(displayInterval - sourceInterval);
+            stats->intervals++;
+            stats->sumAbsoluteError += error;
+            stats->sumSquaredError += error * error;
+            if (error > stats->maxAbsoluteError) {
+                stats->maxAbsoluteError = error;
+            }
+        }
+    }
+    stats->lastSourceTime = sourceTime;
+    stats->lastDisplayTime = displayTime;
+    stats->haveLastFrame = true;
+}
 
-    g_xScaleFactor = ((double)(g_framebufferXRes) / (double)(g_NDIXRes));
-    g_yScaleFactor = ((double)(g_framebufferYRes) / (double)(g_NDIYRes));
+void printPacingStats(const pacingStats_t *stats, double vsyncPeriod) {
+    double meanError = stats->intervals ? stats->sumAbsoluteError / stats->intervals : 0;
+    double rmsError = stats->intervals ? sqrt(stats->sumSquaredError / stats->intervals) : 0;
+    fprintf(stderr, "Pacing: %.3f Hz  shown: %llu  repeated: %llu  dropped: %llu  "
+            "jitter mean: %.2f ms  rms: %.2f ms  max: %.2f ms\n",
+            1.0 / vsyncPeriod,
+            (unsigned long long)stats->framesShown,
+            (unsigned long long)stats->vsyncsRepeated,
+            (unsigned long long)stats->framesDropped,
+            meanError * 1000, rmsError * 1000, stats->maxAbsoluteError * 1000);
+}
 
-    fprintf(stderr, "NDI Xres: %d, Yres: %d\n", video_recv->xres, video_recv->yres);
-    fprintf(stderr, "Xres: %d, Yres: %d, bpp: %d\n", g_framebufferActiveConfiguration.xres,
-            g_framebufferActiveConfiguration.yres, g_framebufferActiveConfiguration.bits_per_pixel);
+#pragma mark - Frame presentation
 
-    if (ioctl(g_framebufferFileHandle, FBIOPAN_DISPLAY, &g_framebufferActiveConfiguration) == -1) {
-        perror("cameracontroller: FBIOPAN_DISPLAY (2)");
-        munmap(g_framebufferMemory, g_framebufferFixedConfiguration.smem_len);
-        goto fail;
+#ifdef __linux__
+    // Frames travel from the NDI receive threads to a single presenter thread through a
+    // one-slot mailbox.  Depositing a frame replaces (and immediately returns to NDI)
+    // any frame the presenter hasn't picked up yet, so a slow draw or a long wait for
+    // the vertical blank never backs up the receive queue, and the frame on screen is
+    // never more than one frame behind the newest one received.
+    //
+    // With -S, frames go into a short queue instead, and the presenter wakes at every
+    // vertical blank and picks the frame that is due for the next one (see Frame pacing).
+    typedef struct pendingFrame {
+        NDIlib_recv_instance_t receiver;
+        NDIlib_video_frame_v2_t video_recv;
+        double sourceTime;        // Only used with -S.
+        double presentationTime;  // Only used with -S.
+    } pendingFrame_t;
+
+    #define PACED_FRAME_QUEUE_SIZE 4
+
+    std::atomic<pendingFrame_t *> g_frameMailbox(NULL);
+    sem_t g_frameMailboxSemaphore;  // Posted when the mailbox goes from empty to full.
+    pthread_mutex_t g_presenterMutex = PTHREAD_MUTEX_INITIALIZER;  // Held while a frame is drawn.
+    pthread_t g_presenterThread;
+    bool g_presenterRunning = false;
+    std::atomic<bool> g_presentationFailed(false);
+
+    std::atomic<uint64_t> g_framesPresented(0);
+    std::atomic<uint64_t> g_framesDropped(0);
+
+    // The picture-in-picture camera has a mailbox of its own.  Whenever the presenter
+    // draws a main frame, it takes the newest inset frame, if there is one, and keeps it
+    // (in g_pictureInPictureFrame) to draw again until a newer one arrives.  The inset
+    // never causes a main frame to be drawn or waits for one.
+    std::atomic<pendingFrame_t *> g_pictureInPictureMailbox(NULL);
+    pendingFrame_t *g_pictureInPictureFrame = NULL;  // Protected by g_presenterMutex.
+
+    // The paced queue, oldest frame first, and everything below it are protected by
+    // g_pacedFrameMutex.
+    pthread_mutex_t g_pacedFrameMutex = PTHREAD_MUTEX_INITIALIZER;
+    pendingFrame_t *g_pacedFrames[PACED_FRAME_QUEUE_SIZE];
+    int g_pacedFrameCount = 0;
+    pacingClock_t g_pacingClock;
+    pacingStats_t g_pacingStats;
+    double g_vsyncPeriod = PACING_DEFAULT_VSYNC_PERIOD;
+
+    // Pending frame records come from a small preallocated pool, so that handing a frame to
+    // the presenter allocates nothing.  The pool covers every record that can be in use at
+    // once (a full paced queue, or a mailbox, plus the frame being drawn and the one being
+    // submitted, and the same for picture-in-picture).  If it somehow runs dry, records
+    // are malloced instead.
+    #define PENDING_FRAME_POOL_SIZE (PACED_FRAME_QUEUE_SIZE + 6)
+
+    pendingFrame_t g_pendingFramePool[PENDING_FRAME_POOL_SIZE];
+    pendingFrame_t *g_freePendingFrames[PENDING_FRAME_POOL_SIZE];
+    int g_freePendingFrameCount = 0;
+    int g_pendingFramesNeverUsed = PENDING_FRAME_POOL_SIZE;
+    pthread_mutex_t g_pendingFramePoolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+    pendingFrame_t *newPendingFrame(NDIlib_recv_instance_t receiver, NDIlib_video_frame_v2_t *video_recv) {
+        pendingFrame_t *frame = NULL;
+        pthread_mutex_lock(&g_pendingFramePoolMutex);
+        if (g_freePendingFrameCount > 0) {
+            frame = g_freePendingFrames[--g_freePendingFrameCount];
+        } else if (g_pendingFramesNeverUsed > 0) {
+            frame = &g_pendingFramePool[--g_pendingFramesNeverUsed];
+        }
+        pthread_mutex_unlock(&g_pendingFramePoolMutex);
+        if (frame == NULL) {
+            frame = (pendingFrame_t *)malloc(sizeof(*frame));
+        }
+        frame->receiver = receiver;
+        frame->video_recv = *video_recv;
+        return frame;
     }
 
-    g_framebufferBase = g_framebufferMemory + framebufferMemoryOffset;
-    g_framebufferActiveMemory = g_framebufferMemory + framebufferMemoryOffset + (g_initialFramebufferConfiguration.yres * g_initialFramebufferConfiguration.xres * (g_initialFramebufferConfiguration.bits_per_pixel / 8));
-    return true;
+    void discardPendingFrame(pendingFrame_t *frame) {
+        NDIlib_recv_free_video_v2(frame->receiver, &frame->video_recv);
+        if (frame >= g_pendingFramePool && frame < g_pendingFramePool + PENDING_FRAME_POOL_SIZE) {
+            pthread_mutex_lock(&g_pendingFramePoolMutex);
+            g_freePendingFrames[g_freePendingFrameCount++] = frame;
+            pthread_mutex_unlock(&g_pendingFramePoolMutex);
+        } else {
+            free(frame);
+        }
+    }
 
-  fail:
-    if (ioctl(g_framebufferFileHandle, FBIOPUT_VSCREENINFO, &g_initialFramebufferConfiguration) == -1) {
-        perror("cameracontroller: FBIOPUT_VSCREENINFO");
+    // Puts a frame back in a mailbox that it was taken out of, unless a newer frame has
+    // arrived meanwhile, in which case the newer one wins and this one is dropped.
+    // Returns true if the frame was dropped.
+    bool restorePendingFrame(std::atomic<pendingFrame_t *> *mailbox, pendingFrame_t *frame) {
+        pendingFrame_t *expected = NULL;
+        if (mailbox->compare_exchange_strong(expected, frame)) {
+            return false;
+        }
+        discardPendingFrame(frame);
+        return true;
     }
-    if (ioctl(g_framebufferFileHandle, FBIOGET_FSCREENINFO, &g_framebufferFixedConfiguration) == -1) {
-        perror("cameracontroller: FBIOGET_FSCREENINFO");
+
+    void printFrameCounters(void) {
+        fprintf(stderr, "Frames presented: %llu  dropped: %llu\n",
+                (unsigned long long)g_framesPresented.load(),
+                (unsigned long long)g_framesDropped.load());
+    }
+
+    void *runPresenterThread(void *argIgnored) {
+        while (true) {
+            sem_wait(&g_frameMailboxSemaphore);
+            if (exit_app) break;
+
+            pthread_mutex_lock(&g_presenterMutex);
+            pendingFrame_t *frame = g_frameMailbox.exchange(NULL);
+            if (frame != NULL) {
+                if (!drawFrame(&frame->video_recv)) {
+                    // The framebuffer configuration failed.  We can't do anything.
+                    g_presentationFailed = true;
+                } else {
+                    uint64_t presented = ++g_framesPresented;
+                    if (enable_verbose_debugging && (presented % 300) == 0) {
+                        printFrameCounters();
+                    }
+                }
+                discardPendingFrame(frame);
+            }
+            pthread_mutex_unlock(&g_presenterMutex);
+        }
+        return NULL;
+    }
+
+    // Removes the first count frames from the paced queue.  The caller holds g_pacedFrameMutex.
+    void removePacedFrames(int count) {
+        memmove(&g_pacedFrames[0], &g_pacedFrames[count], (g_pacedFrameCount - count) * sizeof(g_pacedFrames[0]));
+        g_pacedFrameCount -= count;
+    }
+
+    void sleepUntil(double when) {
+        struct timespec wakeTime;
+        wakeTime.tv_sec = (time_t)when;
+        wakeTime.tv_nsec = (long)((when - wakeTime.tv_sec) * 1000000000.0);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeTime, NULL) == EINTR);
+    }
+
+    void *runPacedPresenterThread(void *argIgnored) {
+        bool vsyncSupported = true;
+        bool periodFromTimings = false;
+        bool copyPending = false;  // Without page flipping, the copy waits for the next blank.
+        double vsyncPeriod = PACING_DEFAULT_VSYNC_PERIOD;
+        double lastVsyncTime = 0;
+
+        while (!exit_app) {
+            // With nothing to show, sleep until a frame arrives instead of every refresh.
+            pthread_mutex_lock(&g_pacedFrameMutex);
+            bool idle = (g_pacedFrameCount == 0);
+            pthread_mutex_unlock(&g_pacedFrameMutex);
+            if (idle && !copyPending) {
+                sem_wait(&g_frameMailboxSemaphore);
+                lastVsyncTime = 0;
+                continue;
+            }
+            while (sem_trywait(&g_frameMailboxSemaphore) == 0);
+
+            // The screen isn't set up until the first frame is drawn, so until then (or if
+            // the driver can't wait for the vertical blank), keep time by the estimate.
+            if (g_primaryOutput.base != NULL && !periodFromTimings) {
+                vsyncPeriod = vsyncPeriodForTimings(g_primaryOutput.activeConfiguration.pixclock,
+                    g_primaryOutput.activeConfiguration.xres, g_primaryOutput.activeConfiguration.left_margin,
+                    g_primaryOutput.activeConfiguration.right_margin, g_primaryOutput.activeConfiguration.hsync_len,
+                    g_primaryOutput.activeConfiguration.yres, g_primaryOutput.activeConfiguration.upper_margin,
+                    g_primaryOutput.activeConfiguration.lower_margin, g_primaryOutput.activeConfiguration.vsync_len);
+                periodFromTimings = true;
+            }
+            bool waited = false;
+            if (g_primaryOutput.base != NULL && vsyncSupported) {
+                int zero = 0;
+                if (ioctl(g_primaryOutput.fileHandle, FBIO_WAITFORVSYNC, &zero) == -1) {
+                    if (enable_debugging) perror("cameracontroller:  FBIO_WAITFORVSYNC");
+                    vsyncSupported = false;
+                } else {
+                    waited = true;
+                }
+            }
+            double vsyncTime;
+            if (waited) {
+                vsyncTime = monotonicSeconds();
+                if (lastVsyncTime != 0) {
+                    vsyncPeriod = updateVsyncPeriodEstimate(vsyncPeriod, vsyncTime - lastVsyncTime);
+                }
+            } else {
+                double now = monotonicSeconds();
+                vsyncTime = (lastVsyncTime == 0) ? now : lastVsyncTime + vsyncPeriod;
+                if (vsyncTime < now - vsyncPeriod) {
+                    vsyncTime = now;  // Fell behind.  Don't try to catch up.
+                }
+                sleepUntil(vsyncTime);
+            }
+            lastVsyncTime = vsyncTime;
+
+            pthread_mutex_lock(&g_presenterMutex);
+            if (copyPending) {
+                presentRenderedFrame(&g_primaryOutput, false);
+                copyPending = false;
+            }
+
+            pthread_mutex_lock(&g_pacedFrameMutex);
+            g_vsyncPeriod = vsyncPeriod;
+            double presentationTimes[PACED_FRAME_QUEUE_SIZE];
+            for (int i = 0; i < g_pacedFrameCount; i++) {
+                presentationTimes[i] = g_pacedFrames[i]->presentationTime;
+            }
+            double displayTime = vsyncTime + vsyncPeriod;
+            int chosen = choosePacedFrame(presentationTimes, g_pacedFrameCount, displayTime);
+            pendingFrame_t *frame = NULL;
+            if (chosen >= 0) {
+                for (int i = 0; i < chosen; i++) {
+                    discardPendingFrame(g_pacedFrames[i]);
+                    g_framesDropped++;
+                    g_pacingStats.framesDropped++;
+                }
+                frame = g_pacedFrames[chosen];
+                removePacedFrames(chosen + 1);
+            }
+            pthread_mutex_unlock(&g_pacedFrameMutex);
+
+            if (frame != NULL) {
+                bool rendered;
+                if (!renderFrame(&frame->video_recv, &rendered)) {
+                    // The framebuffer configuration failed.  We can't do anything.
+                    g_presentationFailed = true;
+                } else if (rendered) {
+                    if (g_primaryOutput.pageFlipping) {
+                        presentRenderedFrame(&g_primaryOutput, false);
+                    } else {
+                        copyPending = true;
+                    }
+                    pthread_mutex_lock(&g_pacedFrameMutex);
+                    recordPacedFrame(&g_pacingStats, frame->sourceTime, displayTime, vsyncPeriod);
+                    pthread_mutex_unlock(&g_pacedFrameMutex);
+
+                    uint64_t presented = ++g_framesPresented;
+                    if (enable_verbose_debugging && (presented % 300) == 0) {
+                        printFrameCounters();
+                        printPacingStats(&g_pacingStats, vsyncPeriod);
+                    }
+                }
+                discardPendingFrame(frame);
+            }
+            pthread_mutex_unlock(&g_presenterMutex);
+        }
+        return NULL;
+    }
+
+    void startPresenterThread(void) {
+        sem_init(&g_frameMailboxSemaphore, 0, 0);
+        void *(*presenter)(void *) = runPresenterThread;
+        if (g_multiviewTileCount > 0) {
+            presenter = runMultiviewPresenterThread;
+        } else if (frame_pacing) {
+            presenter = runPacedPresenterThread;
+        }
+        if (pthread_create(&g_presenterThread, NULL, presenter, NULL)) {
+            perror("cameracontroller: could not create presenter thread");
+            return;
+        }
+        g_presenterRunning = true;
+    }
+
+    void stopPresenterThread(void) {
+        if (!g_presenterRunning) return;
+
+        // exit_app is already set; wake the presenter so that it notices.
+        sem_post(&g_frameMailboxSemaphore);
+        pthread_join(g_presenterThread, NULL);
+        g_presenterRunning = false;
+
+        if (enable_debugging) {
+            printFrameCounters();
+            if (frame_pacing) {
+                printPacingStats(&g_pacingStats, g_vsyncPeriod);
+            }
+        }
+    }
+
+    // Hands a captured frame to the presenter.  The presenter takes ownership of the
+    // frame and frees it.  Returns false if the screen could not be configured.
+    bool submitFrameForPresentation(NDIlib_recv_instance_t receiver, NDIlib_video_frame_v2_t *video_recv) {
+        if (!g_presenterRunning) {
+            bool success = drawFrame(video_recv);
+            NDIlib_recv_free_video_v2(receiver, video_recv);
+            return success;
+        }
+
+        pendingFrame_t *frame = newPendingFrame(receiver, video_recv);
+
+        if (frame_pacing) {
+            double arrivalTime = monotonicSeconds();
+            frame->sourceTime = frameSourceTime(video_recv->timestamp, video_recv->timecode, arrivalTime);
+
+            pthread_mutex_lock(&g_pacedFrameMutex);
+            double offset = updatePacingClock(&g_pacingClock, receiver, frame->sourceTime, arrivalTime);
+            frame->presentationTime = pacedPresentationTime(frame->sourceTime, offset, g_vsyncPeriod);
+            if (g_pacedFrameCount == PACED_FRAME_QUEUE_SIZE) {
+                // The presenter has fallen behind.  Give the oldest frame back to NDI.
+                discardPendingFrame(g_pacedFrames[0]);
+                removePacedFrames(1);
+                g_framesDropped++;
+                g_pacingStats.framesDropped++;
+            }
+            g_pacedFrames[g_pacedFrameCount++] = frame;
+            pthread_mutex_unlock(&g_pacedFrameMutex);
+
+            sem_post(&g_frameMailboxSemaphore);
+            return !g_presentationFailed;
+        }
+
+        pendingFrame_t *supersededFrame = g_frameMailbox.exchange(frame);
+        if (supersededFrame != NULL) {
+            discardPendingFrame(supersededFrame);
+            g_framesDropped++;
+        } else {
+            sem_post(&g_frameMailboxSemaphore);
+        }
+        return !g_presentationFailed;
+    }
+
+    void submitPictureInPictureFrame(NDIlib_recv_instance_t receiver, NDIlib_video_frame_v2_t *video_recv) {
+        pendingFrame_t *frame = newPendingFrame(receiver, video_recv);
+        pendingFrame_t *supersededFrame = g_pictureInPictureMailbox.exchange(frame);
+        if (supersededFrame != NULL) {
+            discardPendingFrame(supersededFrame);
+        }
+    }
+
+    // Makes sure that neither the mailboxes nor the presenter still hold a frame from
+    // a receiver that is about to be destroyed.
+    void retireFramesFromReceiver(NDIlib_recv_instance_t receiver) {
+        pthread_mutex_lock(&g_presenterMutex);
+        pendingFrame_t *frame = g_frameMailbox.exchange(NULL);
+        if (frame != NULL) {
+            if (frame->receiver == receiver) {
+                discardPendingFrame(frame);
+            } else if (restorePendingFrame(&g_frameMailbox, frame)) {
+                g_framesDropped++;
+            }
+        }
+
+        pthread_mutex_lock(&g_pacedFrameMutex);
+        int keptFrameCount = 0;
+        for (int i = 0; i < g_pacedFrameCount; i++) {
+            if (g_pacedFrames[i]->receiver == receiver) {
+                discardPendingFrame(g_pacedFrames[i]);
+            } else {
+                g_pacedFrames[keptFrameCount++] = g_pacedFrames[i];
+            }
+        }
+        g_pacedFrameCount = keptFrameCount;
+        pthread_mutex_unlock(&g_pacedFrameMutex);
+
+        frame = g_pictureInPictureMailbox.exchange(NULL);
+        if (frame != NULL) {
+            if (frame->receiver == receiver) {
+                discardPendingFrame(frame);
+            } else {
+                restorePendingFrame(&g_pictureInPictureMailbox, frame);
+            }
+        }
+        if (g_pictureInPictureFrame != NULL && g_pictureInPictureFrame->receiver == receiver) {
+            discardPendingFrame(g_pictureInPictureFrame);
+            g_pictureInPictureFrame = NULL;
+        }
+        pthread_mutex_unlock(&g_presenterMutex);
+    }
+#endif  // __linux__
+
+#pragma mark - Adaptive bandwidth
+
+// With -A, each receive thread measures how well the controller is keeping up and
+// moves the camera between its high- and low-bandwidth streams.  It steps down after
+// several bad intervals in a row, and steps back up only after a much longer run of
+// good ones (or as soon as the tally says that the camera is live).  Each step up that
+// quickly turns out to be a mistake doubles the wait before the next one.
+
+#define ADAPTIVE_BANDWIDTH_INTERVAL 2.0            // Seconds per measurement.
+#define ADAPTIVE_BANDWIDTH_STEP_DOWN_INTERVALS 3   // Bad intervals in a row before stepping down.
+#define ADAPTIVE_BANDWIDTH_STEP_UP_INTERVALS 15    // Good intervals in a row before stepping up.
+#define ADAPTIVE_BANDWIDTH_MAX_BACKOFF 8           // Limit on the step-up wait multiplier.
+#define ADAPTIVE_BANDWIDTH_MIN_DWELL 10.0          // Seconds after a switch before the next one.
+#define ADAPTIVE_BANDWIDTH_SETTLED 120.0           // Seconds at high bandwidth that forgive past failures.
+#define ADAPTIVE_BANDWIDTH_MAX_QUEUED_FRAMES 2     // More than this waiting inside NDI is a backlog.
+#define THERMAL_THROTTLE_MILLIDEGREES 80000        // The Raspberry Pi starts throttling at 80C.
+#define THERMAL_HEADROOM_MILLIDEGREES 70000
+
+// What happened during one measurement interval.
+typedef struct {
+    double elapsed;       // Seconds.
+    int framesReceived;
+    int framesDropped;    // Replaced by newer frames before they could be drawn.
+    int queuedFrames;     // Video frames waiting inside NDI at the end of the interval.
+    int temperature;      // CPU temperature in millidegrees C, or -1 if unknown.
+    bool live;            // On program or preview, according to the tally.
+} bandwidthSample_t;
+
+typedef struct {
+    bool lowBandwidth;
+    int badIntervals, goodIntervals;
+    int backoff;          // Multiplies ADAPTIVE_BANDWIDTH_STEP_UP_INTERVALS.
+    double sinceSwitch;   // Seconds.
+    bool probing;         // Stepped up, and not yet at high bandwidth for long enough to trust it.
+    const char *reason;   // Why the last switch happened.
+} adaptiveBandwidth_t;
+
+void initAdaptiveBandwidth(adaptiveBandwidth_t *state, bool lowBandwidth) {
+    bzero(state, sizeof(*state));
+    state->lowBandwidth = lowBandwidth;
+    state->backoff = 1;
+    state->sinceSwitch = ADAPTIVE_BANDWIDTH_MIN_DWELL;
+}
+
+// Feeds one interval's measurements into the state machine.  Returns true if the
+// receiver should switch streams; state->lowBandwidth is then the new setting.
+bool updateAdaptiveBandwidth(adaptiveBandwidth_t *state, const bandwidthSample_t *sample) {
+    state->sinceSwitch += sample->elapsed;
+
+    bool overheated = sample->temperature >= THERMAL_THROTTLE_MILLIDEGREES;
+    bool cool = sample->temperature < THERMAL_HEADROOM_MILLIDEGREES;
+    bool backlogged = sample->queuedFrames > ADAPTIVE_BANDWIDTH_MAX_QUEUED_FRAMES;
+    bool droppingFrames = sample->framesDropped * 5 > sample->framesReceived;  // Over 20%.
+    bool keepingUp = sample->framesReceived > 0 && sample->queuedFrames == 0 &&
+                     sample->framesDropped * 50 <= sample->framesReceived;    // 2% or less.
+
+    // While the camera is live, only heat can push the picture down to low bandwidth.
+    bool bad = overheated || (!sample->live && (backlogged || droppingFrames));
+    bool good = cool && keepingUp;
+    state->badIntervals = bad ? state->badIntervals + 1 : 0;
+    state->goodIntervals = good ? state->goodIntervals + 1 : 0;
+
+    if (!state->lowBandwidth && state->probing && state->sinceSwitch >= ADAPTIVE_BANDWIDTH_SETTLED) {
+        state->probing = false;
+        state->backoff = 1;
+    }
+    if (state->sinceSwitch < ADAPTIVE_BANDWIDTH_MIN_DWELL) {
+        return false;
+    }
+
+    if (!state->lowBandwidth && state->badIntervals >= ADAPTIVE_BANDWIDTH_STEP_DOWN_INTERVALS) {
+        if (state->probing) {
+            state->backoff = MIN(state->backoff * 2, ADAPTIVE_BANDWIDTH_MAX_BACKOFF);
+        }
+        state->lowBandwidth = true;
+        state->probing = false;
+        state->reason = overheated ? "overheating" : "falling behind";
+    } else if (state->lowBandwidth && !overheated &&
+               (sample->live || state->goodIntervals >= ADAPTIVE_BANDWIDTH_STEP_UP_INTERVALS * state->backoff)) {
+        state->lowBandwidth = false;
+        state->probing = true;
+        state->reason = sample->live ? "camera is live" : "keeping up";
+    } else {
+        return false;
+    }
+    state->badIntervals = 0;
+    state->goodIntervals = 0;
+    state->sinceSwitch = 0;
+    return true;
+}
+
+// Returns the CPU temperature in millidegrees C, or -1 if there's no way to tell.
+int readCPUTemperature(void) {
+    int temperature = -1;
+    FILE *fp = fopen("/sys/class/thermal/thermal_zone0/temp", "r");
+    if (fp != NULL) {
+        if (fscanf(fp, "%d", &temperature) != 1) {
+            temperature = -1;
+        }
+        fclose(fp);
+    }
+    return temperature;
+}
+
+double monotonicSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1000000000.0);
+}
+
+// Per-thread bookkeeping for the current measurement interval.
+typedef struct {
+    adaptiveBandwidth_t state;
+    double intervalStart;
+    int framesReceived;
+    int framesSkipped;    // Stale frames that low-latency mode threw away.
+    uint64_t framesDroppedAtStart;
+} bandwidthMonitor_t;
+
+uint64_t droppedFrameCount(void) {
+#ifdef __linux__
+    return g_framesDropped;
+#else  // ! __linux__
+    return 0;  // The Mac draws every frame inline.
+#endif  // __linux__
+}
+
+void startBandwidthMonitor(bandwidthMonitor_t *monitor) {
+    initAdaptiveBandwidth(&monitor->state, use_low_res_preview);
+    monitor->intervalStart = monotonicSeconds();
+    monitor->framesReceived = 0;
+    monitor->framesSkipped = 0;
+    monitor->framesDroppedAtStart = droppedFrameCount();
+}
+
+// Replaces the thread's receiver with one for the other stream.  On failure, keeps
+// the old receiver and returns it.
+NDIlib_recv_instance_t reconnectReceiver(receiver_thread_data_t thread_data, bool lowBandwidth) {
+    NDIlib_recv_instance_t oldReceiver = thread_data->pNDI_recv;
+    NDIlib_recv_instance_t newReceiver = createReceiver(&thread_data->source, lowBandwidth);
+    if (newReceiver == NULL) {
+        fprintf(stderr, "Could not reconnect to \"%s\".\n", thread_data->source.p_ndi_name);
+        return oldReceiver;
+    }
+#ifdef __linux__
+    retireFramesFromReceiver(oldReceiver);
+#endif  // __linux__
+    thread_data->p_NDILib->NDIlib_recv_destroy(oldReceiver);
+    thread_data->pNDI_recv = newReceiver;
+    return newReceiver;
+}
+
+// Called once per pass through the receive loop with the number of video frames captured,
+// and how many of those were skipped as stale.  Returns the receiver to use from now on.
+NDIlib_recv_instance_t checkAdaptiveBandwidth(receiver_thread_data_t thread_data, bandwidthMonitor_t *monitor,
+                                              int framesReceived, int framesSkipped) {
+    monitor->framesReceived += framesReceived;
+    monitor->framesSkipped += framesSkipped;
+
+    double now = monotonicSeconds();
+    if (now - monitor->intervalStart < ADAPTIVE_BANDWIDTH_INTERVAL) {
+        return thread_data->pNDI_recv;
+    }
+
+    NDIlib_recv_queue_t queue;
+    bzero(&queue, sizeof(queue));
+    NDIlib_recv_get_queue(thread_data->pNDI_recv, &queue);
+
+    uint64_t framesDropped = droppedFrameCount();
+    bandwidthSample_t sample = {
+        now - monitor->intervalStart,
+        monitor->framesReceived,
+        (int)(framesDropped - monitor->framesDroppedAtStart) + monitor->framesSkipped,
+        queue.video_frames,
+        readCPUTemperature(),
+        g_camera_active || g_camera_preview
+    };
+    monitor->intervalStart = now;
+    monitor->framesReceived = 0;
+    monitor->framesSkipped = 0;
+    monitor->framesDroppedAtStart = framesDropped;
+
+    if (enable_verbose_debugging) {
+        fprintf(stderr, "Bandwidth: %d frames, %d dropped, %d queued, %d mC%s\n", sample.framesReceived,
+                sample.framesDropped, sample.queuedFrames, sample.temperature, sample.live ? ", live" : "");
+    }
+    if (!updateAdaptiveBandwidth(&monitor->state, &sample)) {
+        return thread_data->pNDI_recv;
+    }
+    fprintf(stderr, "Switching to the %s bandwidth stream (%s).\n",
+            monitor->state.lowBandwidth ? "low" : "high", monitor->state.reason);
+    return reconnectReceiver(thread_data, monitor->state.lowBandwidth);
+}
+
+#pragma mark - Low-latency capture
+
+// Latency bookkeeping for one receive thread.
+typedef struct {
+    uint64_t framesCaptured;      // Video frames taken from NDI, including skipped ones.
+    uint64_t staleFramesSkipped;  // Freed without being drawn, because a newer one was queued.
+    int queueDepth;               // Video frames waiting inside NDI after the last capture.
+    int maxQueueDepth;
+} latencyStats_t;
+
+// Reports the queue and dropped-frame counts, including frames that NDI itself dropped
+// before they ever reached us.
+void printLatencyStats(NDIlib_recv_instance_t pNDI_recv, latencyStats_t *stats) {
+    NDIlib_recv_performance_t total, dropped;
+    bzero(&total, sizeof(total));
+    bzero(&dropped, sizeof(dropped));
+    NDIlib_recv_get_performance(pNDI_recv, &total, &dropped);
+    fprintf(stderr, "Frames captured: %llu  stale frames skipped: %llu  dropped by NDI: %lld  "
+            "queue depth: %d (max %d)\n",
+            (unsigned long long)stats->framesCaptured, (unsigned long long)stats->staleFramesSkipped,
+            (long long)dropped.video_frames, stats->queueDepth, stats->maxQueueDepth);
+}
+
+// The NDI receiver calls that drainStaleVideoFrames makes, so that the unit tests can
+// stand in for a real receiver.
+typedef struct {
+    void (*getQueue)(NDIlib_recv_instance_t, NDIlib_recv_queue_t *);
+    NDIlib_frame_type_e (*capture)(NDIlib_recv_instance_t, NDIlib_video_frame_v2_t *, NDIlib_audio_frame_v3_t *,
+                                   NDIlib_metadata_frame_t *, uint32_t);
+    void (*freeVideo)(NDIlib_recv_instance_t, const NDIlib_video_frame_v2_t *);
+    bool (*ptzIsSupported)(NDIlib_recv_instance_t);
+} videoQueueFuncs_t;
+
+const videoQueueFuncs_t g_ndiVideoQueue = {
+    NDIlib_recv_get_queue, NDIlib_recv_capture_v3, NDIlib_recv_free_video_v2, NDIlib_recv_ptz_is_supported
+};
+
+// Records how many video frames are still waiting inside NDI.  In low-latency mode, it
+// also captures and frees every one of them but the newest, which replaces *video_recv.
+// Only the primary receiver's status changes say whether the camera supports PTZ.
+// Returns the number of frames that were skipped.
+int drainStaleVideoFrames(const videoQueueFuncs_t *funcs, NDIlib_recv_instance_t pNDI_recv,
+                          NDIlib_video_frame_v2_t *video_recv, latencyStats_t *stats, bool primary) {
+    int skipped = 0;
+    while (true) {
+        NDIlib_recv_queue_t queue;
+        bzero(&queue, sizeof(queue));
+        funcs->getQueue(pNDI_recv, &queue);
+        stats->queueDepth = queue.video_frames;
+        stats->maxQueueDepth = MAX(stats->maxQueueDepth, queue.video_frames);
+        if (!low_latency_mode || queue.video_frames <= 0) break;
+
+        // Only ask for video, so that nothing else is taken out of the queue by accident.
+        NDIlib_video_frame_v2_t newer_video_recv;
+        NDIlib_frame_type_e frameType = funcs->capture(pNDI_recv, &newer_video_recv, nullptr, nullptr, 0);
+        if (frameType == NDIlib_frame_type_video) {
+            funcs->freeVideo(pNDI_recv, video_recv);
+            *video_recv = newer_video_recv;
+            stats->framesCaptured++;
+            skipped++;
+        } else if (frameType == NDIlib_frame_type_status_change) {
+            if (primary) {
+                g_ptzEnabled = funcs->ptzIsSupported(pNDI_recv);
+            }
+        } else {
+            break;
+        }
+    }
+    stats->staleFramesSkipped += skipped;
+    if (skipped > 0 && enable_verbose_debugging) {
+        fprintf(stderr, "Skipped %d stale frames.\n", skipped);
+    }
+    return skipped;
+}
+
+#pragma mark - Video rendering
+
+void *runNDIRunLoop(void *receiver_thread_data_ref) {
+    receiver_thread_data_t thread_data = (receiver_thread_data_t)receiver_thread_data_ref;
+    const NDIlib_v3 *p_NDILib = thread_data->p_NDILib;
+    NDIlib_recv_instance_t pNDI_recv = thread_data->pNDI_recv;
+    char *stream_name = thread_data->stream_name;
+    bool primary = (thread_data->tileIndex <= 0 && !thread_data->pictureInPicture);
+
+    bandwidthMonitor_t bandwidthMonitor;
+    startBandwidthMonitor(&bandwidthMonitor);
+    latencyStats_t latencyStats;
+    bzero(&latencyStats, sizeof(latencyStats));
+    uint64_t framesHandled = 0;
+
+    bool exit_loop = false;
+    while(!exit_loop && !exit_app) {
+        int framesReceived = 0, framesSkipped = 0;
+        NDIlib_video_frame_v2_t video_recv;
+#ifdef ENABLE_AUDIO
+        NDIlib_audio_frame_v3_t audio_recv;
+#endif
+        NDIlib_frame_type_e frameType =
+            NDIlib_recv_capture_v3(pNDI_recv, &video_recv,
+#ifdef ENABLE_AUDIO
+                                   &audio_recv,
+#else
+                                   nullptr,
+#endif
+                                   nullptr, 1500);
+        switch(frameType) {
+            case NDIlib_frame_type_error:
+                exit_loop = true;
+                break;
+            case NDIlib_frame_type_video:
+                clock_gettime(CLOCK_REALTIME, &last_frame_time);
+                if (enable_debugging) {
+                    fprintf(stderr, "Video frame\n");
+                }
+                latencyStats.framesCaptured++;
+                framesSkipped = drainStaleVideoFrames(&g_ndiVideoQueue, pNDI_recv, &video_recv, &latencyStats, primary);
+                framesReceived = 1 + framesSkipped;
+                if (enable_verbose_debugging && (++framesHandled % 300) == 0) {
+                    printLatencyStats(pNDI_recv, &latencyStats);
+                }
+#ifdef __linux__
+                if (thread_data->pictureInPicture) {
+                    submitPictureInPictureFrame(pNDI_recv, &video_recv);
+                } else if (thread_data->tileIndex >= 0) {
+                    if (!renderMultiviewTile(thread_data->tileIndex, &video_recv)) {
+                        exit_loop = true;
+                    }
+                    NDIlib_recv_free_video_v2(pNDI_recv, &video_recv);
+                } else if (!submitFrameForPresentation(pNDI_recv, &video_recv)) {
+                    // The framebuffer configuration failed.  We can't do anything.
+                    exit_loop = true;
+                }
+#else  // ! __linux__
+                if (!drawFrame(&video_recv)) {
+                    // The framebuffer configuration failed.  We can't do anything.
+                    exit_loop = true;
+                }
+                NDIlib_recv_free_video_v2(pNDI_recv, &video_recv);
+#endif  // __linux__
+                break;
+            case NDIlib_frame_type_status_change:
+                if (primary) {
+                    g_ptzEnabled = NDIlib_recv_ptz_is_supported(pNDI_recv);
+                }
+                break;
+#ifdef ENABLE_AUDIO
+            case NDIlib_frame_type_audio:
+                // Do something with the audio here.
+                NDIlib_recv_free_audio_v2(pNDI_recv, &audio_recv);
+#endif
+            default:
+                if (enable_debugging) {
+                    fprintf(stderr, "Unknown frame type %d.\n", frameType);
+                }
+        }
+        // In multiviewer mode, only the first camera is controlled.
+        if (primary && (g_ptzEnabled || enable_visca)) {
+#ifdef USE_AVAHI
+            if (enable_visca && !visca_use_custom_ip) {
+                int avahi_error = -1;
+                pthread_mutex_lock(&g_avahiMutex);
+                if (g_avahi_simple_poll != NULL) {
+                    avahi_error = avahi_simple_poll_iterate(g_avahi_simple_poll, 0);
+                }
+                pthread_mutex_unlock(&g_avahiMutex);
+                if (avahi_error != 0) {
+                    // Something went horribly wrong.  Just null out the references and start over.
+                    g_avahi_simple_poll = NULL;
+                    g_avahi_client = NULL;
+                    g_avahi_service_browser = NULL;
+
+                    visca_running = connectVISCA(stream_name, "2");
+                }
+            }
+#else
+            if (g_browseRef != NULL) {
+                DNSServiceProcessResult(g_browseRef);
+            }
+            if (g_resolveRef != NULL) {
+                DNSServiceProcessResult(g_resolveRef);
+            }
+            if (g_lookupRef != NULL) {
+                DNSServiceProcessResult(g_lookupRef);
+            }
+#endif
+            sendPTZUpdates(pNDI_recv);
+        } else if (primary) {
+            if (enable_debugging) {
+                fprintf(stderr, "PTZ Disabled\n");
+            }
+        }
+        // The inset and multiviewer tiles always use the low-bandwidth streams.
+        if (adaptive_bandwidth && !exit_loop && !thread_data->pictureInPicture && thread_data->tileIndex < 0) {
+            pNDI_recv = checkAdaptiveBandwidth(thread_data, &bandwidthMonitor, framesReceived, framesSkipped);
+        }
+    }
+    if (enable_debugging) {
+        printLatencyStats(pNDI_recv, &latencyStats);
+    }
+#ifdef __linux__
+    retireFramesFromReceiver(pNDI_recv);
+#endif  // __linux__
+    return NULL;
+}
+
+// Sets up the screen the first time a frame arrives.  Anything that depends on the
+// frame's geometry is handled per frame by updateScalerPlanForFrame instead.
+bool configureScreen(NDIlib_video_frame_v2_t *video_recv) {
+    static bool configured = false;
+    static bool configuredSuccessfully = false;
+    if (configured) return configuredSuccessfully;
+    configured = true;
+    configuredSuccessfully = configureScreenOnce(video_recv);
+    return configuredSuccessfully;
+}
+
+#ifdef __linux__
+// Opens a framebuffer device, switches it to page flipping if it can, and maps it.
+bool openFramebufferOutput(framebufferOutput_t *output) {
+    // Read the current framebuffer settings so that we can restore them later.
+    int framebufferMemoryOffset = 0;
+    int zero = 0;
+    output->fileHandle = open(output->devicePath, O_RDWR);
+    if (output->fileHandle == -1) {
+        perror("cameracontroller: open");
+        goto fail;
+    }
+    if (ioctl(output->fileHandle, FBIOGET_VSCREENINFO, &output->initialConfiguration) == -1) {
+        perror("cameracontroller: FBIOGET_VSCREENINFO");
+        goto fail;
+    }
+    if (ioctl(output->fileHandle, FBIOGET_FSCREENINFO, &output->fixedConfiguration) == -1) {
+        perror("cameracontroller: FBIOGET_FSCREENINFO");
+        goto fail;
+    }
+    if (output->fixedConfiguration.type != FB_TYPE_PACKED_PIXELS) {
+        fprintf(stderr, "Error: Only packed pixel framebuffers are supported.\n");
+        goto fail;
+    }
+
+    output->activeConfiguration = output->initialConfiguration;
+    output->activeConfiguration.xoffset = 0;
+    output->activeConfiguration.yoffset = 0;
+
+    // Ask for a virtual screen twice the visible height so that we can draw into the
+    // half that isn't being shown and flip between the two with FBIOPAN_DISPLAY.  If
+    // the driver refuses, put things back and copy each frame to the screen instead.
+    if (!disable_page_flipping) {
+        struct fb_var_screeninfo doubleBufferedConfiguration = output->activeConfiguration;
+        doubleBufferedConfiguration.yres_virtual = doubleBufferedConfiguration.yres * 2;
+        if (ioctl(output->fileHandle, FBIOPUT_VSCREENINFO, &doubleBufferedConfiguration) != -1 &&
+            ioctl(output->fileHandle, FBIOGET_VSCREENINFO, &doubleBufferedConfiguration) != -1 &&
+            ioctl(output->fileHandle, FBIOGET_FSCREENINFO, &output->fixedConfiguration) != -1 &&
+            doubleBufferedConfiguration.yres_virtual >= doubleBufferedConfiguration.yres * 2 &&
+            doubleBufferedConfiguration.bits_per_pixel == output->initialConfiguration.bits_per_pixel &&
+            output->fixedConfiguration.smem_len >=
+                output->fixedConfiguration.line_length * doubleBufferedConfiguration.yres * 2) {
+            output->activeConfiguration = doubleBufferedConfiguration;
+            output->activeConfiguration.xoffset = 0;
+            output->activeConfiguration.yoffset = 0;
+            output->pageFlipping = true;
+        } else {
+            fprintf(stderr, "Page flipping is not available.  Copying frames instead.\n");
+            ioctl(output->fileHandle, FBIOPUT_VSCREENINFO, &output->initialConfiguration);
+            if (ioctl(output->fileHandle, FBIOGET_FSCREENINFO, &output->fixedConfiguration) == -1) {
+                perror("cameracontroller: FBIOGET_FSCREENINFO");
+                goto fail;
+            }
+        }
+    }
+
+    // Map the framebuffer only after the virtual size is settled, because changing
+    // it can move or resize the framebuffer memory.
+    framebufferMemoryOffset = (unsigned long)(output->fixedConfiguration.smem_start) & (~PAGE_MASK);
+    output->memory = (unsigned char *)mmap(NULL, output->fixedConfiguration.smem_len + framebufferMemoryOffset, PROT_READ | PROT_WRITE, MAP_SHARED, output->fileHandle, 0);
+    if ((long)output->memory == -1L) {
+        perror("cameracontroller: mmap");
+        goto fail;
+    }
+
+    output->bytesPerPixel = output->activeConfiguration.bits_per_pixel / 8;
+    output->xres = output->activeConfiguration.xres;
+    output->yres = output->activeConfiguration.yres;
+    output->stride = output->fixedConfiguration.line_length;
+
+    fprintf(stderr, "%s: Xres: %d, Yres: %d, bpp: %d%s\n", output->devicePath, output->activeConfiguration.xres,
+            output->activeConfiguration.yres, output->activeConfiguration.bits_per_pixel,
+            output->pageFlipping ? " (page flipping)" : "");
+
+    if (ioctl(output->fileHandle, FBIOPAN_DISPLAY, &output->activeConfiguration) == -1) {
+        perror("cameracontroller: FBIOPAN_DISPLAY (2)");
+        munmap(output->memory, output->fixedConfiguration.smem_len);
+        goto fail;
+    }
+
+    // The visible page is first; when page flipping, the back page follows it.
+    output->base = output->memory + framebufferMemoryOffset;
+    output->activeMemory = output->pageFlipping ?
+        output->base + (output->stride * output->yres) : NULL;
+    return true;
+
+  fail:
+    if (ioctl(output->fileHandle, FBIOPUT_VSCREENINFO, &output->initialConfiguration) == -1) {
+        perror("cameracontroller: FBIOPUT_VSCREENINFO");
+    }
+    if (ioctl(output->fileHandle, FBIOGET_FSCREENINFO, &output->fixedConfiguration) == -1) {
+        perror("cameracontroller: FBIOGET_FSCREENINFO");
     }
     return false;
+}
+#endif  // __linux__
+
+bool configureScreenOnce(NDIlib_video_frame_v2_t *video_recv) {
+
+#ifdef __linux__
+    if (!openFramebufferOutput(&g_primaryOutput)) {
+        return false;
+    }
+    monitor_bytes_per_pixel = g_primaryOutput.bytesPerPixel;
+    return true;
+
+#else  // ! __linux__
+    // Mac
+    dispatch_sync(dispatch_get_main_queue(), ^{
+        NSRect frame = NSMakeRect(0, 0, video_recv->xres, video_recv->yres);
+        g_mainWindow = [[NSWindow alloc] initWithContentRect:frame
+                                                   styleMask:NSWindowStyleMaskTitled
+                                                     backing:NSBackingStoreBuffered
+                                                       defer:NO];
+        [g_mainWindow setBackgroundColor:[NSColor whiteColor]];
+        g_mainImageView = [[NSImageView alloc] initWithFrame:frame];
+        [[g_mainWindow contentView] addSubview:g_mainImageView];
+        [g_mainWindow makeKeyAndOrderFront:g_mainWindow];
+    });
+
+    return true;
+#endif
+}
+
+    uint16_t convert_sample_to_16bpp(uint32_t sample) {
+        // Input:  0xAA RR GG BB          // 32-bit LE integer: 8 bits each for ARGB (alpha high).
+        // Output: 0brrrrr gggggg bbbbb;  // 16-bit LE integer: 5 R, 6 G, 5 B (red high).
+
+        uint8_t r = (sample >> 16) & 0xff;
+        uint8_t g = (sample >>  8) & 0xff;
+        uint8_t b = (sample >>  0) & 0xff;
+        return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+
+    }
+
+#pragma mark - Pixel conversion kernels
+
+// Row conversion kernels.  Each one converts `count` BGRX samples into RGB565.  The scalar
+// version is the reference implementation; the SIMD versions must produce bit-identical
+// output (see testPixelConversion), and all of them handle any trailing pixels that don't
+// fill a whole vector with the scalar code.
+typedef void (*convertRowTo16bppFunc)(const uint32_t *in, uint16_t *out, int count);
+
+void convert_row_to_16bpp_scalar(const uint32_t *in, uint16_t *out, int count) {
+    for (int i = 0; i < count; i++) {
+        out[i] = convert_sample_to_16bpp(in[i]);
+    }
+}
+
+#if defined(__SSE2__)
+void convert_row_to_16bpp_sse2(const uint32_t *in, uint16_t *out, int count) {
+    const __m128i redMask = _mm_set1_epi32(0xF800);
+    const __m128i greenMask = _mm_set1_epi32(0x07E0);
+    const __m128i blueMask = _mm_set1_epi32(0x001F);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i pixels[2] = {
+            _mm_loadu_si128((const __m128i *)&in[i]),
+            _mm_loadu_si128((const __m128i *)&in[i + 4])
+        };
+        for (int j = 0; j < 2; j++) {
+            __m128i packed = _mm_or_si128(
+                _mm_or_si128(_mm_and_si128(_mm_srli_epi32(pixels[j], 8), redMask),
+                             _mm_and_si128(_mm_srli_epi32(pixels[j], 5), greenMask)),
+                _mm_and_si128(_mm_srli_epi32(pixels[j], 3), blueMask));
+
+            // SSE2 only has a signed 32-to-16 pack, so sign-extend the low 16 bits
+            // first so that it never saturates.
+            pixels[j] = _mm_srai_epi32(_mm_slli_epi32(packed, 16), 16);
+        }
+        _mm_storeu_si128((__m128i *)&out[i], _mm_packs_epi32(pixels[0], pixels[1]));
+    }
+    convert_row_to_16bpp_scalar(&in[i], &out[i], count - i);
+}
+#endif  // __SSE2__
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void convert_row_to_16bpp_avx2(const uint32_t *in, uint16_t *out, int count) {
+    const __m256i redMask = _mm256_set1_epi32(0xF800);
+    const __m256i greenMask = _mm256_set1_epi32(0x07E0);
+    const __m256i blueMask = _mm256_set1_epi32(0x001F);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i pixels[2] = {
+            _mm256_loadu_si256((const __m256i *)&in[i]),
+            _mm256_loadu_si256((const __m256i *)&in[i + 8])
+        };
+        for (int j = 0; j < 2; j++) {
+            pixels[j] = _mm256_or_si256(
+                _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(pixels[j], 8), redMask),
+                                _mm256_and_si256(_mm256_srli_epi32(pixels[j], 5), greenMask)),
+                _mm256_and_si256(_mm256_srli_epi32(pixels[j], 3), blueMask));
+        }
+        // The pack works within 128-bit lanes, so put the quadwords back in order afterwards.
+        __m256i packed = _mm256_packus_epi32(pixels[0], pixels[1]);
+        _mm256_storeu_si256((__m256i *)&out[i], _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    convert_row_to_16bpp_scalar(&in[i], &out[i], count - i);
+}
+
+bool cpuSupportsAVX2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif  // __x86_64__ || __i386__
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+void convert_row_to_16bpp_neon(const uint32_t *in, uint16_t *out, int count) {
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        // De-interleave into B, G, R, and X planes.
+        uint8x16x4_t pixels = vld4q_u8((const uint8_t *)&in[i]);
+
+        // Put each channel in the top byte, then shift-insert green and blue under red.
+        uint16x8_t low = vshll_n_u8(vget_low_u8(pixels.val[2]), 8);
+        low = vsriq_n_u16(low, vshll_n_u8(vget_low_u8(pixels.val[1]), 8), 5);
+        low = vsriq_n_u16(low, vshll_n_u8(vget_low_u8(pixels.val[0]), 8), 11);
+
+        uint16x8_t high = vshll_n_u8(vget_high_u8(pixels.val[2]), 8);
+        high = vsriq_n_u16(high, vshll_n_u8(vget_high_u8(pixels.val[1]), 8), 5);
+        high = vsriq_n_u16(high, vshll_n_u8(vget_high_u8(pixels.val[0]), 8), 11);
+
+        vst1q_u16(&out[i], low);
+        vst1q_u16(&out[i + 8], high);
+    }
+    convert_row_to_16bpp_scalar(&in[i], &out[i], count - i);
+}
+
+bool cpuSupportsNEON(void) {
+#if defined(__aarch64__)
+    return true;  // NEON is mandatory on AArch64.
+#elif defined(__linux__)
+    #ifndef HWCAP_NEON
+        #define HWCAP_NEON (1 << 12)
+    #endif
+    return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+    return true;
+#endif
+}
+#endif  // __ARM_NEON || __aarch64__
+
+// Row reversal kernels, used for flipping.  Each one copies `count` samples from `in`
+// to `out` in reverse order.  The buffers must not overlap.
+typedef void (*reverseRow32Func)(const uint32_t *in, uint32_t *out, int count);
+
+void reverse_row_32_scalar(const uint32_t *in, uint32_t *out, int count) {
+    for (int i = 0; i < count; i++) {
+        out[i] = in[count - i - 1];
+    }
+}
+
+#if defined(__SSE2__)
+void reverse_row_32_sse2(const uint32_t *in, uint32_t *out, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)&in[count - i - 4]);
+        _mm_storeu_si128((__m128i *)&out[i], _mm_shuffle_epi32(pixels, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+    reverse_row_32_scalar(in, &out[i], count - i);
+}
+#endif  // __SSE2__
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+void reverse_row_32_neon(const uint32_t *in, uint32_t *out, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        // Swap the samples within each half, then swap the halves.
+        uint32x4_t pixels = vrev64q_u32(vld1q_u32(&in[count - i - 4]));
+        vst1q_u32(&out[i], vcombine_u32(vget_high_u32(pixels), vget_low_u32(pixels)));
+    }
+    reverse_row_32_scalar(in, &out[i], count - i);
+}
+#endif  // __ARM_NEON || __aarch64__
+
+// YUV conversion kernels.  Each one converts `count` pixels of a UYVY (4:2:2) row into
+// BGRX, using integer BT.709 limited-range math.  As with the RGB565 kernels, the scalar
+// version is the reference and the SIMD versions must match it exactly.
+typedef void (*convertUYVYRowToBGRXFunc)(const uint8_t *in, uint32_t *out, int count);
+
+static inline uint8_t clampToByte(int value) {
+    return (value < 0) ? 0 : (value > 255) ? 255 : value;
+}
+
+static inline uint32_t convert_yuv_sample_to_bgrx(int y, int u, int v) {
+    int c = y - 16, d = u - 128, e = v - 128;
+    uint8_t r = clampToByte((298 * c + 459 * e + 128) >> 8);
+    uint8_t g = clampToByte((298 * c - 55 * d - 136 * e + 128) >> 8);
+    uint8_t b = clampToByte((298 * c + 541 * d + 128) >> 8);
+    return 0xFF000000 | (r << 16) | (g << 8) | b;
+}
+
+// Converts pixel x of a UYVY row.  Each pair of pixels shares one U and one V sample.
+static inline uint32_t convert_uyvy_pixel_to_bgrx(const uint8_t *row, int x) {
+    const uint8_t *pair = &row[(x & ~1) * 2];
+    return convert_yuv_sample_to_bgrx(pair[1 + (x & 1) * 2], pair[0], pair[2]);
+}
+
+void convert_uyvy_row_to_bgrx_scalar(const uint8_t *in, uint32_t *out, int count) {
+    for (int i = 0; i < count; i++) {
+        out[i] = convert_uyvy_pixel_to_bgrx(in, i);
+    }
+}
+
+#if defined(__SSE2__)
+// Packs two signed 16-bit coefficients for _mm_madd_epi16, first one in the low half.
+#define MADD_COEFFICIENTS(low, high) _mm_set1_epi32((int)(((uint32_t)(uint16_t)(high) << 16) | (uint16_t)(low)))
+
+void convert_uyvy_row_to_bgrx_sse2(const uint8_t *in, uint32_t *out, int count) {
+    const __m128i lowByteMask = _mm_set1_epi16(0x00FF);
+    const __m128i lowWordMask = _mm_set1_epi32(0x0000FFFF);
+    const __m128i lumaOffset = _mm_set1_epi16(16);
+    const __m128i chromaOffset = _mm_set1_epi16(128);
+    const __m128i rounding = _mm_set1_epi32(128);
+    const __m128i redCoefficients = MADD_COEFFICIENTS(298, 459);
+    const __m128i greenCoefficients = MADD_COEFFICIENTS(298, 1);
+    const __m128i blueCoefficients = MADD_COEFFICIENTS(298, 541);
+    const __m128i opaque = _mm_set1_epi8((char)0xFF);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        // Eight pixels: U0 Y0 V0 Y1 U1 Y2 V1 Y3 ...  Split into 16-bit Y, U, and V
+        // lanes, with each chroma sample repeated for both pixels of its pair.
+        __m128i pixels = _mm_loadu_si128((const __m128i *)&in[i * 2]);
+        __m128i y = _mm_srli_epi16(pixels, 8);
+        __m128i uv = _mm_and_si128(pixels, lowByteMask);
+        __m128i u = _mm_and_si128(uv, lowWordMask);
+        __m128i v = _mm_srli_epi32(uv, 16);
+        u = _mm_or_si128(u, _mm_slli_epi32(u, 16));
+        v = _mm_or_si128(v, _mm_slli_epi32(v, 16));
+
+        __m128i c = _mm_sub_epi16(y, lumaOffset);
+        __m128i d = _mm_sub_epi16(u, chromaOffset);
+        __m128i e = _mm_sub_epi16(v, chromaOffset);
+        // The green chroma term is small enough to stay in 16 bits.
+        __m128i greenChroma = _mm_add_epi16(_mm_mullo_epi16(d, _mm_set1_epi16(-55)),
+                                            _mm_mullo_epi16(e, _mm_set1_epi16(-136)));
+
+        __m128i channels[3];
+        const __m128i chroma[3] = { e, greenChroma, d };
+        const __m128i coefficients[3] = { redCoefficients, greenCoefficients, blueCoefficients };
+        for (int j = 0; j < 3; j++) {
+            __m128i low = _mm_madd_epi16(_mm_unpacklo_epi16(c, chroma[j]), coefficients[j]);
+            __m128i high = _mm_madd_epi16(_mm_unpackhi_epi16(c, chroma[j]), coefficients[j]);
+            low = _mm_srai_epi32(_mm_add_epi32(low, rounding), 8);
+            high = _mm_srai_epi32(_mm_add_epi32(high, rounding), 8);
+            __m128i words = _mm_packs_epi32(low, high);
+            channels[j] = _mm_packus_epi16(words, words);  // Clamps to 0-255.
+        }
+
+        __m128i blueGreen = _mm_unpacklo_epi8(channels[2], channels[1]);
+        __m128i redAlpha = _mm_unpacklo_epi8(channels[0], opaque);
+        _mm_storeu_si128((__m128i *)&out[i], _mm_unpacklo_epi16(blueGreen, redAlpha));
+        _mm_storeu_si128((__m128i *)&out[i + 4], _mm_unpackhi_epi16(blueGreen, redAlpha));
+    }
+    convert_uyvy_row_to_bgrx_scalar(&in[i * 2], &out[i], count - i);
+}
+#endif  // __SSE2__
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+// Rounds, shifts, and clamps two halves of a 32-bit channel sum into eight bytes.
+static inline uint8x8_t narrowChannelNEON(int32x4_t low, int32x4_t high) {
+    return vqmovun_s16(vcombine_s16(vqrshrn_n_s32(low, 8), vqrshrn_n_s32(high, 8)));
+}
+
+void convert_uyvy_row_to_bgrx_neon(const uint8_t *in, uint32_t *out, int count) {
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        // Sixteen pixels, de-interleaved into U, even Y, V, and odd Y.
+        uint8x8x4_t pixels = vld4_u8(&in[i * 2]);
+        int16x8_t d = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(pixels.val[0])), vdupq_n_s16(128));
+        int16x8_t e = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(pixels.val[2])), vdupq_n_s16(128));
+
+        // The chroma terms are shared by both pixels of each pair.
+        int32x4_t redLow = vmull_n_s16(vget_low_s16(e), 459);
+        int32x4_t redHigh = vmull_n_s16(vget_high_s16(e), 459);
+        int32x4_t greenLow = vmlal_n_s16(vmull_n_s16(vget_low_s16(d), -55), vget_low_s16(e), -136);
+        int32x4_t greenHigh = vmlal_n_s16(vmull_n_s16(vget_high_s16(d), -55), vget_high_s16(e), -136);
+        int32x4_t blueLow = vmull_n_s16(vget_low_s16(d), 541);
+        int32x4_t blueHigh = vmull_n_s16(vget_high_s16(d), 541);
+
+        uint8x8_t red[2], green[2], blue[2];
+        for (int parity = 0; parity < 2; parity++) {
+            int16x8_t c = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(pixels.val[1 + parity * 2])),
+                                    vdupq_n_s16(16));
+            int32x4_t lumaLow = vmull_n_s16(vget_low_s16(c), 298);
+            int32x4_t lumaHigh = vmull_n_s16(vget_high_s16(c), 298);
+            red[parity] = narrowChannelNEON(vaddq_s32(lumaLow, redLow), vaddq_s32(lumaHigh, redHigh));
+            green[parity] = narrowChannelNEON(vaddq_s32(lumaLow, greenLow), vaddq_s32(lumaHigh, greenHigh));
+            blue[parity] = narrowChannelNEON(vaddq_s32(lumaLow, blueLow), vaddq_s32(lumaHigh, blueHigh));
+        }
+
+        // Put the even and odd pixels back in order, then interleave into BGRX.
+        uint8x8x2_t redPixels = vzip_u8(red[0], red[1]);
+        uint8x8x2_t greenPixels = vzip_u8(green[0], green[1]);
+        uint8x8x2_t bluePixels = vzip_u8(blue[0], blue[1]);
+        uint8x16x4_t bgrx;
+        bgrx.val[0] = vcombine_u8(bluePixels.val[0], bluePixels.val[1]);
+        bgrx.val[1] = vcombine_u8(greenPixels.val[0], greenPixels.val[1]);
+        bgrx.val[2] = vcombine_u8(redPixels.val[0], redPixels.val[1]);
+        bgrx.val[3] = vdupq_n_u8(0xFF);
+        vst4q_u8((uint8_t *)&out[i], bgrx);
+    }
+    convert_uyvy_row_to_bgrx_scalar(&in[i * 2], &out[i], count - i);
+}
+#endif  // __ARM_NEON || __aarch64__
+
+// Framebuffer copy kernels.  The framebuffer is usually uncached, write-combined memory,
+// which is fastest when written in whole cache lines and never read.  The SIMD versions
+// write every full 64-byte line of the destination with non-temporal stores, which also
+// keeps the frame from pushing everything else out of the cache.
+typedef void (*copyToFramebufferFunc)(void *destination, const void *source, size_t bytes);
+
+#define FRAMEBUFFER_LINE_SIZE 64
+
+void copy_to_framebuffer_scalar(void *destination, const void *source, size_t bytes) {
+    memcpy(destination, source, bytes);
+}
+
+#if defined(__SSE2__)
+void copy_to_framebuffer_sse2(void *destination, const void *source, size_t bytes) {
+    unsigned char *out = (unsigned char *)destination;
+    const unsigned char *in = (const unsigned char *)source;
+
+    // Ordinary stores up to the first line boundary, then whole lines.
+    size_t head = MIN((FRAMEBUFFER_LINE_SIZE - ((uintptr_t)out % FRAMEBUFFER_LINE_SIZE)) % FRAMEBUFFER_LINE_SIZE, bytes);
+    memcpy(out, in, head);
+    out += head;
+    in += head;
+    bytes -= head;
+    for (; bytes >= FRAMEBUFFER_LINE_SIZE; bytes -= FRAMEBUFFER_LINE_SIZE) {
+        __m128i a = _mm_loadu_si128((const __m128i *)&in[0]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&in[16]);
+        __m128i c = _mm_loadu_si128((const __m128i *)&in[32]);
+        __m128i d = _mm_loadu_si128((const __m128i *)&in[48]);
+        _mm_stream_si128((__m128i *)&out[0], a);
+        _mm_stream_si128((__m128i *)&out[16], b);
+        _mm_stream_si128((__m128i *)&out[32], c);
+        _mm_stream_si128((__m128i *)&out[48], d);
+        out += FRAMEBUFFER_LINE_SIZE;
+        in += FRAMEBUFFER_LINE_SIZE;
+    }
+    memcpy(out, in, bytes);
+    _mm_sfence();
+}
+#endif  // __SSE2__
+
+#if defined(__aarch64__)
+void copy_to_framebuffer_neon(void *destination, const void *source, size_t bytes) {
+    unsigned char *out = (unsigned char *)destination;
+    const unsigned char *in = (const unsigned char *)source;
+
+    size_t head = MIN((FRAMEBUFFER_LINE_SIZE - ((uintptr_t)out % FRAMEBUFFER_LINE_SIZE)) % FRAMEBUFFER_LINE_SIZE, bytes);
+    memcpy(out, in, head);
+    out += head;
+    in += head;
+    bytes -= head;
+    for (; bytes >= FRAMEBUFFER_LINE_SIZE; bytes -= FRAMEBUFFER_LINE_SIZE) {
+        uint8x16_t a = vld1q_u8(&in[0]);
+        uint8x16_t b = vld1q_u8(&in[16]);
+        uint8x16_t c = vld1q_u8(&in[32]);
+        uint8x16_t d = vld1q_u8(&in[48]);
+        __asm__ volatile("stnp %q0, %q1, [%2]\n\t"
+                         "stnp %q3, %q4, [%2, #32]"
+                         : : "w"(a), "w"(b), "r"(out), "w"(c), "w"(d) : "memory");
+        out += FRAMEBUFFER_LINE_SIZE;
+        in += FRAMEBUFFER_LINE_SIZE;
+    }
+    memcpy(out, in, bytes);
+}
+#endif  // __aarch64__
+
+// Block transpose kernels for the rotated blitters.  Each one transposes a
+// TRANSPOSE_BLOCK_SIZE-square block of 32-bit samples, so that
+// out[i * outStride + j] = in[j * inStride + i].  Strides are in samples.
+typedef void (*transposeBlock32Func)(const uint32_t *in, int inStride, uint32_t *out, int outStride);
+
+void transpose_block_32_scalar(const uint32_t *in, int inStride, uint32_t *out, int outStride) {
+    for (int i = 0; i < TRANSPOSE_BLOCK_SIZE; i++) {
+        for (int j = 0; j < TRANSPOSE_BLOCK_SIZE; j++) {
+            out[i * outStride + j] = in[j * inStride + i];
+        }
+    }
+}
+
+#if defined(__SSE2__)
+static inline void transpose4x4SSE2(const uint32_t *in, int inStride, uint32_t *out, int outStride) {
+    __m128i a = _mm_loadu_si128((const __m128i *)&in[0]);
+    __m128i b = _mm_loadu_si128((const __m128i *)&in[inStride]);
+    __m128i c = _mm_loadu_si128((const __m128i *)&in[inStride * 2]);
+    __m128i d = _mm_loadu_si128((const __m128i *)&in[inStride * 3]);
+    __m128i ab01 = _mm_unpacklo_epi32(a, b);  // a0 b0 a1 b1
+    __m128i cd01 = _mm_unpacklo_epi32(c, d);
+    __m128i ab23 = _mm_unpackhi_epi32(a, b);  // a2 b2 a3 b3
+    __m128i cd23 = _mm_unpackhi_epi32(c, d);
+    _mm_storeu_si128((__m128i *)&out[0], _mm_unpacklo_epi64(ab01, cd01));
+    _mm_storeu_si128((__m128i *)&out[outStride], _mm_unpackhi_epi64(ab01, cd01));
+    _mm_storeu_si128((__m128i *)&out[outStride * 2], _mm_unpacklo_epi64(ab23, cd23));
+    _mm_storeu_si128((__m128i *)&out[outStride * 3], _mm_unpackhi_epi64(ab23, cd23));
+}
+
+void transpose_block_32_sse2(const uint32_t *in, int inStride, uint32_t *out, int outStride) {
+    for (int i = 0; i < TRANSPOSE_BLOCK_SIZE; i += 4) {
+        for (int j = 0; j < TRANSPOSE_BLOCK_SIZE; j += 4) {
+            transpose4x4SSE2(&in[j * inStride + i], inStride, &out[i * outStride + j], outStride);
+        }
+    }
+}
+#endif  // __SSE2__
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+static inline void transpose4x4NEON(const uint32_t *in, int inStride, uint32_t *out, int outStride) {
+    uint32x4x2_t ab = vtrnq_u32(vld1q_u32(&in[0]), vld1q_u32(&in[inStride]));  // a0 b0 a2 b2, a1 b1 a3 b3
+    uint32x4x2_t cd = vtrnq_u32(vld1q_u32(&in[inStride * 2]), vld1q_u32(&in[inStride * 3]));
+    vst1q_u32(&out[0], vcombine_u32(vget_low_u32(ab.val[0]), vget_low_u32(cd.val[0])));
+    vst1q_u32(&out[outStride], vcombine_u32(vget_low_u32(ab.val[1]), vget_low_u32(cd.val[1])));
+    vst1q_u32(&out[outStride * 2], vcombine_u32(vget_high_u32(ab.val[0]), vget_high_u32(cd.val[0])));
+    vst1q_u32(&out[outStride * 3], vcombine_u32(vget_high_u32(ab.val[1]), vget_high_u32(cd.val[1])));
+}
+
+void transpose_block_32_neon(const uint32_t *in, int inStride, uint32_t *out, int outStride) {
+    for (int i = 0; i < TRANSPOSE_BLOCK_SIZE; i += 4) {
+        for (int j = 0; j < TRANSPOSE_BLOCK_SIZE; j += 4) {
+            transpose4x4NEON(&in[j * inStride + i], inStride, &out[i * outStride + j], outStride);
+        }
+    }
+}
+#endif  // __ARM_NEON || __aarch64__
+
+convertRowTo16bppFunc g_convertRowTo16bpp = convert_row_to_16bpp_scalar;
+reverseRow32Func g_reverseRow32 = reverse_row_32_scalar;
+convertUYVYRowToBGRXFunc g_convertUYVYRowToBGRX = convert_uyvy_row_to_bgrx_scalar;
+copyToFramebufferFunc g_copyToFramebuffer = copy_to_framebuffer_scalar;
+transposeBlock32Func g_transposeBlock32 = transpose_block_32_scalar;
+
+// Picks the fastest row conversion kernel that this CPU supports.  Called once at startup.
+void selectPixelConversionKernels(void) {
+    const char *kernelName = "scalar";
+#if defined(__SSE2__)
+    g_convertRowTo16bpp = convert_row_to_16bpp_sse2;
+    g_reverseRow32 = reverse_row_32_sse2;
+    g_convertUYVYRowToBGRX = convert_uyvy_row_to_bgrx_sse2;
+    g_copyToFramebuffer = copy_to_framebuffer_sse2;
+    g_transposeBlock32 = transpose_block_32_sse2;
+    kernelName = "SSE2";
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpuSupportsAVX2()) {
+        g_convertRowTo16bpp = convert_row_to_16bpp_avx2;
+        kernelName = "AVX2";
+    }
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+    if (cpuSupportsNEON()) {
+        g_convertRowTo16bpp = convert_row_to_16bpp_neon;
+        g_reverseRow32 = reverse_row_32_neon;
+        g_convertUYVYRowToBGRX = convert_uyvy_row_to_bgrx_neon;
+        g_transposeBlock32 = transpose_block_32_neon;
+#if defined(__aarch64__)
+        g_copyToFramebuffer = copy_to_framebuffer_neon;
+#endif
+        kernelName = "NEON";
+    }
+#endif
+    if (enable_debugging) {
+        fprintf(stderr, "Using %s pixel conversion.\n", kernelName);
+    }
+}
+
+#ifdef __linux__
+    // This is a really weak scaling algorithm, intended to be as fast as possible, to leave
+    // as much CPU as possible free for decoding whatever crazy resolution or profile of H.264
+    // (or worse, H.265) the camera might throw in our direction.  Experimentally, the overhead
+    // of 32-bit to 16-bit conversion plus the overhead of doing even this minimal conversion
+    // exceeds what the Raspberry Pi 4 can handle at 1080p, at least with the vc4-fkms-v3d
+    // driver enabled, so if you want to add a better scaling algorithm, it needs to be
+    // configurable.
+
+    void freeScalerPlan(scalerPlan_t *plan) {
+        free(plan->columnStart);
+        free(plan->rowStart);
+        if (plan->packedRow != (unsigned char *)plan->scratchRow) {
+            free(plan->packedRow);
+        }
+        free(plan->scratchRow);
+        free(plan->reversedRow);
+        free(plan->decodedRow);
+        free(plan->bandRows);
+        free(plan->sourceColumn);
+        free(plan->sourceRow);
+        bzero(plan, sizeof(*plan));
+    }
+
+    // UYVA frames are a UYVY frame followed by an alpha plane, which is ignored.
+    bool frameFormatIsYUV(int fourCC) {
+        return fourCC == NDIlib_FourCC_type_UYVY || fourCC == NDIlib_FourCC_type_UYVA;
+    }
+
+    // The first row or column of a window of sourceRes pixels around center (a fraction
+    // of the frame), kept inside the frame.
+    int magnifiedSourceOrigin(int frameRes, int sourceRes, float center) {
+        int origin = (int)lround(center * frameRes - sourceRes / 2.0);
+        return MIN(MAX(origin, 0), frameRes - sourceRes);
+    }
+
+    // Moves a magnified plan's window to wherever the joystick has put it.  The window is
+    // in the frame's own coordinates, so it doesn't move when the screen is flipped.
+    void updateMagnifiedRegion(scalerPlan_t *plan) {
+        int sourceX = magnifiedSourceOrigin(plan->frameXRes, plan->sourceXRes, g_magnifiedCenterX);
+        int sourceY = magnifiedSourceOrigin(plan->frameYRes, plan->sourceYRes, g_magnifiedCenterY);
+        if (plan->sourceBytesPerPixel == 2) {
+            sourceX &= ~1;
+        }
+        plan->sourceOffset = (ssize_t)sourceY * plan->sourceStride + sourceX * plan->sourceBytesPerPixel;
+    }
+
+    // Works out which part of the frame to show and where on the screen to draw it.
+    // Flipping mirrors both rectangles so that the picture rotates as a whole.  A screen
+    // turned 90 or 270 degrees is fitted as if it were its rotated shape, and only the
+    // final position is worked out in the screen's own orientation.
+    void computeFitRects(scalerPlan_t *plan) {
+        bool rotated = (plan->rotation != 0);
+        int frameXRes = plan->frameXRes, frameYRes = plan->frameYRes;
+        int displayXRes = rotated ? plan->displayYRes : plan->displayXRes;
+        int displayYRes = rotated ? plan->displayXRes : plan->displayYRes;
+        int sourceX = 0, sourceY = 0, screenX = 0, screenY = 0;
+        int sourceXRes = frameXRes, sourceYRes = frameYRes;
+        int screenXRes = displayXRes, screenYRes = displayYRes;
+
+        if (plan->magnification > 0) {
+            // A window into the frame, a whole number of screen pixels per source pixel.
+            sourceXRes = MIN(frameXRes, MAX(displayXRes / plan->magnification, 1));
+            sourceYRes = MIN(frameYRes, MAX(displayYRes / plan->magnification, 1));
+            screenXRes = sourceXRes * plan->magnification;
+            screenYRes = sourceYRes * plan->magnification;
+        } else if (plan->fitMode == kFitLetterbox) {
+            if ((int64_t)frameXRes * displayYRes > (int64_t)frameYRes * displayXRes) {
+                // Wider than the screen.  Borders above and below.
+                screenYRes = MAX((int)(((int64_t)displayXRes * frameYRes) / frameXRes), 1);
+            } else {
+                screenXRes = MAX((int)(((int64_t)displayYRes * frameXRes) / frameYRes), 1);
+            }
+        } else if (plan->fitMode == kFitCrop) {
+            sourceXRes = screenXRes = MIN(frameXRes, displayXRes);
+            sourceYRes = screenYRes = MIN(frameYRes, displayYRes);
+        }
+        sourceX = (frameXRes - sourceXRes) / 2;
+        sourceY = (frameYRes - sourceYRes) / 2;
+        screenX = (displayXRes - screenXRes) / 2;
+        screenY = (displayYRes - screenYRes) / 2;
+        if (plan->flipped) {
+            sourceX = frameXRes - sourceXRes - sourceX;
+            sourceY = frameYRes - sourceYRes - sourceY;
+            screenX = displayXRes - screenXRes - screenX;
+            screenY = displayYRes - screenYRes - screenY;
+        }
+        if (plan->sourceBytesPerPixel == 2) {
+            // Keep each UYVY pixel pair together.
+            sourceX &= ~1;
+        }
+
+        plan->sourceXRes = sourceXRes;
+        plan->sourceYRes = sourceYRes;
+        plan->screenXRes = screenXRes;
+        plan->screenYRes = screenYRes;
+        plan->outputXRes = rotated ? screenYRes : screenXRes;
+        plan->outputYRes = rotated ? screenXRes : screenYRes;
+        if (plan->rotation == 90) {
+            // The top of the picture is along the right edge of the screen.
+            int outputX = displayYRes - screenYRes - screenY;
+            screenY = screenX;
+            screenX = outputX;
+        } else if (plan->rotation == 270) {
+            int outputY = displayXRes - screenXRes - screenX;
+            screenX = screenY;
+            screenY = outputY;
+        }
+        plan->sourceOffset = (ssize_t)sourceY * plan->sourceStride + sourceX * plan->sourceBytesPerPixel;
+        plan->screenOffset = (ssize_t)screenY * plan->screenStride + screenX * plan->bytesPerPixel;
+        if (plan->magnification > 0) {
+            updateMagnifiedRegion(plan);
+        }
+    }
+
+    // Splits a number of clockwise quarter turns into a flip and a quarter turn.  Flipping
+    // is a 180-degree rotation, so flipping a 90-degree rotation gives 270 degrees, and so on.
+    void orientationForQuarterTurns(int quarterTurns, bool *flipped, int *rotation) {
+        *flipped = (quarterTurns == 2);
+        *rotation = (quarterTurns % 2) ? quarterTurns * 90 : 0;
+    }
+
+    // The primary screen's orientation, combining -F and -r.
+    int screenQuarterTurns(void) {
+        return ((monitor_rotation / 90) + (monitor_flipped ? 2 : 0)) % 4;
+    }
+
+    void currentScreenOrientation(bool *flipped, int *rotation) {
+        orientationForQuarterTurns(screenQuarterTurns(), flipped, rotation);
+    }
+
+    // Builds a plan for a screen turned by the given number of quarter turns, magnified
+    // if magnification isn't zero.
+    void buildOrientedScalerPlan(scalerPlan_t *plan, int frameXRes, int frameYRes, int sourceStride, int fourCC,
+                                 int displayXRes, int displayYRes, int bytesPerPixel, int screenStride,
+                                 int quarterTurns, int magnification) {
+        freeScalerPlan(plan);
+
+        plan->frameXRes = frameXRes;
+        plan->frameYRes = frameYRes;
+        plan->displayXRes = displayXRes;
+        plan->displayYRes = displayYRes;
+        plan->bytesPerPixel = bytesPerPixel;
+        plan->sourceBytesPerPixel = frameFormatIsYUV(fourCC) ? 2 : 4;
+        plan->sourceStride = sourceStride ? sourceStride : frameXRes * plan->sourceBytesPerPixel;
+        plan->screenStride = screenStride;
+        plan->fourCC = fourCC;
+        orientationForQuarterTurns(quarterTurns, &plan->flipped, &plan->rotation);
+        plan->fitMode = fit_mode;
+        plan->magnification = magnification;
+        computeFitRects(plan);
+
+        int sourceXRes = plan->sourceXRes, sourceYRes = plan->sourceYRes;
+        int screenXRes = plan->screenXRes, screenYRes = plan->screenYRes;
+
+        plan->columnStart = (int *)malloc((sourceXRes + 1) * sizeof(int));
+        for (int x = 0; x <= sourceXRes; x++) {
+            plan->columnStart[x] = (int)(((int64_t)x * screenXRes) / sourceXRes);
+        }
+        plan->rowStart = (int *)malloc((sourceYRes + 1) * sizeof(int));
+        for (int y = 0; y <= sourceYRes; y++) {
+            plan->rowStart[y] = (int)(((int64_t)y * screenYRes) / sourceYRes);
+        }
+        plan->scratchRow = (uint32_t *)malloc(screenXRes * sizeof(uint32_t));
+        // Rotated rows are outputXRes wide, which may be wider than screenXRes.
+        plan->packedRow = (bytesPerPixel == 4) ? (unsigned char *)plan->scratchRow :
+                                                 (unsigned char *)malloc(MAX(screenXRes, plan->outputXRes) * bytesPerPixel);
+        plan->reversedRow = (uint32_t *)malloc(sourceXRes * sizeof(uint32_t));
+        plan->decodedRow = (uint32_t *)malloc(sourceXRes * sizeof(uint32_t));
+        plan->bandStride = ((plan->outputXRes + TRANSPOSE_BLOCK_SIZE - 1) / TRANSPOSE_BLOCK_SIZE) *
+                           TRANSPOSE_BLOCK_SIZE;
+        if (plan->rotation != 0) {
+            plan->bandRows = (uint32_t *)malloc(TRANSPOSE_BLOCK_SIZE * plan->bandStride * sizeof(uint32_t));
+        }
+
+        // Sample each screen pixel from the source pixel nearest its center.
+        plan->downscale = (sourceXRes >= screenXRes && sourceYRes >= screenYRes);
+        plan->sourceColumn = (int *)malloc(screenXRes * sizeof(int));
+        for (int x = 0; x < screenXRes; x++) {
+            int column = (int)(((int64_t)(2 * x + 1) * sourceXRes) / (2 * screenXRes));
+            plan->sourceColumn[x] = plan->flipped ? sourceXRes - column - 1 : column;
+        }
+        plan->sourceRow = (int *)malloc(screenYRes * sizeof(int));
+        for (int y = 0; y < screenYRes; y++) {
+            int row = (int)(((int64_t)(2 * y + 1) * sourceYRes) / (2 * screenYRes));
+            plan->sourceRow[y] = plan->flipped ? sourceYRes - row - 1 : row;
+        }
+
+        // Pick the cheapest way to draw this geometry.  force_slow_path skips the special cases.
+        if (plan->rotation != 0) {
+            plan->scaleMode = kScaleRotated;
+        } else if (plan->downscale && !(sourceXRes == screenXRes && sourceYRes == screenYRes)) {
+            plan->scaleMode = kScaleDownscale;
+        } else if (force_slow_path) {
+            plan->scaleMode = kScaleArbitrary;
+        } else if (sourceXRes == screenXRes && sourceYRes == screenYRes) {
+            plan->scaleMode = kScaleIdentity;
+        } else if (screenXRes % sourceXRes == 0 && screenYRes % sourceYRes == 0) {
+            plan->scaleMode = kScaleInteger;
+        } else {
+            plan->scaleMode = kScaleArbitrary;
+        }
+        plan->xFactor = screenXRes / sourceXRes;
+        plan->yFactor = screenYRes / sourceYRes;
+        plan->blitRows = selectBlitter(plan);
+    }
+
+    // Builds the scaler plan for the primary screen, including its lookup tables.  Source
+    // column x covers the screen columns from columnStart[x] up to (but not including)
+    // columnStart[x + 1], and likewise for rows.  This is the same truncating math that the
+    // old per-pixel code did in floating point, but done once per configuration instead of
+    // several times per pixel.
+    void buildScalerPlan(scalerPlan_t *plan, int frameXRes, int frameYRes, int sourceStride, int fourCC,
+                         int displayXRes, int displayYRes, int bytesPerPixel, int screenStride) {
+        buildOrientedScalerPlan(plan, frameXRes, frameYRes, sourceStride, fourCC, displayXRes, displayYRes,
+                                bytesPerPixel, screenStride, screenQuarterTurns(), 0);
+    }
+
+    // Returns true if the plan was built for this combination of source and screen geometry.
+    bool orientedScalerPlanMatches(scalerPlan_t *plan, int frameXRes, int frameYRes, int sourceStride, int fourCC,
+                                   int displayXRes, int displayYRes, int bytesPerPixel, int screenStride,
+                                   int quarterTurns, int magnification) {
+        if (sourceStride == 0) sourceStride = frameXRes * (frameFormatIsYUV(fourCC) ? 2 : 4);
+        bool flipped;
+        int rotation;
+        orientationForQuarterTurns(quarterTurns, &flipped, &rotation);
+        return plan->columnStart != NULL &&
+               plan->frameXRes == frameXRes && plan->frameYRes == frameYRes &&
+               plan->sourceStride == sourceStride && plan->fourCC == fourCC &&
+               plan->displayXRes == displayXRes && plan->displayYRes == displayYRes &&
+               plan->bytesPerPixel == bytesPerPixel && plan->screenStride == screenStride &&
+               plan->flipped == flipped && plan->rotation == rotation && plan->fitMode == fit_mode &&
+               plan->magnification == magnification;
+    }
+
+    bool scalerPlanMatches(scalerPlan_t *plan, int frameXRes, int frameYRes, int sourceStride, int fourCC,
+                           int displayXRes, int displayYRes, int bytesPerPixel, int screenStride) {
+        return orientedScalerPlanMatches(plan, frameXRes, frameYRes, sourceStride, fourCC, displayXRes, displayYRes,
+                                         bytesPerPixel, screenStride, screenQuarterTurns(), 0);
+    }
+
+    // Returns true for the NDI pixel formats that the blitters can draw.
+    bool frameFormatIsSupported(int fourCC) {
+        return fourCC == NDIlib_FourCC_type_BGRX || fourCC == NDIlib_FourCC_type_BGRA ||
+               frameFormatIsYUV(fourCC);
+    }
+
+    // Returns a plan from the cache for this frame's geometry, stride, and format, drawn into
+    // a displayXRes x displayYRes rectangle of a screen with the given depth, stride, and
+    // orientation and magnification, rebuilding the least recently used plan if none
+    // matches.  Sets *changed if the result isn't `current`.
+    scalerPlan_t *scalerPlanForFrame(scalerPlan_t *cache, int cacheSize, scalerPlan_t *current, uint64_t *clock,
+                                     NDIlib_video_frame_v2_t *video_recv, int displayXRes, int displayYRes,
+                                     int bytesPerPixel, int screenStride, int quarterTurns, int magnification,
+                                     bool *changed) {
+        scalerPlan_t *plan = current;
+        *changed = false;
+        if (plan == NULL || !orientedScalerPlanMatches(plan, video_recv->xres, video_recv->yres,
+                                                       video_recv->line_stride_in_bytes, video_recv->FourCC,
+                                                       displayXRes, displayYRes,
+                                                       bytesPerPixel, screenStride, quarterTurns, magnification)) {
+            plan = NULL;
+            scalerPlan_t *leastRecentlyUsedPlan = &cache[0];
+            for (int i = 0; i < cacheSize; i++) {
+                scalerPlan_t *cachedPlan = &cache[i];
+                if (orientedScalerPlanMatches(cachedPlan, video_recv->xres, video_recv->yres,
+                                              video_recv->line_stride_in_bytes, video_recv->FourCC,
+                                              displayXRes, displayYRes,
+                                              bytesPerPixel, screenStride, quarterTurns, magnification)) {
+                    plan = cachedPlan;
+                    break;
+                }
+                if (cachedPlan->lastUsed < leastRecentlyUsedPlan->lastUsed) {
+                    leastRecentlyUsedPlan = cachedPlan;
+                }
+            }
+            if (plan == NULL) {
+                plan = leastRecentlyUsedPlan;
+                buildOrientedScalerPlan(plan, video_recv->xres, video_recv->yres, video_recv->line_stride_in_bytes,
+                                        video_recv->FourCC, displayXRes, displayYRes,
+                                        bytesPerPixel, screenStride, quarterTurns, magnification);
+            }
+            *changed = true;
+        }
+        if (magnification > 0) {
+            updateMagnifiedRegion(plan);
+        }
+        plan->lastUsed = ++(*clock);
+        return plan;
+    }
+
+    // Points g_scalerPlan at a plan for this frame's geometry, stride, and format, reusing a
+    // cached plan if there is one and otherwise rebuilding the least recently used one.  A
+    // camera that changes resolution (or a switch to the low-bandwidth stream) then takes
+    // effect on the very next frame.  Returns false if the frame can't be drawn.
+    bool updateScalerPlanForFrame(NDIlib_video_frame_v2_t *video_recv) {
+        if (!frameFormatIsSupported(video_recv->FourCC) || video_recv->xres <= 0 || video_recv->yres <= 0) {
+            if (enable_debugging) {
+                fprintf(stderr, "Skipping unsupported %dx%d frame (FourCC 0x%08x).\n",
+                        video_recv->xres, video_recv->yres, (unsigned)video_recv->FourCC);
+            }
+            return false;
+        }
+
+        bool changed;
+        g_scalerPlan = scalerPlanForFrame(g_scalerPlanCache, SCALER_PLAN_CACHE_SIZE, g_scalerPlan,
+                                          &g_scalerPlanClock, video_recv, g_primaryOutput.xres,
+                                          g_primaryOutput.yres, monitor_bytes_per_pixel, g_primaryOutput.stride,
+                                          screenQuarterTurns(), g_magnification, &changed);
+        if (changed) {
+            fprintf(stderr, "NDI Xres: %d, Yres: %d\n", video_recv->xres, video_recv->yres);
+            g_NDIXRes = video_recv->xres;
+            g_NDIYRes = video_recv->yres;
+
+            // Frames never draw over the letterbox borders, so clear them only when the
+            // picture's position on the screen changes.
+            clearFramebufferPages(&g_primaryOutput);
+        }
+        return true;
+    }
+
+    // Averages four BGRX samples, one channel pair at a time.  Each 16-bit field has
+    // room for the sum of four 8-bit values, so the channels can't overflow into
+    // each other.
+    static inline uint32_t averageOfFourSamples(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+        uint32_t evenChannels = ((a & 0x00FF00FF) + (b & 0x00FF00FF) +
+                                 (c & 0x00FF00FF) + (d & 0x00FF00FF)) >> 2;
+        uint32_t oddChannels = (((a >> 8) & 0x00FF00FF) + ((b >> 8) & 0x00FF00FF) +
+                                ((c >> 8) & 0x00FF00FF) + ((d >> 8) & 0x00FF00FF)) >> 2;
+        return (evenChannels & 0x00FF00FF) | ((oddChannels & 0x00FF00FF) << 8);
+    }
+
+    // The blitters below are templates, instantiated once for each combination of screen
+    // depth, flipping, scale mode, and source format, so that none of those checks happen
+    // inside a row.  Flipping walks the rows backwards and reverses each row with a
+    // vectorized kernel.  UYVY sources are converted to BGRX a row at a time, also with a
+    // vectorized kernel, and only for the rows and columns that are actually drawn, so the
+    // NDI library never has to convert the whole frame first.
+
+    static inline const unsigned char *sourceRowAddress(renderSlice_t *slice, int y) {
+        return slice->video_recv->p_data + slice->plan->sourceOffset +
+               (ssize_t)y * slice->plan->sourceStride;
+    }
+
+    static inline unsigned char *screenRowAddress(renderSlice_t *slice, int outY) {
+        return slice->outBuf + slice->plan->screenOffset + (ssize_t)outY * slice->plan->screenStride;
+    }
+
+    // Returns a whole source row as BGRX, converting it into scratch memory if necessary.
+    template <bool yuv>
+    static inline const uint32_t *decodedSourceRow(renderSlice_t *slice, int y) {
+        const unsigned char *row = sourceRowAddress(slice, y);
+        if (!yuv) return (const uint32_t *)row;
+        g_convertUYVYRowToBGRX(row, slice->decodedRow, slice->plan->sourceXRes);
+        return slice->decodedRow;
+    }
+
+    // Like decodedSourceRow, but converts only columns firstX (which must be even) up to
+    // endX, into the given sourceXRes-entry buffer.
+    template <bool yuv>
+    static inline const uint32_t *decodedSourceColumns(renderSlice_t *slice, int y, uint32_t *buffer,
+                                                       int firstX, int endX) {
+        const unsigned char *row = sourceRowAddress(slice, y);
+        if (!yuv) return (const uint32_t *)row;
+        g_convertUYVYRowToBGRX(row + firstX * 2, buffer + firstX, endX - firstX);
+        return buffer;
+    }
+
+    // Writes one finished 32-bit row to the screen, converting it if necessary.  Rows are
+    // always finished in scratch memory and written with the slice's row copier, so the
+    // screen only ever sees whole-row (streaming) stores.
+    template <int bytesPerPixel>
+    static inline void storeRow(renderSlice_t *slice, const uint32_t *row, unsigned char *outRow, int count) {
+        if (bytesPerPixel == 4) {
+            slice->copyRow(outRow, row, count * sizeof(uint32_t));
+        } else {
+            g_convertRowTo16bpp(row, (uint16_t *)slice->packedRow, count);
+            slice->copyRow(outRow, slice->packedRow, count * sizeof(uint16_t));
+        }
+    }
+
+    // The identity path.  Each source row maps to exactly one screen row, so padded
+    // frames, centered crops, and 1:1 letterboxing are all just row copies.
+    template <int bytesPerPixel, bool flipped, bool yuv>
+    void blitIdentityRows(renderSlice_t *slice) {
+        scalerPlan_t *plan = slice->plan;
+        int xres = plan->screenXRes;
+
+        for (int outY = slice->firstRow; outY < slice->endRow; outY++) {
+            int y = flipped ? plan->sourceYRes - outY - 1 : outY;
+            const uint32_t *inRow = decodedSourceRow<yuv>(slice, y);
+            if (flipped) {
+                g_reverseRow32(inRow, slice->scratchRow, xres);
+                inRow = slice->scratchRow;
+            }
+            storeRow<bytesPerPixel>(slice, inRow, screenRowAddress(slice, outY), xres);
+        }
+    }
+
+    // The downscaling path.  Walks the screen instead of the source, so a 4K or 1080p
+    // frame costs only as much as the panel it is shown on.  Each screen pixel reads
+    // its nearest source pixel, or with the -b flag, the 2x2 block starting there.
+    // Flipping is already built into the plan's tables, so it costs nothing here.  UYVY
+    // rows are first converted with the vectorized kernel, across just the columns that the
+    // screen samples, and then sampled as BGRX.
+    template <int bytesPerPixel, bool flipped, bool yuv>
+    void blitDownscaledRows(renderSlice_t *slice) {
+        scalerPlan_t *plan = slice->plan;
+        int screenXRes = plan->screenXRes;
+        const int *sourceColumn = plan->sourceColumn;
+        int firstX = MIN(sourceColumn[0], sourceColumn[screenXRes - 1]) & ~1;
+        int endX = MIN(MAX(sourceColumn[0], sourceColumn[screenXRes - 1]) + 2, plan->sourceXRes);
+
+        for (int outY = slice->firstRow; outY < slice->endRow; outY++) {
+            int y = plan->sourceRow[outY];
+            const uint32_t *inRow = decodedSourceColumns<yuv>(slice, y, slice->decodedRow, firstX, endX);
+            uint32_t *rowOut32 = slice->scratchRow;
+
+            if (use_box_filter) {
+                // The reversed row buffer is free here, so it holds the second row.
+                const uint32_t *nextInRow = (y + 1 < plan->sourceYRes) ?
+                    decodedSourceColumns<yuv>(slice, y + 1, slice->reversedRow, firstX, endX) : inRow;
+                for (int outX = 0; outX < screenXRes; outX++) {
+                    int x = sourceColumn[outX];
+                    int nextX = (x + 1 < plan->sourceXRes) ? x + 1 : x;
+                    rowOut32[outX] = averageOfFourSamples(inRow[x], inRow[nextX], nextInRow[x], nextInRow[nextX]);
+                }
+            } else {
+                for (int outX = 0; outX < screenXRes; outX++) {
+                    rowOut32[outX] = inRow[sourceColumn[outX]];
+                }
+            }
+            storeRow<bytesPerPixel>(slice, rowOut32, screenRowAddress(slice, outY), screenXRes);
+        }
+    }
+
+    // The upscaling paths.  Walks the source frame one row at a time, fills each source
+    // pixel's span of screen columns, then copies the finished row into every screen row
+    // that the same source row covers.  Rows are assembled in scratch memory, so this never
+    // reads back from the output (which may be uncached video memory).  Integer upscales
+    // repeat each sample a fixed number of times instead of looking up its span.
+    template <int bytesPerPixel, bool flipped, bool yuv, scaleMode_t scaleMode>
+    void blitUpscaledRows(renderSlice_t *slice) {
+        scalerPlan_t *plan = slice->plan;
+        int sourceXRes = plan->sourceXRes;
+        int screenXRes = plan->screenXRes;
+        ssize_t bytesPerRow = screenXRes * bytesPerPixel;
+
+        for (int y = slice->firstRow; y < slice->endRow; y++) {
+            int minRow = plan->rowStart[y];
+            int endRow = plan->rowStart[y + 1];
+            if (minRow == endRow) {
+                // Downscaling vertically, and a later source row covers this screen row.
+                continue;
+            }
+            const uint32_t *inRow = decodedSourceRow<yuv>(slice, flipped ? plan->sourceYRes - y - 1 : y);
+            if (flipped) {
+                g_reverseRow32(inRow, slice->reversedRow, sourceXRes);
+                inRow = slice->reversedRow;
+            }
+
+            uint32_t *rowOut32 = slice->scratchRow;
+            if (scaleMode == kScaleInteger) {
+                int xFactor = plan->xFactor;
+                for (int x = 0; x < sourceXRes; x++) {
+                    uint32_t sample = inRow[x];
+                    for (int i = 0; i < xFactor; i++) {
+                        *rowOut32++ = sample;
+                    }
+                }
+            } else {
+                const int *columnStart = plan->columnStart;
+                for (int x = 0; x < sourceXRes; x++) {
+                    uint32_t sample = inRow[x];
+                    for (int outX = columnStart[x]; outX < columnStart[x + 1]; outX++) {
+                        rowOut32[outX] = sample;
+                    }
+                }
+            }
+
+            // In 16bpp mode, convert the whole row at once with the vectorized kernel.
+            unsigned char *packedRow = (unsigned char *)slice->scratchRow;
+            if (bytesPerPixel != 4) {
+                packedRow = slice->packedRow;
+                g_convertRowTo16bpp(slice->scratchRow, (uint16_t *)packedRow, screenXRes);
+            }
+            for (int row = minRow; row < endRow; row++) {
+                slice->copyRow(screenRowAddress(slice, row), packedRow, bytesPerRow);
+            }
+        }
+    }
+
+    // The rotated paths.  Each screen row of a rotated picture is a source column, so
+    // drawing it row by row would read the frame a pixel per cache line.  Instead, this
+    // walks the screen in bands of TRANSPOSE_BLOCK_SIZE rows, gathers each 8x8 tile from
+    // eight short runs along source rows, transposes the tile into the band, and then
+    // writes the finished band out a row at a time.  UYVY runs are converted with the
+    // vectorized kernel before they are gathered.
+    template <int bytesPerPixel, bool yuv, bool clockwise>
+    void blitRotatedRows(renderSlice_t *slice) {
+        scalerPlan_t *plan = slice->plan;
+        int outputXRes = plan->outputXRes;
+        int bandStride = plan->bandStride;
+        const int *sourceRow = plan->sourceRow;
+        const bool boxFilter = use_box_filter;
+        uint32_t *band = slice->bandRows;
+        uint32_t tile[TRANSPOSE_BLOCK_SIZE * TRANSPOSE_BLOCK_SIZE] __attribute__((aligned(16)));
+        int columns[TRANSPOSE_BLOCK_SIZE], nextColumns[TRANSPOSE_BLOCK_SIZE];
+        bzero(tile, sizeof(tile));
+
+        for (int bandY = slice->firstRow; bandY < slice->endRow; bandY += TRANSPOSE_BLOCK_SIZE) {
+            // Every tile in the band reads the same source columns.
+            int rows = MIN(TRANSPOSE_BLOCK_SIZE, slice->endRow - bandY);
+            for (int i = 0; i < rows; i++) {
+                int outY = bandY + i;
+                columns[i] = plan->sourceColumn[clockwise ? outY : plan->screenXRes - outY - 1];
+                nextColumns[i] = (columns[i] + 1 < plan->sourceXRes) ? columns[i] + 1 : columns[i];
+            }
+            int firstX = MIN(columns[0], columns[rows - 1]) & ~1;
+            int endX = MIN(MAX(columns[0], columns[rows - 1]) + 2, plan->sourceXRes);
+
+            for (int tileX = 0; tileX < outputXRes; tileX += TRANSPOSE_BLOCK_SIZE) {
+                int tileColumns = MIN(TRANSPOSE_BLOCK_SIZE, outputXRes - tileX);
+
+                // Tile row j is screen column tileX + j, which is one row of the picture.
+                for (int j = 0; j < tileColumns; j++) {
+                    int outX = tileX + j;
+                    int y = sourceRow[clockwise ? plan->screenYRes - outX - 1 : outX];
+                    const uint32_t *inRow = decodedSourceColumns<yuv>(slice, y, slice->decodedRow, firstX, endX);
+                    uint32_t *tileRow = &tile[j * TRANSPOSE_BLOCK_SIZE];
+                    if (boxFilter) {
+                        const uint32_t *nextInRow = (y + 1 < plan->sourceYRes) ?
+                            decodedSourceColumns<yuv>(slice, y + 1, slice->reversedRow, firstX, endX) : inRow;
+                        for (int i = 0; i < rows; i++) {
+                            tileRow[i] = averageOfFourSamples(inRow[columns[i]], inRow[nextColumns[i]],
+                                                              nextInRow[columns[i]], nextInRow[nextColumns[i]]);
+                        }
+                    } else {
+                        for (int i = 0; i < rows; i++) {
+                            tileRow[i] = inRow[columns[i]];
+                        }
+                    }
+                }
+                g_transposeBlock32(tile, TRANSPOSE_BLOCK_SIZE, &band[tileX], bandStride);
+            }
+            for (int i = 0; i < rows; i++) {
+                storeRow<bytesPerPixel>(slice, &band[i * bandStride], screenRowAddress(slice, bandY + i), outputXRes);
+            }
+        }
+    }
+
+    template <int bytesPerPixel, bool flipped, bool yuv>
+    blitRowsFunc blitterForScaleMode(scaleMode_t scaleMode) {
+        switch (scaleMode) {
+            case kScaleIdentity:
+                return blitIdentityRows<bytesPerPixel, flipped, yuv>;
+            case kScaleInteger:
+                return blitUpscaledRows<bytesPerPixel, flipped, yuv, kScaleInteger>;
+            case kScaleDownscale:
+                return blitDownscaledRows<bytesPerPixel, flipped, yuv>;
+            case kScaleArbitrary:
+            default:
+                return blitUpscaledRows<bytesPerPixel, flipped, yuv, kScaleArbitrary>;
+        }
+    }
+
+    template <int bytesPerPixel, bool yuv>
+    blitRowsFunc blitterForRotation(int rotation) {
+        return (rotation == 90) ? blitRotatedRows<bytesPerPixel, yuv, true> :
+                                  blitRotatedRows<bytesPerPixel, yuv, false>;
+    }
+
+    template <int bytesPerPixel, bool flipped>
+    blitRowsFunc blitterForSourceFormat(scalerPlan_t *plan) {
+        if (plan->rotation != 0) {
+            return (plan->sourceBytesPerPixel == 2) ? blitterForRotation<bytesPerPixel, true>(plan->rotation) :
+                                                      blitterForRotation<bytesPerPixel, false>(plan->rotation);
+        }
+        return (plan->sourceBytesPerPixel == 2) ?
+            blitterForScaleMode<bytesPerPixel, flipped, true>(plan->scaleMode) :
+            blitterForScaleMode<bytesPerPixel, flipped, false>(plan->scaleMode);
+    }
+
+    // Returns the blitter specialized for the plan's geometry.  Anything that isn't 32bpp
+    // is drawn as RGB565.
+    blitRowsFunc selectBlitter(scalerPlan_t *plan) {
+        if (plan->bytesPerPixel == 4) {
+            return plan->flipped ? blitterForSourceFormat<4, true>(plan) :
+                                   blitterForSourceFormat<4, false>(plan);
+        }
+        return plan->flipped ? blitterForSourceFormat<2, true>(plan) :
+                               blitterForSourceFormat<2, false>(plan);
+    }
+
+    // Returns the number of rows that render slices divide up: screen rows when the
+    // blitter walks the screen, and source rows when it walks the source.
+    int sliceRowCount(scalerPlan_t *plan) {
+        if (plan->scaleMode == kScaleRotated) return plan->outputYRes;
+        return (plan->scaleMode == kScaleIdentity || plan->scaleMode == kScaleDownscale) ?
+            plan->screenYRes : plan->sourceYRes;
+    }
+
+    // Returns the first row of slice number `index`.  Rotated frames are split on whole
+    // bands of tiles, so that no tile straddles two slices.
+    int sliceBoundary(scalerPlan_t *plan, int rowCount, int index, int sliceCount) {
+        if (index >= sliceCount) return rowCount;
+        int row = (int)(((int64_t)rowCount * index) / sliceCount);
+        if (plan->scaleMode == kScaleRotated) {
+            row -= row % TRANSPOSE_BLOCK_SIZE;
+        }
+        return row;
+    }
+
+    void renderSlice(renderSlice_t *slice) {
+        slice->plan->blitRows(slice);
+    }
+
+    // Persistent render worker pool.  drawFrame splits each frame into horizontal bands,
+    // renders the first band itself, and hands the rest to these threads, then waits
+    // for all of them to finish before presenting the frame.
+    #define MIN_PIXELS_PER_RENDER_SLICE (128 * 1024)
+
+    typedef struct renderWorker {
+        pthread_t thread;
+        int index;
+        renderSlice_t slice;
+        int scratchWidth;
+    } renderWorker_t;
+
+    renderWorker_t *g_renderWorkers = NULL;
+    int g_renderWorkerCount = 0;
+    pthread_mutex_t g_renderPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t g_renderPoolWorkCondition = PTHREAD_COND_INITIALIZER;
+    pthread_cond_t g_renderPoolDoneCondition = PTHREAD_COND_INITIALIZER;
+    uint64_t g_renderPoolGeneration = 0;
+    int g_renderPoolActiveWorkers = 0;
+    int g_renderPoolPendingWorkers = 0;
+
+    void *runRenderWorker(void *workerRef) {
+        renderWorker_t *worker = (renderWorker_t *)workerRef;
+        uint64_t lastGeneration = 0;
+        while (true) {
+            pthread_mutex_lock(&g_renderPoolMutex);
+            while (g_renderPoolGeneration == lastGeneration) {
+                pthread_cond_wait(&g_renderPoolWorkCondition, &g_renderPoolMutex);
+            }
+            lastGeneration = g_renderPoolGeneration;
+            bool hasWork = worker->index < g_renderPoolActiveWorkers;
+            pthread_mutex_unlock(&g_renderPoolMutex);
+
+            if (!hasWork) continue;
+            renderSlice(&worker->slice);
+
+            pthread_mutex_lock(&g_renderPoolMutex);
+            if (--g_renderPoolPendingWorkers == 0) {
+                pthread_cond_signal(&g_renderPoolDoneCondition);
+            }
+            pthread_mutex_unlock(&g_renderPoolMutex);
+        }
+        return NULL;
+    }
 
-#else  // ! __linux__
-    // Mac
-    dispatch_sync(dispatch_get_main_queue(), ^{
-        NSRect frame = NSMakeRect(0, 0, video_recv->xres, video_recv->yres);
-        g_mainWindow = [[NSWindow alloc] initWithContentRect:frame
-                                                   styleMask:NSWindowStyleMaskTitled
-                                                     backing:NSBackingStoreBuffered
-                                                       defer:NO];
-        [g_mainWindow setBackgroundColor:[NSColor whiteColor]];
-        g_mainImageView = [[NSImageView alloc] initWithFrame:frame];
-        [[g_mainWindow contentView] addSubview:g_mainImageView];
-        [g_mainWindow makeKeyAndOrderFront:g_mainWindow];
-    });
+    void startRenderWorkers(void) {
+        int threadCount = render_thread_count;
+        if (threadCount <= 0) {
+            threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if (threadCount <= 1) return;
 
-    return true;
-#endif
-}
+        g_renderWorkers = (renderWorker_t *)calloc(threadCount - 1, sizeof(renderWorker_t));
+        for (int i = 0; i < threadCount - 1; i++) {
+            g_renderWorkers[i].index = i;
+            if (pthread_create(&g_renderWorkers[i].thread, NULL, runRenderWorker, &g_renderWorkers[i])) {
+                perror("cameracontroller: could not create render thread");
+                break;
+            }
+            g_renderWorkerCount++;
+        }
+        if (enable_debugging) {
+            fprintf(stderr, "Rendering with %d threads.\n", g_renderWorkerCount + 1);
+        }
+    }
 
-    uint16_t convert_sample_to_16bpp(uint32_t sample) {
-        // Input:  0xAA RR GG BB          // 32-bit LE integer: 8 bits each for ARGB (alpha high).
-        // Output: 0brrrrr gggggg bbbbb;  // 16-bit LE integer: 5 R, 6 G, 5 B (red high).
+    void renderFrameInSlices(NDIlib_video_frame_v2_t *video_recv, unsigned char *outBuf, scalerPlan_t *plan,
+                             bool outputIsFramebuffer) {
+        static bool started = false;
+        if (!started) {
+            startRenderWorkers();
+            started = true;
+        }
 
-        uint8_t r = (sample >> 16) & 0xff;
-        uint8_t g = (sample >>  8) & 0xff;
-        uint8_t b = (sample >>  0) & 0xff;
-        return ((r >> 3) << 11) | ((g >> 2) << 5) | (g >> 3);
+        int rowCount = sliceRowCount(plan);
+        int sliceCount = MIN(g_renderWorkerCount + 1,
+                             (plan->screenXRes * plan->screenYRes) / MIN_PIXELS_PER_RENDER_SLICE);
+        sliceCount = MAX(MIN(sliceCount, rowCount), 1);
+
+        renderSlice_t firstSlice = { video_recv, outBuf, plan, 0, sliceBoundary(plan, rowCount, 1, sliceCount),
+                                     plan->scratchRow, plan->packedRow, plan->reversedRow,
+                                     plan->decodedRow, plan->bandRows,
+                                     outputIsFramebuffer ? g_copyToFramebuffer : copy_to_framebuffer_scalar };
+        if (sliceCount == 1) {
+            renderSlice(&firstSlice);
+            return;
+        }
 
+        pthread_mutex_lock(&g_renderPoolMutex);
+        for (int i = 0; i < sliceCount - 1; i++) {
+            renderWorker_t *worker = &g_renderWorkers[i];
+            int scratchWidth = MAX(MAX(plan->screenXRes, plan->sourceXRes), plan->bandStride);
+            if (worker->scratchWidth < scratchWidth) {
+                free(worker->slice.scratchRow);
+                free(worker->slice.packedRow);
+                free(worker->slice.reversedRow);
+                free(worker->slice.decodedRow);
+                free(worker->slice.bandRows);
+                worker->slice.scratchRow = (uint32_t *)malloc(scratchWidth * sizeof(uint32_t));
+                worker->slice.packedRow = (unsigned char *)malloc(scratchWidth * sizeof(uint32_t));
+                worker->slice.reversedRow = (uint32_t *)malloc(scratchWidth * sizeof(uint32_t));
+                worker->slice.decodedRow = (uint32_t *)malloc(scratchWidth * sizeof(uint32_t));
+                worker->slice.bandRows = (uint32_t *)malloc(TRANSPOSE_BLOCK_SIZE * scratchWidth * sizeof(uint32_t));
+                worker->scratchWidth = scratchWidth;
+            }
+            worker->slice.video_recv = video_recv;
+            worker->slice.outBuf = outBuf;
+            worker->slice.plan = plan;
+            worker->slice.copyRow = firstSlice.copyRow;
+            worker->slice.firstRow = sliceBoundary(plan, rowCount, i + 1, sliceCount);
+            worker->slice.endRow = sliceBoundary(plan, rowCount, i + 2, sliceCount);
+        }
+        g_renderPoolActiveWorkers = sliceCount - 1;
+        g_renderPoolPendingWorkers = sliceCount - 1;
+        g_renderPoolGeneration++;
+        pthread_cond_broadcast(&g_renderPoolWorkCondition);
+        pthread_mutex_unlock(&g_renderPoolMutex);
+
+        renderSlice(&firstSlice);
+
+        // Wait for the other bands before the frame is presented.
+        pthread_mutex_lock(&g_renderPoolMutex);
+        while (g_renderPoolPendingWorkers > 0) {
+            pthread_cond_wait(&g_renderPoolDoneCondition, &g_renderPoolMutex);
+        }
+        pthread_mutex_unlock(&g_renderPoolMutex);
     }
 
-#ifdef __linux__
-    // This is a really weak scaling algorithm, intended to be as fast as possible, to leave
-    // as much CPU as possible free for decoding whatever crazy resolution or profile of H.264
-    // (or worse, H.265) the camera might throw in our direction.  Experimentally, the overhead
-    // of 32-bit to 16-bit conversion plus the overhead of doing even this minimal conversion
-    // exceeds what the Raspberry Pi 4 can handle at 1080p, at least with the vc4-fkms-v3d
-    // driver enabled, so if you want to add a better scaling algorithm, it needs to be
-    // configurable.
+    // Draws a whole frame on the calling thread, for threads that render in parallel
+    // with the presenter (and so can't share the render worker pool).
+    void renderWholeFrame(NDIlib_video_frame_v2_t *video_recv, unsigned char *outBuf, scalerPlan_t *plan,
+                          bool outputIsFramebuffer) {
+        renderSlice_t slice = { video_recv, outBuf, plan, 0, sliceRowCount(plan),
+                                plan->scratchRow, plan->packedRow, plan->reversedRow,
+                                plan->decodedRow, plan->bandRows,
+                                outputIsFramebuffer ? g_copyToFramebuffer : copy_to_framebuffer_scalar };
+        renderSlice(&slice);
+    }
+
+    // Blanks the page that the next frame is drawn into, including the letterbox borders.
+    // The page on screen is left alone, so that the picture doesn't flash black.  When page
+    // flipping, it is cleared as soon as it becomes the back page.  Otherwise, the whole
+    // offscreen buffer is copied over it anyway.
+    void clearFramebufferPages(framebufferOutput_t *output) {
+        ssize_t screenSize = output->stride * output->yres;
+        if (output->pageFlipping) {
+            bzero(output->activeMemory, screenSize);
+            output->otherPageNeedsClear = true;
+        }
+        if (output->offscreenBuffer != NULL) {
+            bzero(output->offscreenBuffer, screenSize);
+        }
+    }
 
-    // Takes frame coordinate and returns index into framebuffer.
-    uint32_t scaledRow(uint32_t y) {
-        return y * g_yScaleFactor;
+    // When page flipping, frames are drawn straight into the page that isn't on screen.
+    // Otherwise, they are drawn offscreen and copied to the screen after the vertical blank.
+    // Returns NULL if the offscreen buffer could not be allocated.
+    unsigned char *outputRenderTarget(framebufferOutput_t *output) {
+        if (output->pageFlipping) {
+            return output->activeMemory;
+        }
+        if (output->offscreenBuffer == NULL) {
+            void *offscreenBuffer = mmap(0, output->stride * output->yres, PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (offscreenBuffer == MAP_FAILED) {
+                perror("cameracontroller: offscreen buffer mmap");
+                return NULL;
+            }
+            output->offscreenBuffer = (unsigned char *)offscreenBuffer;
+        }
+        return output->offscreenBuffer;
     }
 
-    // Takes frame coordinate and returns index into framebuffer.
-    uint32_t scaledColumn(uint32_t x) {
-        return x * g_xScaleFactor;
+    // Mirror outputs (-X) show the same picture as the primary screen on other framebuffers,
+    // each at its own size, depth, and orientation.  Every NDI frame is received and decoded
+    // once.  Each mirror's thread then scales and converts it straight from the NDI buffer
+    // into that mirror's page with a scaler plan of its own, while the presenter draws the
+    // primary screen, so another display costs only its own blit.  A mirror that is still
+    // waiting for its own vertical blank skips a frame rather than holding up the primary
+    // screen.
+    #define MAX_MIRROR_OUTPUTS 3
+    #define MIRROR_PLAN_CACHE_SIZE 2
+
+    typedef struct mirrorOutput {
+        framebufferOutput_t output;
+        int quarterTurns;
+        bool configured;
+        bool failed;
+        scalerPlan_t planCache[MIRROR_PLAN_CACHE_SIZE];
+        scalerPlan_t *plan;
+        uint64_t planClock;
+        pthread_t thread;
+
+        // Protected by g_mirrorMutex.
+        NDIlib_video_frame_v2_t *frame;  // The frame to draw, until it has been drawn.
+        bool busy;                       // Drawing or showing a frame.
+    } mirrorOutput_t;
+
+    mirrorOutput_t g_mirrorOutputs[MAX_MIRROR_OUTPUTS];
+    int g_mirrorOutputCount = 0;
+    bool g_mirrorThreadsStarted = false;
+    pthread_mutex_t g_mirrorMutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t g_mirrorWorkCondition = PTHREAD_COND_INITIALIZER;
+    pthread_cond_t g_mirrorDoneCondition = PTHREAD_COND_INITIALIZER;
+
+    // Parses "<device>[:<degrees>]", where degrees is 0, 90, 180, or 270 clockwise.
+    // Returns the device path (which the caller frees), or NULL if the spec is invalid.
+    char *parseMirrorSpec(const char *spec, int *quarterTurns) {
+        const char *separator = strchr(spec, ':');
+        *quarterTurns = 0;
+        if (separator != NULL) {
+            int degrees = atoi(separator + 1);
+            if ((degrees != 0 && degrees != 90 && degrees != 180 && degrees != 270) ||
+                (degrees == 0 && strcmp(separator + 1, "0"))) {
+                return NULL;
+            }
+            *quarterTurns = degrees / 90;
+        }
+        size_t length = separator ? (size_t)(separator - spec) : strlen(spec);
+        return length ? strndup(spec, length) : NULL;
     }
 
-    bool drawFrame(NDIlib_video_frame_v2_t *video_recv) {
-        if (!configureScreen(video_recv)) {
+    bool addMirrorOutput(const char *spec) {
+        if (g_mirrorOutputCount == MAX_MIRROR_OUTPUTS) {
+            fprintf(stderr, "Too many mirror outputs.  Ignoring %s.\n", spec);
+            return false;
+        }
+        mirrorOutput_t *mirror = &g_mirrorOutputs[g_mirrorOutputCount];
+        char *devicePath = parseMirrorSpec(spec, &mirror->quarterTurns);
+        if (devicePath == NULL) {
+            fprintf(stderr, "Invalid mirror output %s.  (Expected a device, optionally followed by "
+                            ":0, :90, :180, or :270)\n", spec);
+            return false;
+        }
+        mirror->output.devicePath = devicePath;
+        mirror->output.fileHandle = -1;
+        g_mirrorOutputCount++;
+        return true;
+    }
+
+    // Draws a frame into the mirror's back page (or offscreen buffer).  Opens the device
+    // the first time.  Returns false if there is nothing new to show.
+    bool renderMirrorFrame(mirrorOutput_t *mirror, NDIlib_video_frame_v2_t *video_recv) {
+        if (!mirror->configured) {
+            mirror->configured = true;
+            mirror->failed = !openFramebufferOutput(&mirror->output);
+            if (mirror->failed) {
+                fprintf(stderr, "Could not open mirror output %s.  Not mirroring to it.\n",
+                        mirror->output.devicePath);
+            }
+        }
+        if (mirror->failed) return false;
+
+        bool changed;
+        mirror->plan = scalerPlanForFrame(mirror->planCache, MIRROR_PLAN_CACHE_SIZE, mirror->plan, &mirror->planClock,
+                                          video_recv, mirror->output.xres, mirror->output.yres,
+                                          mirror->output.bytesPerPixel, mirror->output.stride,
+                                          mirror->quarterTurns, g_magnification, &changed);
+        if (changed) {
+            clearFramebufferPages(&mirror->output);
+        }
+        unsigned char *renderTarget = outputRenderTarget(&mirror->output);
+        if (renderTarget == NULL) {
+            fprintf(stderr, "Not mirroring to %s.\n", mirror->output.devicePath);
+            mirror->failed = true;
             return false;
         }
+        renderWholeFrame(video_recv, renderTarget, mirror->plan, mirror->output.pageFlipping);
+        if (mirror->plan->magnification > 0) {
+            drawMagnificationIndicator(renderTarget + mirror->plan->screenOffset, mirror->plan->outputXRes,
+                                       mirror->plan->outputYRes, mirror->output.bytesPerPixel,
+                                       mirror->output.stride);
+        }
+        return true;
+    }
+
+    void *runMirrorOutput(void *mirrorRef) {
+        mirrorOutput_t *mirror = (mirrorOutput_t *)mirrorRef;
+        while (true) {
+            pthread_mutex_lock(&g_mirrorMutex);
+            while (mirror->frame == NULL) {
+                pthread_cond_wait(&g_mirrorWorkCondition, &g_mirrorMutex);
+            }
+            NDIlib_video_frame_v2_t *video_recv = mirror->frame;
+            pthread_mutex_unlock(&g_mirrorMutex);
 
-        ssize_t screenSize = g_framebufferActiveConfiguration.xres *
-                             g_framebufferActiveConfiguration.yres *
-                             monitor_bytes_per_pixel;
-        static unsigned char *tempBuf = NULL;
-        if (tempBuf == NULL) {
-            tempBuf = (unsigned char *)mmap(0, screenSize, PROT_READ | PROT_WRITE,
-                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            bool rendered = renderMirrorFrame(mirror, video_recv);
+
+            // The presenter frees the frame as soon as every mirror has drawn it.
+            pthread_mutex_lock(&g_mirrorMutex);
+            mirror->frame = NULL;
+            pthread_cond_broadcast(&g_mirrorDoneCondition);
+            pthread_mutex_unlock(&g_mirrorMutex);
+
+            if (rendered) {
+                presentRenderedFrame(&mirror->output, true);
+            }
+
+            pthread_mutex_lock(&g_mirrorMutex);
+            mirror->busy = false;
+            pthread_mutex_unlock(&g_mirrorMutex);
         }
-        if (g_xScaleFactor == 1.0 && g_yScaleFactor == 1.0 && monitor_bytes_per_pixel == 4 &&
-            !monitor_flipped && !force_slow_path) {
+        return NULL;
+    }
 
-            if (enable_verbose_debugging) {
-                fprintf(stderr, "fastpath\n");
+    // Hands a frame (which the caller has already checked can be drawn) to every mirror
+    // that isn't busy.
+    void startMirrorRenders(NDIlib_video_frame_v2_t *video_recv) {
+        if (g_mirrorOutputCount == 0) return;
+        if (!g_mirrorThreadsStarted) {
+            g_mirrorThreadsStarted = true;
+            for (int i = 0; i < g_mirrorOutputCount; i++) {
+                if (pthread_create(&g_mirrorOutputs[i].thread, NULL, runMirrorOutput, &g_mirrorOutputs[i])) {
+                    perror("cameracontroller: could not create mirror thread");
+                    g_mirrorOutputs[i].failed = true;
+                }
             }
+        }
 
-            bcopy(video_recv->p_data, tempBuf, screenSize);
-            drawOnScreenLights(tempBuf, g_framebufferXRes, g_framebufferYRes, monitor_bytes_per_pixel);
-        } else {
-            if (enable_verbose_debugging) {
-                fprintf(stderr, "slowpath (%f / %f)\n", g_xScaleFactor, g_yScaleFactor);
-            }
-            uint32_t *inBuf = (uint32_t *)video_recv->p_data;
-            uint16_t *outBuf16 = (uint16_t *)tempBuf;
-            uint32_t *outBuf32 = (uint32_t *)tempBuf;
-            for (int y = 0; y < video_recv->yres; y++) {
-                int minRow = scaledRow(y);
-                int maxRow = scaledRow(y+1) - 1;
-                for (int x = 0; x < video_recv->xres; x++) {
-                    int flippedX = monitor_flipped ? video_recv->xres - x - 1 : x;
-                    int flippedY = monitor_flipped ? video_recv->yres - y - 1 : y;
-                    uint32_t *inPos = &inBuf[(flippedY * video_recv->xres) + flippedX];
-                    for (int outX = scaledColumn(x); outX < scaledColumn(x+1); outX++) {
-                        if (monitor_bytes_per_pixel == 4) {
-                            uint32_t *outPos32 = &outBuf32[(minRow * g_framebufferXRes) + outX];
-                            *outPos32 = *inPos;
-                        } else {
-                            uint16_t *outPos16 = &outBuf16[(minRow * g_framebufferXRes) + outX];
-                            *outPos16 = convert_sample_to_16bpp(*inPos);
-                        }
-                    }
+        pthread_mutex_lock(&g_mirrorMutex);
+        for (int i = 0; i < g_mirrorOutputCount; i++) {
+            mirrorOutput_t *mirror = &g_mirrorOutputs[i];
+            if (!mirror->busy && !mirror->failed) {
+                mirror->frame = video_recv;
+                mirror->busy = true;
+            }
+        }
+        pthread_cond_broadcast(&g_mirrorWorkCondition);
+        pthread_mutex_unlock(&g_mirrorMutex);
+    }
+
+    // Waits until the mirrors are done with the frame that startMirrorRenders handed them.
+    void waitForMirrorRenders(void) {
+        if (g_mirrorOutputCount == 0) return;
+        pthread_mutex_lock(&g_mirrorMutex);
+        for (int i = 0; i < g_mirrorOutputCount; i++) {
+            while (g_mirrorOutputs[i].frame != NULL) {
+                pthread_cond_wait(&g_mirrorDoneCondition, &g_mirrorMutex);
+            }
+        }
+        pthread_mutex_unlock(&g_mirrorMutex);
+    }
+
+    // Draws a frame into the page that isn't on screen (or the offscreen buffer) without
+    // showing it.  Returns false if the screen could not be configured or drawn into, and sets
+    // *rendered to false if the frame can't be drawn and the previous one should stay up.
+    bool renderFrame(NDIlib_video_frame_v2_t *video_recv, bool *rendered) {
+        *rendered = false;
+        if (!configureScreen(video_recv)) {
+            return false;
+        }
+        if (!updateScalerPlanForFrame(video_recv)) {
+            // Leave the previous frame on the screen.
+            return true;
+        }
+
+        unsigned char *renderTarget = outputRenderTarget(&g_primaryOutput);
+        if (renderTarget == NULL) {
+            return false;
+        }
+        if (enable_verbose_debugging) {
+            fprintf(stderr, "scale mode %d (%dx%d to %dx%d)\n", g_scalerPlan->scaleMode, g_scalerPlan->sourceXRes,
+                    g_scalerPlan->sourceYRes, g_scalerPlan->screenXRes, g_scalerPlan->screenYRes);
+        }
+        startMirrorRenders(video_recv);
+        renderFrameInSlices(video_recv, renderTarget, g_scalerPlan, g_primaryOutput.pageFlipping);
+        renderPictureInPicture(renderTarget, g_primaryOutput.pageFlipping);
+        // Keep the lights on the picture itself.  Nothing redraws the borders.
+        drawOnScreenLights(renderTarget + g_scalerPlan->screenOffset, g_scalerPlan->outputXRes,
+                           g_scalerPlan->outputYRes, monitor_bytes_per_pixel, g_primaryOutput.stride,
+                           g_scalerPlan->rotation);
+        if (g_scalerPlan->magnification > 0) {
+            drawMagnificationIndicator(renderTarget + g_scalerPlan->screenOffset, g_scalerPlan->outputXRes,
+                                       g_scalerPlan->outputYRes, monitor_bytes_per_pixel, g_primaryOutput.stride);
+        }
+        waitForMirrorRenders();
+        *rendered = true;
+        return true;
+    }
+
+    // Shows the frame that was drawn into outputRenderTarget, by panning to its page or
+    // copying it to the screen.  Waits for the vertical blank first unless the caller just did.
+    void presentRenderedFrame(framebufferOutput_t *output, bool waitForVsync) {
+        ssize_t screenSize = output->stride * output->yres;
+        unsigned char *renderTarget = output->pageFlipping ? output->activeMemory : output->offscreenBuffer;
+
+        if (waitForVsync) {
+            int zero = 0;
+            if (ioctl(output->fileHandle, FBIO_WAITFORVSYNC, &zero) == -1) {
+                if (enable_debugging) perror("cameracontroller:  FBIO_WAITFORVSYNC");
+            }
+        }
+        if (output->pageFlipping) {
+            bool drewSecondPage = (renderTarget != output->base);
+            output->activeConfiguration.yoffset = drewSecondPage ? output->yres : 0;
+            if (ioctl(output->fileHandle, FBIOPAN_DISPLAY, &output->activeConfiguration) == -1) {
+                // The driver accepted the larger virtual screen but won't pan it.  Show
+                // this frame the slow way and stop page flipping.
+                perror("cameracontroller: FBIOPAN_DISPLAY");
+                output->pageFlipping = false;
+                output->activeConfiguration.yoffset = 0;
+                if (drewSecondPage) {
+                    g_copyToFramebuffer(output->base, renderTarget, screenSize);
                 }
-                for (int row = minRow + 1; row <= maxRow; row++) {
-                    if (monitor_bytes_per_pixel == 4) {
-                        bcopy(&outBuf32[(minRow * g_framebufferXRes)],
-                              &outBuf32[(row * g_framebufferXRes)], g_framebufferXRes * monitor_bytes_per_pixel);
-                    } else {
-                        bcopy(&outBuf16[(minRow * g_framebufferXRes)],
-                              &outBuf16[(row * g_framebufferXRes)], g_framebufferXRes * monitor_bytes_per_pixel);
-                    }
+            } else {
+                output->activeMemory = drewSecondPage ? output->base : output->base + screenSize;
+                if (output->otherPageNeedsClear) {
+                    bzero(output->activeMemory, screenSize);
+                    output->otherPageNeedsClear = false;
                 }
             }
-            drawOnScreenLights(tempBuf, g_framebufferXRes, g_framebufferYRes, monitor_bytes_per_pixel);
+        } else {
+            g_copyToFramebuffer(output->base, output->offscreenBuffer, screenSize);
         }
+    }
 
-        int zero = 0;
-        if (ioctl(g_framebufferFileHandle, FBIO_WAITFORVSYNC, &zero) == -1) {
-            if (enable_debugging) perror("cameracontroller:  FBIO_WAITFORVSYNC");
+    bool drawFrame(NDIlib_video_frame_v2_t *video_recv) {
+        bool rendered;
+        if (!renderFrame(video_recv, &rendered)) {
+            return false;
+        }
+        if (rendered) {
+            presentRenderedFrame(&g_primaryOutput, true);
         }
-        bcopy(tempBuf, g_framebufferBase, screenSize);
-
         return true;
     }
 
     void cleanupFrameBuffer(void) {
-        if (ioctl(g_framebufferFileHandle, FBIOPUT_VSCREENINFO, &g_initialFramebufferConfiguration) == -1) {
+        if (ioctl(g_primaryOutput.fileHandle, FBIOPUT_VSCREENINFO, &g_primaryOutput.initialConfiguration) == -1) {
             fprintf(stderr, "Ioctl FBIOPUT_VSCREENINFO error.\n");
         }
-        if (ioctl(g_framebufferFileHandle, FBIOGET_FSCREENINFO, &g_framebufferFixedConfiguration) == -1) {
+        if (ioctl(g_primaryOutput.fileHandle, FBIOGET_FSCREENINFO, &g_primaryOutput.fixedConfiguration) == -1) {
             fprintf(stderr, "Ioctl FBIOGET_FSCREENINFO.\n");
         }
-        munmap(g_framebufferMemory, g_framebufferFixedConfiguration.smem_len);
-        close(g_framebufferFileHandle);
+        munmap(g_primaryOutput.memory, g_primaryOutput.fixedConfiguration.smem_len);
+        close(g_primaryOutput.fileHandle);
+    }
+
+    // Multiviewer mode tiles several cameras onto one screen.  Each receive thread scales
+    // its own camera's frames into that camera's rectangle of a full-screen composition
+    // buffer, using its own scaler plans, so the tiles render in parallel on separate
+    // cores instead of through the render worker pool.  A single presenter copies the
+    // composition to the screen and flips once per vertical blank, whichever tiles have
+    // changed.  The tiles hold the composition lock for reading while they draw (they
+    // never overlap), and the presenter holds it for writing while it copies, so it never
+    // shows a half-drawn tile.
+    #define MULTIVIEW_PLAN_CACHE_SIZE 2
+
+    typedef struct multiviewTile {
+        int x, y, width, height;   // On the screen, in the screen's orientation.
+        scalerPlan_t planCache[MULTIVIEW_PLAN_CACHE_SIZE];
+        scalerPlan_t *plan;
+        uint64_t planClock;
+    } multiviewTile_t;
+
+    multiviewTile_t g_multiviewTiles[MAX_MULTIVIEW_SOURCES];
+    unsigned char *g_compositionBuffer = NULL;
+    pthread_mutex_t g_compositionSetupMutex = PTHREAD_MUTEX_INITIALIZER;
+    // Prefer the writer, or a steady stream of tile draws would starve the presenter.
+    pthread_rwlock_t g_compositionLock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+    // Turns a rectangle on the picture (the screen as seen in the picture's orientation)
+    // into the same rectangle on the screen, in the same way that computeFitRects
+    // positions a whole picture.
+    void pictureRectToScreen(int pictureX, int pictureY, int pictureWidth, int pictureHeight,
+                             int displayXRes, int displayYRes, bool flipped, int rotation,
+                             int *x, int *y, int *width, int *height) {
+        if (rotation == 90) {
+            // The top of the picture is along the right edge of the screen.
+            *x = displayXRes - pictureY - pictureHeight;
+            *y = pictureX;
+        } else if (rotation == 270) {
+            *x = pictureY;
+            *y = displayYRes - pictureX - pictureWidth;
+        } else if (flipped) {
+            *x = displayXRes - pictureX - pictureWidth;
+            *y = displayYRes - pictureY - pictureHeight;
+        } else {
+            *x = pictureX;
+            *y = pictureY;
+        }
+        *width = rotation ? pictureHeight : pictureWidth;
+        *height = rotation ? pictureWidth : pictureHeight;
+    }
+
+    // Lays out `count` tiles in the most nearly square grid, filled a row at a time, as
+    // seen in the picture's orientation.
+    void multiviewTileRect(int index, int count, int displayXRes, int displayYRes, bool flipped, int rotation,
+                           int *x, int *y, int *width, int *height) {
+        int columns = 1;
+        while (columns * columns < count) columns++;
+        int rows = (count + columns - 1) / columns;
+        int pictureXRes = rotation ? displayYRes : displayXRes;
+        int pictureYRes = rotation ? displayXRes : displayYRes;
+
+        int column = index % columns, row = index / columns;
+        int pictureX = (int)(((int64_t)pictureXRes * column) / columns);
+        int pictureY = (int)(((int64_t)pictureYRes * row) / rows);
+        int pictureWidth = (int)(((int64_t)pictureXRes * (column + 1)) / columns) - pictureX;
+        int pictureHeight = (int)(((int64_t)pictureYRes * (row + 1)) / rows) - pictureY;
+        pictureRectToScreen(pictureX, pictureY, pictureWidth, pictureHeight, displayXRes, displayYRes,
+                            flipped, rotation, x, y, width, height);
+    }
+
+    // The inset is a quarter of the screen's width and height, inset from the corner by
+    // a thirty-second of the screen's width, as seen in the picture's orientation.
+    #define PICTURE_IN_PICTURE_PLAN_CACHE_SIZE 2
+
+    scalerPlan_t g_pictureInPicturePlanCache[PICTURE_IN_PICTURE_PLAN_CACHE_SIZE];
+    scalerPlan_t *g_pictureInPicturePlan = NULL;
+    uint64_t g_pictureInPicturePlanClock = 0;
+
+    void pictureInPictureRect(screenCorner_t corner, int displayXRes, int displayYRes, bool flipped, int rotation,
+                              int *x, int *y, int *width, int *height) {
+        int pictureXRes = rotation ? displayYRes : displayXRes;
+        int pictureYRes = rotation ? displayXRes : displayYRes;
+        int insetXRes = MAX(pictureXRes / 4, 1), insetYRes = MAX(pictureYRes / 4, 1);
+        int margin = pictureXRes / 32;
+        bool right = (corner == kCornerTopRight || corner == kCornerBottomRight);
+        bool bottom = (corner == kCornerBottomLeft || corner == kCornerBottomRight);
+        int insetX = right ? pictureXRes - insetXRes - margin : margin;
+        int insetY = bottom ? pictureYRes - insetYRes - margin : margin;
+        pictureRectToScreen(insetX, insetY, insetXRes, insetYRes, displayXRes, displayYRes, flipped, rotation,
+                            x, y, width, height);
+    }
+
+    // Draws the newest picture-in-picture frame over the main picture in renderTarget.
+    // The inset gets a scaler plan of its own, so it is scaled straight from the second
+    // camera's frame into its corner of the page being drawn, touching only its own
+    // pixels, before that page is shown.  Called with g_presenterMutex held.
+    void renderPictureInPicture(unsigned char *renderTarget, bool outputIsFramebuffer) {
+        pendingFrame_t *frame = g_pictureInPictureMailbox.exchange(NULL);
+        if (frame != NULL) {
+            if (g_pictureInPictureFrame != NULL) {
+                discardPendingFrame(g_pictureInPictureFrame);
+            }
+            g_pictureInPictureFrame = frame;
+        }
+        if (g_pictureInPictureFrame == NULL) return;
+
+        NDIlib_video_frame_v2_t *video_recv = &g_pictureInPictureFrame->video_recv;
+        if (!frameFormatIsSupported(video_recv->FourCC) || video_recv->xres <= 0 || video_recv->yres <= 0) {
+            return;
+        }
+
+        bool flipped;
+        int rotation;
+        int x, y, width, height;
+        currentScreenOrientation(&flipped, &rotation);
+        pictureInPictureRect(pip_corner, g_primaryOutput.xres, g_primaryOutput.yres, flipped, rotation,
+                             &x, &y, &width, &height);
+        bool changed;
+        g_pictureInPicturePlan = scalerPlanForFrame(g_pictureInPicturePlanCache, PICTURE_IN_PICTURE_PLAN_CACHE_SIZE,
+                                                    g_pictureInPicturePlan, &g_pictureInPicturePlanClock,
+                                                    video_recv, width, height, monitor_bytes_per_pixel,
+                                                    g_primaryOutput.stride, screenQuarterTurns(), 0, &changed);
+        renderFrameInSlices(video_recv, renderTarget + (ssize_t)y * g_primaryOutput.stride + x * monitor_bytes_per_pixel,
+                            g_pictureInPicturePlan, outputIsFramebuffer);
+    }
+
+    // Configures the screen on the first frame from any camera, then lays out the tiles
+    // and allocates the composition buffer.
+    bool configureMultiview(NDIlib_video_frame_v2_t *video_recv) {
+        pthread_mutex_lock(&g_compositionSetupMutex);
+        bool configured = configureScreen(video_recv);
+        if (configured && g_compositionBuffer == NULL) {
+            bool flipped;
+            int rotation;
+            currentScreenOrientation(&flipped, &rotation);
+            for (int i = 0; i < g_multiviewTileCount; i++) {
+                multiviewTile_t *tile = &g_multiviewTiles[i];
+                multiviewTileRect(i, g_multiviewTileCount, g_primaryOutput.xres, g_primaryOutput.yres, flipped, rotation,
+                                  &tile->x, &tile->y, &tile->width, &tile->height);
+            }
+            void *compositionBuffer = mmap(0, g_primaryOutput.stride * g_primaryOutput.yres,
+                                           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (compositionBuffer == MAP_FAILED) {
+                perror("cameracontroller: composition buffer mmap");
+                configured = false;
+            } else {
+                g_compositionBuffer = (unsigned char *)compositionBuffer;
+                clearFramebufferPages(&g_primaryOutput);
+            }
+        }
+        pthread_mutex_unlock(&g_compositionSetupMutex);
+        return configured;
+    }
+
+    void clearMultiviewTile(multiviewTile_t *tile, unsigned char *tileBase) {
+        for (int y = 0; y < tile->height; y++) {
+            bzero(tileBase + (ssize_t)y * g_primaryOutput.stride, tile->width * monitor_bytes_per_pixel);
+        }
+    }
+
+    // Draws a frame into its camera's tile and asks the presenter to show it.  Called on
+    // that camera's receive thread.  Returns false if the screen could not be configured.
+    bool renderMultiviewTile(int tileIndex, NDIlib_video_frame_v2_t *video_recv) {
+        if (!configureMultiview(video_recv)) {
+            return false;
+        }
+        if (!frameFormatIsSupported(video_recv->FourCC) || video_recv->xres <= 0 || video_recv->yres <= 0) {
+            return true;
+        }
+
+        multiviewTile_t *tile = &g_multiviewTiles[tileIndex];
+        unsigned char *tileBase = g_compositionBuffer + (ssize_t)tile->y * g_primaryOutput.stride +
+                                  tile->x * monitor_bytes_per_pixel;
+        bool changed;
+        tile->plan = scalerPlanForFrame(tile->planCache, MULTIVIEW_PLAN_CACHE_SIZE, tile->plan, &tile->planClock,
+                                        video_recv, tile->width, tile->height, monitor_bytes_per_pixel,
+                                        g_primaryOutput.stride, screenQuarterTurns(), 0, &changed);
+        scalerPlan_t *plan = tile->plan;
+
+        pthread_rwlock_rdlock(&g_compositionLock);
+        if (changed) {
+            clearMultiviewTile(tile, tileBase);
+        }
+        renderWholeFrame(video_recv, tileBase, plan, false);
+        if (tileIndex == 0) {
+            // The lights belong to the camera that the joystick controls.
+            drawOnScreenLights(tileBase + plan->screenOffset, plan->outputXRes, plan->outputYRes,
+                               monitor_bytes_per_pixel, g_primaryOutput.stride, plan->rotation);
+        }
+        pthread_rwlock_unlock(&g_compositionLock);
+
+        sem_post(&g_frameMailboxSemaphore);
+        return true;
+    }
+
+    void *runMultiviewPresenterThread(void *argIgnored) {
+        while (true) {
+            sem_wait(&g_frameMailboxSemaphore);
+            if (exit_app) break;
+            // Any tiles drawn since the wakeup go out with this copy.
+            while (sem_trywait(&g_frameMailboxSemaphore) == 0);
+
+            ssize_t screenSize = g_primaryOutput.stride * g_primaryOutput.yres;
+            pthread_mutex_lock(&g_presenterMutex);
+            if (g_primaryOutput.pageFlipping) {
+                pthread_rwlock_wrlock(&g_compositionLock);
+                g_copyToFramebuffer(g_primaryOutput.activeMemory, g_compositionBuffer, screenSize);
+                pthread_rwlock_unlock(&g_compositionLock);
+                presentRenderedFrame(&g_primaryOutput, true);
+            } else {
+                int zero = 0;
+                if (ioctl(g_primaryOutput.fileHandle, FBIO_WAITFORVSYNC, &zero) == -1) {
+                    if (enable_debugging) perror("cameracontroller:  FBIO_WAITFORVSYNC");
+                }
+                pthread_rwlock_wrlock(&g_compositionLock);
+                g_copyToFramebuffer(g_primaryOutput.base, g_compositionBuffer, screenSize);
+                pthread_rwlock_unlock(&g_compositionLock);
+            }
+            uint64_t presented = ++g_framesPresented;
+            if (enable_verbose_debugging && (presented % 300) == 0) {
+                printFrameCounters();
+            }
+            pthread_mutex_unlock(&g_presenterMutex);
+        }
+        return NULL;
     }
 
 #else  // ! __linux__
@@ -1134,7 +4066,7 @@ bool configureScreen(NDIlib_video_frame_v2_t *video_recv) {
             unsigned char *datacopy = (unsigned char *)malloc(bufsize);
             bcopy(video_recv->p_data, datacopy, bufsize);
 
-            drawOnScreenLights(datacopy, video_recv->xres, video_recv->yres, 4);
+            drawOnScreenLights(datacopy, video_recv->xres, video_recv->yres, 4, video_recv->xres * 4, 0);
 
             CGContextRef bitmapBuffer = CGBitmapContextCreateWithData(datacopy, video_recv->xres, video_recv->yres,
                                                                       8, (video_recv->xres * 4), CGColorSpaceCreateDeviceRGB(),
@@ -1155,17 +4087,51 @@ enum onScreenColor {
     onScreenLightColorClear = 0,
     onScreenLightColorRed = 1,
     onScreenLightColorGreen = 2,
+    onScreenLightColorYellow = 3,
     onScreenLightColorBlue = 4,
     onScreenLightColorWhite = 7
 };
 
-void drawOnScreenLight(unsigned char *framebuffer_base, int xres, int bytes_per_pixel,
-                       int min_x, int max_x, int min_y, int max_y, enum onScreenColor color);
+#define ON_SCREEN_LIGHT_COUNT 7  // The status light, then lights 0 through 5.
+#define ON_SCREEN_COLOR_COUNT 8
 
-void drawOnScreenLights(unsigned char *framebuffer_base, int xres, int yres, int bytes_per_pixel) {
+typedef struct {
+    int minX, maxX, minY, maxY;  // Inclusive.
+} onScreenLightRect_t;
+
+// Everything about the lights that depends only on the screen, computed once per
+// configuration instead of once per pixel.
+typedef struct {
+    int xres, yres, bytesPerPixel;
+    ssize_t bytesPerRow;
+    int rotation;
+    onScreenLightRect_t lights[ON_SCREEN_LIGHT_COUNT];
+
+    // Indexed by onScreenColor.  At 16 bits per pixel, the value is repeated in both halves
+    // so that rows can be filled two pixels at a time.
+    uint32_t pixelValues[ON_SCREEN_COLOR_COUNT];
+} onScreenOverlay_t;
+
+onScreenOverlay_t g_onScreenOverlay;
+
+void prepareOnScreenOverlay(onScreenOverlay_t *overlay, int xres, int yres, int bytes_per_pixel,
+                            ssize_t bytes_per_row, int rotation);
+void fillOnScreenLight(const onScreenOverlay_t *overlay, unsigned char *framebuffer_base,
+                       int light, enum onScreenColor color);
+
+// xres and yres are the size of the picture on the screen, in the screen's orientation.
+// With a rotated screen, the lights turn with the picture.
+void drawOnScreenLights(unsigned char *framebuffer_base, int xres, int yres, int bytes_per_pixel,
+                        ssize_t bytes_per_row, int rotation) {
 #if __linux__
     if (g_use_on_screen_lights) {
 #endif // __linux__
+        onScreenOverlay_t *overlay = &g_onScreenOverlay;
+        if (overlay->xres != xres || overlay->yres != yres || overlay->bytesPerPixel != bytes_per_pixel ||
+            overlay->bytesPerRow != bytes_per_row || overlay->rotation != rotation) {
+            prepareOnScreenOverlay(overlay, xres, yres, bytes_per_pixel, bytes_per_row, rotation);
+        }
+
         motionData_t motionData = getMotionData();
 
         enum onScreenColor statusColor =
@@ -1174,63 +4140,22 @@ void drawOnScreenLights(unsigned char *framebuffer_base, int xres, int yres, int
             (g_camera_malfunctioning) ? onScreenLightColorBlue :
             onScreenLightColorClear;
 
+        // Every frame repaints the whole picture, so each lit light must be filled again,
+        // but unlit lights need nothing at all.
         if (statusColor != onScreenLightColorClear) {
-            drawOnScreenLight(framebuffer_base, xres, bytes_per_pixel,
-                              LIGHT_STATUS_X_MIN(xres), LIGHT_STATUS_X_MAX(xres),
-                              LIGHT_STATUS_Y_MIN(yres), LIGHT_STATUS_Y_MAX(yres), statusColor);
-        }
-        if (motionData.light[0]) {
-            drawOnScreenLight(framebuffer_base, xres, bytes_per_pixel,
-                              LIGHT_0_X_MIN(xres), LIGHT_0_X_MAX(xres),
-                              LIGHT_0_Y_MIN(yres), LIGHT_0_Y_MAX(yres), onScreenLightColorWhite);
-        }
-        if (motionData.light[1]) {
-            drawOnScreenLight(framebuffer_base, xres, bytes_per_pixel,
-                              LIGHT_1_X_MIN(xres), LIGHT_1_X_MAX(xres),
-                              LIGHT_1_Y_MIN(yres), LIGHT_1_Y_MAX(yres), onScreenLightColorWhite);
-        }
-        if (motionData.light[2]) {
-            drawOnScreenLight(framebuffer_base, xres, bytes_per_pixel,
-                              LIGHT_2_X_MIN(xres), LIGHT_2_X_MAX(xres),
-                              LIGHT_2_Y_MIN(yres), LIGHT_2_Y_MAX(yres), onScreenLightColorWhite);
-        }
-        if (motionData.light[3]) {
-            drawOnScreenLight(framebuffer_base, xres, bytes_per_pixel,
-                              LIGHT_3_X_MIN(xres), LIGHT_3_X_MAX(xres),
-                              LIGHT_3_Y_MIN(yres), LIGHT_3_Y_MAX(yres), onScreenLightColorWhite);
-        }
-        if (motionData.light[4]) {
-            drawOnScreenLight(framebuffer_base, xres, bytes_per_pixel,
-                              LIGHT_4_X_MIN(xres), LIGHT_4_X_MAX(xres),
-                              LIGHT_4_Y_MIN(yres), LIGHT_4_Y_MAX(yres), onScreenLightColorWhite);
-        }
-        if (motionData.light[5]) {
-            drawOnScreenLight(framebuffer_base, xres, bytes_per_pixel,
-                              LIGHT_5_X_MIN(xres), LIGHT_5_X_MAX(xres),
-                              LIGHT_5_Y_MIN(yres), LIGHT_5_Y_MAX(yres), onScreenLightColorWhite);
+            fillOnScreenLight(overlay, framebuffer_base, 0, statusColor);
+        }
+        for (int light = 0; light < ON_SCREEN_LIGHT_COUNT - 1; light++) {
+            if (motionData.light[light]) {
+                fillOnScreenLight(overlay, framebuffer_base, light + 1, onScreenLightColorWhite);
+            }
         }
 #if __linux__
     }
 #endif // __linux__
 }
 
-void drawLightPixel(unsigned char *framebuffer_base, ssize_t offset, int color, int bytes_per_pixel);
-void drawOnScreenLight(unsigned char *framebuffer_base, int xres, int bytes_per_pixel,
-                       int min_x, int max_x, int min_y, int max_y, enum onScreenColor color) {
-    ssize_t bytes_per_row = (xres * bytes_per_pixel);
-    ssize_t first_row_offset = (bytes_per_row * min_y);
-    ssize_t last_row_offset = (bytes_per_row * (max_y + 1));
-
-    for (ssize_t row_start = first_row_offset; row_start < last_row_offset; row_start += bytes_per_row) {
-        for (ssize_t rowpos = row_start + (min_x * bytes_per_pixel);
-             rowpos < row_start + ((max_x + 1) * bytes_per_pixel);
-             rowpos += bytes_per_pixel) {
-            drawLightPixel(framebuffer_base, rowpos, color, bytes_per_pixel);
-        }
-    }
-}
-
-void drawLightPixel(unsigned char *framebuffer_base, ssize_t offset, int color, int bytes_per_pixel) {
+uint32_t onScreenColorPixelValue(enum onScreenColor color, int bytes_per_pixel) {
     bool red = color & onScreenLightColorRed;
     bool green = color & onScreenLightColorGreen;
     bool blue = color & onScreenLightColorBlue;
@@ -1238,14 +4163,150 @@ void drawLightPixel(unsigned char *framebuffer_base, ssize_t offset, int color,
     uint32_t pixelValue = (red ? 0xFF0000 : 0) | (green ? 0x00FF00 : 0) | (blue ? 0x0000FF : 0);
 
     if (bytes_per_pixel == 4) {
-        uint32_t *pixel = (uint32_t *)(&framebuffer_base[offset]);
-        *pixel = pixelValue;
-    } else {
-        // Assume 2.
-        uint16_t *pixel = (uint16_t *)(&framebuffer_base[offset]);
-        *pixel = convert_sample_to_16bpp(pixelValue);
+        return pixelValue;
+    }
+    // Assume 2.
+    uint32_t pixelValue16 = convert_sample_to_16bpp(pixelValue);
+    return pixelValue16 | (pixelValue16 << 16);
+}
+
+void prepareOnScreenOverlay(onScreenOverlay_t *overlay, int xres, int yres, int bytes_per_pixel,
+                            ssize_t bytes_per_row, int rotation) {
+    overlay->xres = xres;
+    overlay->yres = yres;
+    overlay->bytesPerPixel = bytes_per_pixel;
+    overlay->bytesPerRow = bytes_per_row;
+    overlay->rotation = rotation;
+
+    // Lay the lights out on the picture, then turn them to match the screen.
+    int screenXRes = xres, screenYRes = yres;
+    if (rotation != 0) {
+        xres = screenYRes;
+        yres = screenXRes;
+    }
+
+    const onScreenLightRect_t lights[ON_SCREEN_LIGHT_COUNT] = {
+        { (int)LIGHT_STATUS_X_MIN(xres), (int)LIGHT_STATUS_X_MAX(xres),
+          (int)LIGHT_STATUS_Y_MIN(yres), (int)LIGHT_STATUS_Y_MAX(yres) },
+        { (int)LIGHT_0_X_MIN(xres), (int)LIGHT_0_X_MAX(xres), (int)LIGHT_0_Y_MIN(yres), (int)LIGHT_0_Y_MAX(yres) },
+        { (int)LIGHT_1_X_MIN(xres), (int)LIGHT_1_X_MAX(xres), (int)LIGHT_1_Y_MIN(yres), (int)LIGHT_1_Y_MAX(yres) },
+        { (int)LIGHT_2_X_MIN(xres), (int)LIGHT_2_X_MAX(xres), (int)LIGHT_2_Y_MIN(yres), (int)LIGHT_2_Y_MAX(yres) },
+        { (int)LIGHT_3_X_MIN(xres), (int)LIGHT_3_X_MAX(xres), (int)LIGHT_3_Y_MIN(yres), (int)LIGHT_3_Y_MAX(yres) },
+        { (int)LIGHT_4_X_MIN(xres), (int)LIGHT_4_X_MAX(xres), (int)LIGHT_4_Y_MIN(yres), (int)LIGHT_4_Y_MAX(yres) },
+        { (int)LIGHT_5_X_MIN(xres), (int)LIGHT_5_X_MAX(xres), (int)LIGHT_5_Y_MIN(yres), (int)LIGHT_5_Y_MAX(yres) },
+    };
+    for (int light = 0; light < ON_SCREEN_LIGHT_COUNT; light++) {
+        // Keep custom configurations from drawing outside the picture.
+        onScreenLightRect_t rect = lights[light];
+        rect.minX = MAX(rect.minX, 0);
+        rect.minY = MAX(rect.minY, 0);
+        rect.maxX = MIN(rect.maxX, xres - 1);
+        rect.maxY = MIN(rect.maxY, yres - 1);
+        if (rotation == 90) {
+            onScreenLightRect_t rotated = { screenXRes - 1 - rect.maxY, screenXRes - 1 - rect.minY,
+                                            rect.minX, rect.maxX };
+            rect = rotated;
+        } else if (rotation == 270) {
+            onScreenLightRect_t rotated = { rect.minY, rect.maxY,
+                                            screenYRes - 1 - rect.maxX, screenYRes - 1 - rect.minX };
+            rect = rotated;
+        }
+        overlay->lights[light] = rect;
+    }
+
+    for (int color = 0; color < ON_SCREEN_COLOR_COUNT; color++) {
+        overlay->pixelValues[color] = onScreenColorPixelValue((enum onScreenColor)color, bytes_per_pixel);
+    }
+}
+
+// Fills count 32-bit words with value.  The framebuffer is only ever written, never read.
+// Like the framebuffer copy kernels, this uses ordinary stores up to the first line
+// boundary, then writes whole lines with non-temporal stores.
+void fillSpan32(uint32_t *out, ssize_t count, uint32_t value) {
+    ssize_t x = 0;
+#if defined(__SSE2__) || defined(__aarch64__)
+    ssize_t head = MIN((ssize_t)((FRAMEBUFFER_LINE_SIZE - ((uintptr_t)out % FRAMEBUFFER_LINE_SIZE)) %
+                                 FRAMEBUFFER_LINE_SIZE) / (ssize_t)sizeof(uint32_t), count);
+    for (; x < head; x++) {
+        out[x] = value;
+    }
+    const ssize_t wordsPerLine = FRAMEBUFFER_LINE_SIZE / sizeof(uint32_t);
+#endif
+#if defined(__SSE2__)
+    __m128i vector = _mm_set1_epi32((int)value);
+    for (; x + wordsPerLine <= count; x += wordsPerLine) {
+        _mm_stream_si128((__m128i *)&out[x], vector);
+        _mm_stream_si128((__m128i *)&out[x + 4], vector);
+        _mm_stream_si128((__m128i *)&out[x + 8], vector);
+        _mm_stream_si128((__m128i *)&out[x + 12], vector);
+    }
+#elif defined(__aarch64__)
+    uint32x4_t vector = vdupq_n_u32(value);
+    for (; x + wordsPerLine <= count; x += wordsPerLine) {
+        __asm__ volatile("stnp %q0, %q0, [%1]\n\t"
+                         "stnp %q0, %q0, [%1, #32]"
+                         : : "w"(vector), "r"(&out[x]) : "memory");
+    }
+#endif
+    for (; x < count; x++) {
+        out[x] = value;
+    }
+#if defined(__SSE2__)
+    _mm_sfence();
+#endif
+}
+
+// Fills a rectangle with a single span store per row.  pixelValue is as returned by
+// onScreenColorPixelValue.
+void fillScreenRect(unsigned char *framebuffer_base, ssize_t bytes_per_row, int bytes_per_pixel,
+                    const onScreenLightRect_t *rect, uint32_t pixelValue) {
+    ssize_t width = rect->maxX + 1 - rect->minX;
+    if (width <= 0) return;
+
+    for (int row = rect->minY; row <= rect->maxY; row++) {
+        unsigned char *out = framebuffer_base + (row * bytes_per_row) + (rect->minX * bytes_per_pixel);
+        if (bytes_per_pixel == 4) {
+            fillSpan32((uint32_t *)out, width, pixelValue);
+        } else {
+            // Assume 2.  Align to a 32-bit boundary, then fill two pixels at a time.
+            uint16_t *out16 = (uint16_t *)out;
+            ssize_t remaining = width;
+            if (((uintptr_t)out16 & 2) != 0) {
+                *out16++ = (uint16_t)pixelValue;
+                remaining--;
+            }
+            fillSpan32((uint32_t *)out16, remaining / 2, pixelValue);
+            if (remaining & 1) {
+                out16[remaining - 1] = (uint16_t)pixelValue;
+            }
+        }
+    }
+}
+
+void fillOnScreenLight(const onScreenOverlay_t *overlay, unsigned char *framebuffer_base,
+                       int light, enum onScreenColor color) {
+    fillScreenRect(framebuffer_base, overlay->bytesPerRow, overlay->bytesPerPixel, &overlay->lights[light],
+                   overlay->pixelValues[color]);
+}
+
+#ifdef __linux__
+// Frames a magnified picture in yellow, so that nobody mistakes it for the whole shot.
+// The border is the same on every side, so it needs no rotating.
+void drawMagnificationIndicator(unsigned char *framebuffer_base, int xres, int yres, int bytes_per_pixel,
+                                ssize_t bytes_per_row) {
+    int thickness = MIN(MAX(MIN(xres, yres) / 120, 2), MIN(xres, yres) / 2);
+    uint32_t pixelValue = onScreenColorPixelValue(onScreenLightColorYellow, bytes_per_pixel);
+    const onScreenLightRect_t edges[4] = {
+        { 0, xres - 1, 0, thickness - 1 },
+        { 0, xres - 1, yres - thickness, yres - 1 },
+        { 0, thickness - 1, thickness, yres - thickness - 1 },
+        { xres - thickness, xres - 1, thickness, yres - thickness - 1 }
+    };
+    for (int edge = 0; edge < 4; edge++) {
+        fillScreenRect(framebuffer_base, bytes_per_row, bytes_per_pixel, &edges[edge], pixelValue);
     }
 }
+#endif  // __linux__
 
 #pragma mark - VISCA Service Discovery
 
@@ -1445,7 +4506,7 @@ void handleDNSResponse(const struct sockaddr *address) {
     // port than the port we send to, which makes connected UDP sockets impossible.  This
     // sucks from a performance perspective, but we work around it by not connecting the
     // socket.
-    g_visca_sock = connectToVISCAPortWithAddress(address);
+    setVISCASocket(connectToVISCAPortWithAddress(address));
     if (g_visca_sock == -1) {
         fprintf(stderr, "VISCA failed.");
         return;
@@ -1604,7 +4665,7 @@ void handleDNSServiceGetAddrInfoReply(DNSServiceRef sdRef,
     if (errorCode != kDNSServiceErr_NoError) {
         fprintf(stderr, "Service resolver for VISCA failed (error %d)\n", errorCode);
     } else {
-        g_visca_sock = connectToVISCAPortWithAddress(address);
+        setVISCASocket(connectToVISCAPortWithAddress(address));
         if (g_visca_sock == -1) {
             fprintf(stderr, "VISCA failed.");
             if (flags & kDNSServiceFlagsMoreComing) { return; }  // Keep browsing until we have a full response.
@@ -1624,6 +4685,47 @@ void handleDNSServiceGetAddrInfoReply(DNSServiceRef sdRef,
 
 #pragma mark - VISCA Core
 
+// Over TCP, drive commands are a few bytes each and must not wait for Nagle's algorithm,
+// and a camera that has gone away should be noticed in seconds, not hours.
+#define VISCA_TCP_KEEPALIVE_IDLE 2        // Seconds.
+#define VISCA_TCP_KEEPALIVE_INTERVAL 1    // Seconds.
+#define VISCA_TCP_KEEPALIVE_COUNT 3
+#define VISCA_TCP_USER_TIMEOUT 3000       // Milliseconds that sent data may go unacknowledged.
+
+#ifdef MSG_NOSIGNAL
+#define VISCA_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define VISCA_SEND_FLAGS 0                // SO_NOSIGPIPE is set on the socket instead.
+#endif
+
+void setVISCASocketOption(int sock, int level, int option, int value, const char *name) {
+    if (setsockopt(sock, level, option, &value, sizeof(value)) != 0) {
+        fprintf(stderr, "Could not set %s on VISCA socket: %s\n", name, strerror(errno));
+    }
+}
+
+void configureVISCATCPSocket(int sock) {
+    setVISCASocketOption(sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    setVISCASocketOption(sock, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+#ifdef TCP_KEEPIDLE
+    setVISCASocketOption(sock, IPPROTO_TCP, TCP_KEEPIDLE, VISCA_TCP_KEEPALIVE_IDLE, "TCP_KEEPIDLE");
+#elif defined(TCP_KEEPALIVE)
+    setVISCASocketOption(sock, IPPROTO_TCP, TCP_KEEPALIVE, VISCA_TCP_KEEPALIVE_IDLE, "TCP_KEEPALIVE");
+#endif
+#ifdef TCP_KEEPINTVL
+    setVISCASocketOption(sock, IPPROTO_TCP, TCP_KEEPINTVL, VISCA_TCP_KEEPALIVE_INTERVAL, "TCP_KEEPINTVL");
+#endif
+#ifdef TCP_KEEPCNT
+    setVISCASocketOption(sock, IPPROTO_TCP, TCP_KEEPCNT, VISCA_TCP_KEEPALIVE_COUNT, "TCP_KEEPCNT");
+#endif
+#ifdef TCP_USER_TIMEOUT
+    setVISCASocketOption(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, VISCA_TCP_USER_TIMEOUT, "TCP_USER_TIMEOUT");
+#endif
+#ifdef SO_NOSIGPIPE
+    setVISCASocketOption(sock, SOL_SOCKET, SO_NOSIGPIPE, 1, "SO_NOSIGPIPE");
+#endif
+}
+
 int connectToVISCAPortWithAddress(const struct sockaddr *address) {
     struct sockaddr_in sa;
     memcpy((void *)&sa, (void *)address, sizeof(struct sockaddr_in));
@@ -1662,6 +4764,7 @@ int connectToVISCAPortWithAddress(const struct sockaddr *address) {
     if (g_visca_use_udp) {
         g_visca_addr = sa;
     } else {
+        configureVISCATCPSocket(sock);
         if (connect(sock, (struct sockaddr *) &sa, sizeof(sa)) == -1) {
             perror("Connect failed");
             close(sock);
@@ -1692,12 +4795,218 @@ void sendPTZUpdatesOverVISCA(motionData_t *motionData) {
         sendManualExposureOverVISCA(g_visca_sock);
 #endif
     }
-#endif
+#endif
+}
+
+static uint32_t g_visca_sequence_number = 0;
+
+#pragma mark - VISCA codec
+
+// Commands are encoded into fixed-size packets on the caller's stack, and responses are
+// parsed in place, as views into the buffer they were received into, so sending and
+// receiving allocate nothing.  Each fixed command layout has a packet type of its exact
+// size, and a layout too large for the engine's queue entries fails to compile.
+#define VISCA_MAX_PACKET_SIZE 24          // Without the VISCA-over-IP header.
+#define VISCA_HEADER_SIZE 8               // VISCA over IP (UDP).
+#define VISCA_PAYLOAD_TYPE_COMMAND 0x0100
+#define VISCA_PAYLOAD_TYPE_INQUIRY 0x0110
+#define VISCA_PAYLOAD_TYPE_REPLY 0x0111
+#define VISCA_PAYLOAD_TYPE_CONTROL 0x0200
+#define VISCA_PAYLOAD_TYPE_CONTROL_REPLY 0x0201
+#define VISCA_CONTROL_RESET 0x01          // Resets the camera's sequence number.  Also its ack.
+#define VISCA_CONTROL_ERROR 0x0F          // Then 0x01 (bad sequence number) or 0x02 (bad message).
+#define VISCA_RESET_PACKET_SIZE (VISCA_HEADER_SIZE + 1)
+
+template <size_t N>
+struct viscaPacket {
+    static_assert(N >= 3 && N <= VISCA_MAX_PACKET_SIZE, "VISCA packets must fit in a queue entry.");
+    uint8_t bytes[N];
+};
+
+typedef viscaPacket<6> viscaZoomDrive_t;
+typedef viscaPacket<8> viscaExtendedZoomDrive_t;          // Nonstandard (VISCAPTZ).
+typedef viscaPacket<9> viscaPanTiltDrive_t;
+typedef viscaPacket<13> viscaExtendedPanTiltDrive_t;      // Nonstandard (VISCAPTZ).
+typedef viscaPacket<7> viscaPresetCommand_t;
+
+// A message from the camera, pointing into the buffer that it was received into.
+typedef struct viscaMessage {
+    uint16_t payloadType;              // From the VISCA-over-IP header, if any.
+    bool hasSequenceNumber;
+    uint32_t sequenceNumber;
+    const uint8_t *payload;            // From the address byte through the 0xFF terminator.
+    ssize_t length;
+    int responseType;                  // 4 = ack, 5 = completion or answer, 6 = error.
+    int cameraSocket;
+} viscaMessage_t;
+
+// The levels are signed speeds, computed from the joystick position.  Zero stops.
+viscaZoomDrive_t encodeVISCAZoomDrive(int level) {
+    viscaZoomDrive_t packet = {{ 0x81, 0x01, 0x04, 0x07, 0x00, 0xFF }};
+    if (level != 0) {
+        packet.bytes[4] = (abs(level) - 1) | (level < 0 ? 0x20 : 0x30);
+    }
+    return packet;
+}
+
+viscaExtendedZoomDrive_t encodeVISCAExtendedZoomDrive(int level) {
+    viscaExtendedZoomDrive_t packet = {{ 0x81, 0x01, 0x04, 0x07, 0x00, 0x00, 0x00, 0xFF }};
+    packet.bytes[4] = (level < 0) ? 0x2f : 0x3f;
+    packet.bytes[5] = (abs(level) >> 8) & 0xff;
+    packet.bytes[6] = abs(level) & 0xff;
+    return packet;
+}
+
+uint8_t viscaDirection(int level) {
+    return level > 0 ? 0x01 : level < 0 ? 0x02 : 0x03;
+}
+
+viscaPanTiltDrive_t encodeVISCAPanTiltDrive(int panLevel, int tiltLevel) {
+    viscaPanTiltDrive_t packet = {{ 0x81, 0x01, 0x06, 0x01,
+                                    (uint8_t)(abs(panLevel) ?: 1),   // Pan speed: 1 to 24 (0x18)
+                                    (uint8_t)(abs(tiltLevel) ?: 1),  // Tilt speed: 1 to 23 (0x17)
+                                    viscaDirection(panLevel), viscaDirection(tiltLevel), 0xFF }};
+    return packet;
+}
+
+viscaExtendedPanTiltDrive_t encodeVISCAExtendedPanTiltDrive(int panLevel, int tiltLevel) {
+    viscaExtendedPanTiltDrive_t packet = {{ 0x81, 0x01, 0x06, 0x01, 0x00, 0x00, // Extended command.
+                                            (uint8_t)((abs(panLevel) >> 8) & 0xff),
+                                            (uint8_t)(abs(panLevel) & 0xff),    // Pan (big endian)
+                                            (uint8_t)((abs(tiltLevel) >> 8) & 0xff),
+                                            (uint8_t)(abs(tiltLevel) & 0xff),   // Tilt (big endian)
+                                            viscaDirection(panLevel), viscaDirection(tiltLevel), 0xFF }};
+    return packet;
+}
+
+viscaPresetCommand_t encodeVISCAPreset(bool store, uint8_t presetNumber) {
+    viscaPresetCommand_t packet = {{ 0x81, 0x01, 0x04, 0x3F, (uint8_t)(store ? 0x01 : 0x02), presetNumber, 0xFF }};
+    return packet;
+}
+
+// Writes the VISCA-over-IP header into the first VISCA_HEADER_SIZE bytes of header.
+void encodeVISCAHeader(uint8_t *header, uint16_t payloadType, ssize_t length, uint32_t sequenceNumber) {
+    header[0] = payloadType >> 8;
+    header[1] = payloadType & 0xff;
+    header[2] = 0x00;
+    header[3] = (uint8_t)length;
+    header[4] = sequenceNumber >> 24;
+    header[5] = (sequenceNumber >> 16) & 0xff;
+    header[6] = (sequenceNumber >> 8) & 0xff;
+    header[7] = sequenceNumber & 0xff;
+}
+
+// Writes a whole VISCA_RESET_PACKET_SIZE-byte control packet.  The camera ignores the
+// sequence number and expects zero next.
+void encodeVISCAReset(uint8_t *packet, uint32_t sequenceNumber) {
+    encodeVISCAHeader(packet, VISCA_PAYLOAD_TYPE_CONTROL, 1, sequenceNumber);
+    packet[VISCA_HEADER_SIZE] = VISCA_CONTROL_RESET;
+}
+
+// Parses one message without copying it.  hasHeader is true for VISCA over IP (UDP).
+// Returns false if the message is malformed.  Control replies (any payload type other
+// than VISCA_PAYLOAD_TYPE_REPLY) are returned with a responseType of 0.
+bool parseVISCAMessage(const uint8_t *data, ssize_t length, bool hasHeader, viscaMessage_t *message) {
+    bzero(message, sizeof(*message));
+    if (hasHeader) {
+        if (length < VISCA_HEADER_SIZE) return false;
+        message->payloadType = (uint16_t)(data[0] << 8 | data[1]);
+        message->hasSequenceNumber = true;
+        message->sequenceNumber = ((uint32_t)data[4] << 24) | ((uint32_t)data[5] << 16) |
+                                  ((uint32_t)data[6] << 8) | data[7];
+        data += VISCA_HEADER_SIZE;
+        length -= VISCA_HEADER_SIZE;
+    } else {
+        message->payloadType = VISCA_PAYLOAD_TYPE_REPLY;
+    }
+    message->payload = data;
+    message->length = length;
+    if (message->payloadType != VISCA_PAYLOAD_TYPE_REPLY) return true;
+
+    if (length < 3 || data[length - 1] != 0xff) return false;
+    message->responseType = data[1] >> 4;
+    message->cameraSocket = data[1] & 0xf;
+    return true;
+}
+
+// Reassembles a VISCA byte stream (TCP) into 0xFF-terminated messages.  A read may hold
+// part of a message, or several.  Complete messages are returned as views into the buffer.
+#define VISCA_STREAM_BUFFER_SIZE 1024
+
+typedef struct viscaStreamParser {
+    uint8_t buffer[VISCA_STREAM_BUFFER_SIZE];
+    ssize_t start;                     // The first byte not yet returned as a message.
+    ssize_t length;                    // Bytes received into the buffer.
+} viscaStreamParser_t;
+
+void resetVISCAStreamParser(viscaStreamParser_t *parser) {
+    parser->start = 0;
+    parser->length = 0;
+}
+
+// Returns where the next read should go, and sets *space to its size.  This moves any
+// partial message to the front, invalidating the views returned so far.
+uint8_t *viscaStreamReadSpace(viscaStreamParser_t *parser, ssize_t *space) {
+    if (parser->start > 0) {
+        memmove(parser->buffer, parser->buffer + parser->start, parser->length - parser->start);
+        parser->length -= parser->start;
+        parser->start = 0;
+    }
+    if (parser->length == VISCA_STREAM_BUFFER_SIZE) {
+        // A whole buffer without a terminator isn't VISCA.  Start over.
+        parser->length = 0;
+    }
+    *space = VISCA_STREAM_BUFFER_SIZE - parser->length;
+    return parser->buffer + parser->length;
 }
 
-static uint32_t g_visca_sequence_number = 0;
-void send_visca_packet(int sock, uint8_t *buf, ssize_t bufsize, int timeout_usec);
-uint8_t *send_visca_inquiry(int sock, uint8_t *buf, ssize_t bufsize, int timeout_usec, ssize_t *responseLength);
+void viscaStreamDidRead(viscaStreamParser_t *parser, ssize_t count) {
+    parser->length += count;
+}
+
+// Returns the next complete message, if any.  It stays valid until the next read.
+bool nextVISCAStreamMessage(viscaStreamParser_t *parser, const uint8_t **message, ssize_t *length) {
+    const uint8_t *begin = parser->buffer + parser->start;
+    const uint8_t *end = (const uint8_t *)memchr(begin, 0xff, parser->length - parser->start);
+    if (end == NULL) return false;
+    *message = begin;
+    *length = end - begin + 1;
+    parser->start += *length;
+    return true;
+}
+
+// Receives an inquiry's answer (starting with the camera's address byte, without any
+// VISCA-over-IP header), or NULL if the inquiry failed or timed out.
+typedef void (*viscaResponseHandler)(const uint8_t *response, ssize_t length);
+
+typedef enum {
+    kVISCACommandOther,
+    kVISCACommandPanTilt,              // Drive commands.  Only the newest of each kind matters.
+    kVISCACommandZoom
+} viscaCommandKind_t;
+
+// These return at once.  The VISCA engine sends the packet when the camera is ready for it.
+void queueVISCARequest(int sock, const uint8_t *buf, ssize_t bufsize, int timeout_usec, bool isInquiry,
+                       viscaResponseHandler handler, viscaCommandKind_t kind, bool isStop);
+
+template <size_t N>
+void send_visca_packet(int sock, const viscaPacket<N> &packet, int timeout_usec) {
+    queueVISCARequest(sock, packet.bytes, N, timeout_usec, false, NULL, kVISCACommandOther, false);
+}
+
+template <size_t N>
+void send_visca_drive(int sock, const viscaPacket<N> &packet, int timeout_usec, viscaCommandKind_t kind,
+                      bool isStop) {
+    queueVISCARequest(sock, packet.bytes, N, timeout_usec, false, NULL, kind, isStop);
+}
+
+template <size_t N>
+void send_visca_inquiry(int sock, const viscaPacket<N> &packet, int timeout_usec, viscaResponseHandler handler) {
+    queueVISCARequest(sock, packet.bytes, N, timeout_usec, true, handler, kVISCACommandOther, false);
+}
+
+void handleVISCAMaxSpeedResponse(const uint8_t *responseBuf, ssize_t responseLength);
+void handleVISCATallyResponse(const uint8_t *responseBuf, ssize_t responseLength);
 
 // Custom VISCA command, because 8 speeds aren't enough to properly drive Panasonic cameras.  This is a
 // nonstandard command specific to the VISCAPTZ project.  On all actual VISCA devices, this will fail,
@@ -1713,9 +5022,11 @@ void updateVISCAMaxSpeed(int sock) {
 
     lastCheck = curTime;
 
-    uint8_t buf[7] = { 0x81, 0x09, 0x04, 0x07, 0xFF };  // Custom max zoom speed command
-    ssize_t responseLength = 0;
-    uint8_t *responseBuf = send_visca_inquiry(sock, buf, sizeof(buf), 20000, &responseLength);
+    viscaPacket<7> buf = {{ 0x81, 0x09, 0x04, 0x07, 0xFF }};  // Custom max zoom speed command
+    send_visca_inquiry(sock, buf, VISCA_ACK_TIMEOUT, handleVISCAMaxSpeedResponse);
+}
+
+void handleVISCAMaxSpeedResponse(const uint8_t *responseBuf, ssize_t responseLength) {
     if (responseBuf && responseLength == 13 &&
             responseBuf[1] == 0x50 && responseBuf[2] == 0xde &&
             responseBuf[3] == 0xad && responseBuf[4] == 0xbe &&
@@ -1743,10 +5054,12 @@ void updateTallyLightsOverVISCA(int sock) {
     if (difference < MIN_TALLY_INTERVAL) return;
     lastCheck = curTime;
 
-    uint8_t buf[7] = { 0x81, 0x09, 0x7E, 0x01, 0x0A, 0x01, 0xFF };
-    // uint8_t buf[7] = { 0x81, 0x09, 0x00, 0x02, 0x00, 0x00, 0xFF };  // Firmware version command.
-    ssize_t responseLength = 0;
-    uint8_t *responseBuf = send_visca_inquiry(sock, buf, sizeof(buf), 20000, &responseLength);
+    viscaPacket<7> buf = {{ 0x81, 0x09, 0x7E, 0x01, 0x0A, 0x01, 0xFF }};
+    // viscaPacket<7> buf = {{ 0x81, 0x09, 0x00, 0x02, 0x00, 0x00, 0xFF }};  // Firmware version command.
+    send_visca_inquiry(sock, buf, VISCA_ACK_TIMEOUT, handleVISCATallyResponse);
+}
+
+void handleVISCATallyResponse(const uint8_t *responseBuf, ssize_t responseLength) {
     if (responseBuf && responseLength == 4 && responseBuf[1] == 0x50 && responseBuf[3] == 0xff) {
         if (enable_verbose_debugging) {
             fprintf(stderr, "Got tally data: %s\n", fmtbuf(responseBuf, responseLength));
@@ -1768,13 +5081,11 @@ void updateTallyLightsOverVISCA(int sock) {
 }
 
 void sendVISCALoadPreset(uint8_t presetNumber, int sock) {
-    uint8_t buf[7] = { 0x81, 0x01, 0x04, 0x3F, 0x02, presetNumber, 0xFF };
-    send_visca_packet(sock, buf, sizeof(buf), 100000);
+    send_visca_packet(sock, encodeVISCAPreset(false, presetNumber), 100000);
 }
 
 void sendVISCASavePreset(uint8_t presetNumber, int sock) {
-    uint8_t buf[7] = { 0x81, 0x01, 0x04, 0x3F, 0x01, presetNumber, 0xFF };
-    send_visca_packet(sock, buf, sizeof(buf), 100000);
+    send_visca_packet(sock, encodeVISCAPreset(true, presetNumber), 100000);
 }
 
 #ifdef P2_HACK
@@ -1817,7 +5128,6 @@ void sendZoomUpdatesOverP2(int sock, motionData_t *motionData) {
 void sendZoomUpdatesOverVISCA(int sock, motionData_t *motionData) {
     if (gMaxZoomValue != 8) {
         // Use a nonstandard VISCA command with a much larger zoom speed range.
-        uint8_t buf[8] = { 0x81, 0x01, 0x04, 0x07, 0x00, 0x00, 0x00, 0xFF };
         int level = (int)(motionData->zoomPosition * (gMaxZoomValue + 0.9));
         static int last_zoom_level = 0;
 
@@ -1826,17 +5136,13 @@ void sendZoomUpdatesOverVISCA(int sock, motionData_t *motionData) {
         }
         last_zoom_level = level;
 
-        buf[4] = (level < 0) ? 0x2f : 0x3f;
-        buf[5] = (abs(level) >> 8) & 0xff;
-        buf[6] = abs(level) & 0xff;
-
+        viscaExtendedZoomDrive_t packet = encodeVISCAExtendedZoomDrive(level);
         if (enable_ptz_debugging) {
-            fprintf(stderr, "zoom speed: %d buf: 0x%02x\n", level, buf[4]);
+            fprintf(stderr, "zoom speed: %d buf: 0x%02x\n", level, packet.bytes[4]);
         }
     
-        send_visca_packet(sock, buf, sizeof(buf), 100000);
+        send_visca_drive(sock, packet, 100000, kVISCACommandZoom, level == 0);
     } else {
-        uint8_t buf[6] = { 0x81, 0x01, 0x04, 0x07, 0x00, 0xFF };
         int level = (int)(motionData->zoomPosition * (8.9));
 
         static int last_zoom_level = 0;
@@ -1846,14 +5152,12 @@ void sendZoomUpdatesOverVISCA(int sock, motionData_t *motionData) {
         }
         last_zoom_level = level;
 
-        if (level != 0) {
-            buf[4] = (abs(level) - 1) | (level < 0 ? 0x20 : 0x30);
-        }
+        viscaZoomDrive_t packet = encodeVISCAZoomDrive(level);
         if (enable_ptz_debugging) {
-            fprintf(stderr, "zoom speed: %d buf: 0x%02x\n", level, buf[4]);
+            fprintf(stderr, "zoom speed: %d buf: 0x%02x\n", level, packet.bytes[4]);
         }
 
-        send_visca_packet(sock, buf, sizeof(buf), 100000);
+        send_visca_drive(sock, packet, 100000, kVISCACommandZoom, level == 0);
     }
 }
 
@@ -1890,17 +5194,11 @@ void sendPanTiltUpdatesOverVISCA(int sock, motionData_t *motionData) {
                             pan_level,
                             tilt_level);
 
-    uint8_t pan_command = left ? 0x01 : right ? 0x2 : 0x3;
-    uint8_t tilt_command = up ? 0x01 : down ? 0x2 : 0x3;
+    viscaPanTiltDrive_t packet = encodeVISCAPanTiltDrive(pan_level, tilt_level);
 
-    uint8_t buf[9] = { 0x81, 0x01, 0x06, 0x01, 0x00, 0x00, pan_command, tilt_command, 0xFF };
+    if (localDebug) fprintf(stderr, "Sent packet %s\n", fmtbuf(packet.bytes, sizeof(packet.bytes)));
 
-    buf[4] = abs(pan_level) ?: 1; // Pan speed: 1 to 24 (0x18)
-    buf[5] = abs(tilt_level) ?: 1; // Pan speed: 1 to 24 (0x18)
-
-    if (localDebug) fprintf(stderr, "Sent packet %s\n", fmtbuf(buf, 9));
-
-    send_visca_packet(sock, buf, sizeof(buf), 100000);
+    send_visca_drive(sock, packet, 100000, kVISCACommandPanTilt, pan_level == 0 && tilt_level == 0);
 }
 
 void sendExtendedPanTiltUpdatesOverVISCA(int sock, motionData_t *motionData) {
@@ -1930,22 +5228,11 @@ void sendExtendedPanTiltUpdatesOverVISCA(int sock, motionData_t *motionData) {
                             pan_level,
                             tilt_level);
 
-    uint8_t pan_command = left ? 0x01 : right ? 0x02 : 0x03;
-    uint8_t tilt_command = up ? 0x01 : down ? 0x02 : 0x03;
-
-    uint8_t buf[13] = { 0x81, 0x01, 0x06, 0x01, 0x00, 0x00, // Extended command.
-                        0x00, 0x00, // Pan (big endian)
-                        0x00, 0x00, // Tilt (big endian)
-                        pan_command, tilt_command, 0xFF };
-
-    buf[6] = (abs(pan_level) >> 8) & 0xff;
-    buf[7] = pan_level & 0xff;
-    buf[8] = (abs(tilt_level) >> 8) & 0xff;
-    buf[9] = tilt_level & 0xff;
+    viscaExtendedPanTiltDrive_t packet = encodeVISCAExtendedPanTiltDrive(pan_level, tilt_level);
 
-    if (localDebug) fprintf(stderr, "Sent packet %s\n", fmtbuf(buf, 9));
+    if (localDebug) fprintf(stderr, "Sent packet %s\n", fmtbuf(packet.bytes, sizeof(packet.bytes)));
 
-    send_visca_packet(sock, buf, sizeof(buf), 100000);
+    send_visca_drive(sock, packet, 100000, kVISCACommandPanTilt, pan_level == 0 && tilt_level == 0);
 }
 
 void sendManualExposureOverVISCA(int sock) {
@@ -1958,36 +5245,36 @@ void sendManualExposureOverVISCA(int sock) {
 
     if (g_set_auto_exposure) {
         if (localDebug) fprintf(stderr, "Enabling automatic exposure.\n");
-        uint8_t disablebuf[6] = { 0x81, 0x01, 0x04, 0x39, 0x00, 0xFF };
-        send_visca_packet(sock, disablebuf, sizeof(disablebuf), 100000);
+        viscaPacket<6> disablebuf = {{ 0x81, 0x01, 0x04, 0x39, 0x00, 0xFF }};
+        send_visca_packet(sock, disablebuf, 100000);
         return;
     } else if (!(g_set_manual_iris || g_set_manual_gain || g_set_manual_gain)) {
         return;
     }
 
     if (localDebug) fprintf(stderr, "Enabling manual exposure.\n");
-    uint8_t enablebuf[6] = { 0x81, 0x01, 0x04, 0x39, 0x03, 0xFF };
-    send_visca_packet(sock, enablebuf, sizeof(enablebuf), 100000);
+    viscaPacket<6> enablebuf = {{ 0x81, 0x01, 0x04, 0x39, 0x03, 0xFF }};
+    send_visca_packet(sock, enablebuf, 100000);
 
     if (g_set_manual_iris) {
         if (localDebug) fprintf(stderr, "Setting iris position.\n");
-        uint8_t irisbuf[9] = { 0x81, 0x01, 0x04, 0x4B, 0x00, 0x00,
-                               (uint8_t)(g_manual_iris >> 4), (uint8_t)(g_manual_iris & 0xF), 0xFF };
-        send_visca_packet(sock, irisbuf, sizeof(irisbuf), 100000);
+        viscaPacket<9> irisbuf = {{ 0x81, 0x01, 0x04, 0x4B, 0x00, 0x00,
+                                    (uint8_t)(g_manual_iris >> 4), (uint8_t)(g_manual_iris & 0xF), 0xFF }};
+        send_visca_packet(sock, irisbuf, 100000);
     }
 
     if (g_set_manual_gain) {
         if (localDebug) fprintf(stderr, "Setting gain position.\n");
-        uint8_t gainbuf[9] = { 0x81, 0x01, 0x04, 0x4C, 0x00, 0x00,
-                               (uint8_t)(g_manual_gain >> 4), (uint8_t)(g_manual_gain & 0xF), 0xFF };
-        send_visca_packet(sock, gainbuf, sizeof(gainbuf), 100000);
+        viscaPacket<9> gainbuf = {{ 0x81, 0x01, 0x04, 0x4C, 0x00, 0x00,
+                                    (uint8_t)(g_manual_gain >> 4), (uint8_t)(g_manual_gain & 0xF), 0xFF }};
+        send_visca_packet(sock, gainbuf, 100000);
     }
 
     if (g_set_manual_gain) {
         if (localDebug) fprintf(stderr, "Setting gain position.\n");
-        uint8_t gainbuf[9] = { 0x81, 0x01, 0x04, 0x4A, 0x00, 0x00,
-                               (uint8_t)(g_manual_gain >> 4), (uint8_t)(g_manual_gain & 0xF), 0xFF };
-        send_visca_packet(sock, gainbuf, sizeof(gainbuf), 100000);
+        viscaPacket<9> gainbuf = {{ 0x81, 0x01, 0x04, 0x4A, 0x00, 0x00,
+                                    (uint8_t)(g_manual_gain >> 4), (uint8_t)(g_manual_gain & 0xF), 0xFF }};
+        send_visca_packet(sock, gainbuf, 100000);
     }
 }
 
@@ -2000,190 +5287,1006 @@ void sendExposureCompensationOverVISCA(int sock) {
     count--;
 
     // Enable exposure compensation.
-    uint8_t enablebuf[6] = { 0x81, 0x01, 0x04, 0x3E, (uint8_t)(g_exposure_compensation == 0 ? 0x03 : 0x02), 0xFF };
-    send_visca_packet(sock, enablebuf, sizeof(enablebuf), 100000);
+    viscaPacket<6> enablebuf = {{ 0x81, 0x01, 0x04, 0x3E, (uint8_t)(g_exposure_compensation == 0 ? 0x03 : 0x02),
+                                  0xFF }};
+    send_visca_packet(sock, enablebuf, 100000);
 
     // Set compensation amount.
     if (g_exposure_compensation != 0) {
         uint8_t exposure_compensation_scaled = (uint8_t)(g_exposure_compensation + 5); // Range now 0 to 10
-        uint8_t buf[9] = { 0x81, 0x01, 0x04, 0x4E, 0x00, 0x00, (uint8_t)((exposure_compensation_scaled >> 4) & 0xf),
-                           (uint8_t)(exposure_compensation_scaled & 0xf), 0xFF };
-        send_visca_packet(sock, buf, sizeof(buf), 100000);
+        viscaPacket<9> buf = {{ 0x81, 0x01, 0x04, 0x4E, 0x00, 0x00, (uint8_t)((exposure_compensation_scaled >> 4) & 0xf),
+                                (uint8_t)(exposure_compensation_scaled & 0xf), 0xFF }};
+        send_visca_packet(sock, buf, 100000);
     }
 }
 
-uint8_t get_ack(int sock, int timeout_usec);
-uint8_t *get_ack_data(int sock, int timeout_usec, ssize_t *len);
-void send_visca_packet_raw(int sock, uint8_t *buf, ssize_t bufsize, int timeout_usec, bool isInquiry);
+#pragma mark - VISCA engine
 
-uint8_t *send_visca_inquiry(int sock, uint8_t *buf, ssize_t bufsize, int timeout_usec, ssize_t *responseLength) {
-    bool localDebug = false || enable_verbose_debugging;
-    if (sock == -1) return NULL;
+// VISCA commands are sent and answered on a thread of their own, so that a slow or lost
+// ack never stalls the joystick.  Callers queue a command and return at once.  The engine
+// thread sends queued commands as the camera takes them (at most VISCA_SEND_WINDOW
+// awaiting an ack at a time), matches each ack, completion, or error to its request, and
+// times requests out on a timer wheel.  Over UDP, responses are matched by their
+// VISCA-over-IP sequence number.  Over TCP, they are matched in order, and completions by
+// the camera's socket number.
+//
+// Pan/tilt and zoom drive commands are coalesced while they wait: only the newest speed
+// of each kind is sent, so a slow camera never works through a backlog of stale speeds.
+// A stop goes to the front of the queue, is sent even if the window is full, and abandons
+// any drive command of its kind that is still in flight.
+//
+// Over UDP, a response is matched only to the request in flight with its exact sequence
+// number.  Anything outside that window is stale and dropped.  If the camera reports a
+// bad sequence number, or several acks in a row go missing, the engine resynchronizes in
+// one round trip: it abandons what is in flight, sends the RESET control command, holds
+// everything else until the camera acks it, and then starts again from sequence number
+// zero, all on the same socket.  The same handshake starts each new UDP session.  A
+// camera that answers commands but never acks RESET is remembered, and later resyncs only
+// abandon what is in flight.
+#define VISCA_QUEUE_SIZE 32
+#define VISCA_IN_FLIGHT_TABLE_SIZE 16     // Indexed by sequence number modulo this.
+#define VISCA_SEND_WINDOW 2               // Cameras have two command sockets.
+#define VISCA_TIMER_TICK_MSEC 5
+#define VISCA_TIMER_WHEEL_SIZE 64         // Slots.  Longer timeouts take more than one turn.
+#define VISCA_COMPLETION_TIMEOUT 1000000  /* 1 sec */
+#define VISCA_RESET_TIMEOUT 100000        /* 100 msec */
+#define VISCA_RESET_ATTEMPTS 3            // Then carry on without it.
+#define VISCA_MISSED_ACKS_BEFORE_RESYNC 3
+#define VISCA_ERROR_BUFFER_FULL 0x03
+#define VISCA_UNSENT_BUFFER_SIZE 1024     // TCP bytes waiting for room in the socket.
+#define VISCA_RECONNECT_MIN_DELAY 500000  /* 0.5 sec */
+#define VISCA_RECONNECT_MAX_DELAY 30000000  /* 30 sec */
+#define VISCA_STOP_RETRIES 8              // When the camera's command buffer is full.
+#define VISCA_STOP_RETRY_DELAY 50000      /* 50 msec, unless a command finishes sooner */
+
+typedef enum {
+    kVISCARequestFree,
+    kVISCARequestAwaitingAck,          // Or, for an inquiry, its answer.
+    kVISCARequestAwaitingCompletion
+} viscaRequestState_t;
+
+typedef struct viscaRequest {
+    uint8_t packet[VISCA_MAX_PACKET_SIZE];
+    ssize_t length;
+    bool isInquiry;
+    int timeoutUsec;                   // For the ack, or for an inquiry's answer.
+    viscaResponseHandler handler;      // Inquiries only.
+    int sock;                          // The socket that it was queued for.
+    viscaCommandKind_t kind;
+    bool isStop;                       // A drive command with zero speed.
+    int retries;                       // Times a stop was sent back to the queue.
+    uint64_t heldUntilTick;            // A requeued stop waits for this, or for a completion.
+
+    // Once sent:
+    viscaRequestState_t state;
+    uint32_t sequenceNumber;
+    int cameraSocket;                  // From the ack.  The completion quotes it.
+    uint64_t deadlineTick;
+    int nextTimer;                     // The next request in the same wheel slot, or -1.
+} viscaRequest_t;
+
+// The requests that the camera hasn't finished answering.  Owned by the engine thread.
+typedef struct viscaEngine {
+    viscaRequest_t inFlight[VISCA_IN_FLIGHT_TABLE_SIZE];
+    int timerWheel[VISCA_TIMER_WHEEL_SIZE];  // The first request in each slot, or -1.
+    uint64_t currentTick;
+    int awaitingAck;
+
+    // Sequence number resynchronization (VISCA over IP only).
+    bool resyncNeeded;
+    bool awaitingReset;          // Nothing else is sent meanwhile.
+    int resetAttempts;
+    uint64_t resetDeadlineTick;
+    int missedAcks;              // In a row.
+
+    // When a stop that found the camera's command buffer full may be sent again, or 0.
+    uint64_t stopRetryTick;
+
+    // What is known about the camera at cameraAddress, which outlives the socket.
+    struct sockaddr_in cameraAddress;
+    bool cameraAnswered;         // It has answered a command.
+    bool cameraAckedReset;
+    bool resetUnsupported;       // It answers commands, but ignores RESET.
+
+    // TCP only.
+    viscaStreamParser_t stream;
+    uint8_t unsent[VISCA_UNSENT_BUFFER_SIZE];  // Sent before anything newer.
+    ssize_t unsentLength;
+    bool watchingWritable;
+
+    // Reconnecting to a TCP camera that hung up, with exponential backoff.
+    struct sockaddr_in peerAddress;
+    bool havePeerAddress;
+    bool reconnectPending;
+    uint64_t reconnectTick;
+    int reconnectDelayUsec;
+} viscaEngine_t;
+
+// Commands waiting to be sent, in the order they will be sent.
+typedef struct viscaQueue {
+    viscaRequest_t entries[VISCA_QUEUE_SIZE];
+    int head;
+    int count;
+} viscaQueue_t;
+
+typedef struct viscaCommandStats {
+    uint64_t queued;
+    uint64_t coalesced;   // Replaced by a newer command of the same kind before being sent.
+    uint64_t sent;
+    uint64_t preempted;   // Abandoned in flight because a stop overtook them.
+    uint64_t dropped;     // Pushed out of a full queue.
+    uint64_t resyncs;     // Sequence number resets.
+} viscaCommandStats_t;
+
+viscaEngine_t g_viscaEngine;
+
+// Protected by g_viscaQueueMutex, as is the socket generation, which changes whenever
+// g_visca_sock is replaced.
+viscaQueue_t g_viscaQueue;
+viscaCommandStats_t g_viscaStats;
+uint64_t g_viscaSocketGeneration = 0;
+bool g_viscaResyncRequested = false;
+bool g_viscaReconnectWanted = false;  // The TCP camera hung up, and nothing has replaced it.
+bool g_viscaEngineStarted = false;
+pthread_mutex_t g_viscaQueueMutex = PTHREAD_MUTEX_INITIALIZER;
+int g_viscaWakePipe[2] = { -1, -1 };
+
+uint64_t viscaTickForTime(double seconds) {
+    return (uint64_t)(seconds * 1000.0 / VISCA_TIMER_TICK_MSEC);
+}
 
-    send_visca_packet_raw(sock, buf, bufsize, timeout_usec, true);
-    int udp_offset = g_visca_use_udp ? 8 : 0;
-    ssize_t localResponseLength = 0;
-    uint8_t *response = get_ack_data(sock, VISCA_ACK_TIMEOUT, &localResponseLength);
-    bool valid = false;
-    while (!valid) {
-        valid = true;
-        if (!response) return NULL;
-        int sequence_number = g_visca_sequence_number - 1;
-        if (g_visca_use_udp) {
-            if (response[0] != 0x01 ||
-                response[1] != 0x11 /* ||
-                response[2] != 0x00 ||
-                response[3] != 0x04 */ /* ||
-                response[4] != sequence_number >> 24 ||
-                response[5] != (sequence_number >> 16) & 0xff ||
-                response[6] != (sequence_number >> 8) & 0xff ||
-                response[7] != sequence_number & 0xff */) {
-                if (localDebug) {
-                    fprintf(stderr, "Unexpected response packet[1] %s\n", fmtbuf(response, localResponseLength));
-                    fprintf(stderr, "Expected %02x %02x %02x %02x %02x %02x %02x %02x\n", 1, 0x11, 0, 4, sequence_number >> 24,
-                            (sequence_number >> 16) & 0xff, (sequence_number >> 8) & 0xff, sequence_number & 0xff);
+void initVISCAEngine(viscaEngine_t *engine, uint64_t tick) {
+    bzero(engine, sizeof(*engine));
+    for (int slot = 0; slot < VISCA_TIMER_WHEEL_SIZE; slot++) {
+        engine->timerWheel[slot] = -1;
+    }
+    engine->currentTick = tick;
+}
+
+// Rounded up, and at least one.
+uint64_t viscaTicksForUsec(int usec) {
+    uint64_t ticks = (usec + (VISCA_TIMER_TICK_MSEC * 1000) - 1) / (VISCA_TIMER_TICK_MSEC * 1000);
+    return MAX(ticks, (uint64_t)1);
+}
+
+void scheduleVISCATimeout(viscaEngine_t *engine, int index, int timeoutUsec) {
+    viscaRequest_t *request = &engine->inFlight[index];
+    request->deadlineTick = engine->currentTick + viscaTicksForUsec(timeoutUsec);
+    int slot = (int)(request->deadlineTick % VISCA_TIMER_WHEEL_SIZE);
+    request->nextTimer = engine->timerWheel[slot];
+    engine->timerWheel[slot] = index;
+}
+
+void cancelVISCATimeout(viscaEngine_t *engine, int index) {
+    int *link = &engine->timerWheel[engine->inFlight[index].deadlineTick % VISCA_TIMER_WHEEL_SIZE];
+    while (*link != -1) {
+        if (*link == index) {
+            *link = engine->inFlight[index].nextTimer;
+            return;
+        }
+        link = &engine->inFlight[*link].nextTimer;
+    }
+}
+
+// Frees a request whose timer is already gone, passing an inquiry's answer (or NULL) on.
+void retireVISCARequest(viscaEngine_t *engine, int index, const uint8_t *response, ssize_t length) {
+    viscaRequest_t *request = &engine->inFlight[index];
+    if (request->state == kVISCARequestAwaitingAck) {
+        engine->awaitingAck--;
+    }
+    request->state = kVISCARequestFree;
+    if (request->isInquiry && request->handler != NULL) {
+        request->handler(response, length);
+    }
+}
+
+void finishVISCARequest(viscaEngine_t *engine, int index, const uint8_t *response, ssize_t length) {
+    cancelVISCATimeout(engine, index);
+    retireVISCARequest(engine, index, response, length);
+}
+
+// Records a request that has just been sent.  A request still waiting for its completion
+// sixteen sequence numbers later is given up on.
+void trackVISCARequest(viscaEngine_t *engine, const viscaRequest_t *request, uint32_t sequenceNumber) {
+    int index = (int)(sequenceNumber % VISCA_IN_FLIGHT_TABLE_SIZE);
+    if (engine->inFlight[index].state != kVISCARequestFree) {
+        finishVISCARequest(engine, index, NULL, 0);
+    }
+    viscaRequest_t *tracked = &engine->inFlight[index];
+    *tracked = *request;
+    tracked->state = kVISCARequestAwaitingAck;
+    tracked->sequenceNumber = sequenceNumber;
+    tracked->cameraSocket = 0;
+    engine->awaitingAck++;
+    scheduleVISCATimeout(engine, index, request->timeoutUsec);
+}
+
+// Gives up on every request in flight.  Inquiry handlers get NULL.
+void abandonVISCARequests(viscaEngine_t *engine) {
+    for (int index = 0; index < VISCA_IN_FLIGHT_TABLE_SIZE; index++) {
+        if (engine->inFlight[index].state != kVISCARequestFree) {
+            finishVISCARequest(engine, index, NULL, 0);
+        }
+    }
+}
+
+// Returns the longest-waiting request in the given state (and, if cameraSocket isn't
+// zero, on that camera socket), or -1.
+int oldestVISCARequest(viscaEngine_t *engine, viscaRequestState_t state, int cameraSocket) {
+    int oldest = -1;
+    for (int index = 0; index < VISCA_IN_FLIGHT_TABLE_SIZE; index++) {
+        viscaRequest_t *request = &engine->inFlight[index];
+        if (request->state != state || (cameraSocket != 0 && request->cameraSocket != cameraSocket)) {
+            continue;
+        }
+        if (oldest == -1 || (int32_t)(request->sequenceNumber - engine->inFlight[oldest].sequenceNumber) < 0) {
+            oldest = index;
+        }
+    }
+    return oldest;
+}
+
+void handleVISCAControlReply(viscaEngine_t *engine, const viscaMessage_t *message) {
+    if (message->length >= 1 && message->payload[0] == VISCA_CONTROL_RESET) {
+        engine->cameraAckedReset = true;
+        engine->resetUnsupported = false;
+        if (engine->awaitingReset) {
+            // The camera expects sequence number zero next.
+            engine->awaitingReset = false;
+            engine->missedAcks = 0;
+            g_visca_sequence_number = 0;
+            if (enable_verbose_debugging) {
+                fprintf(stderr, "VISCA sequence number reset.\n");
+            }
+        }
+    } else if (message->length >= 2 && message->payload[0] == VISCA_CONTROL_ERROR) {
+        if (enable_verbose_debugging) {
+            fprintf(stderr, "VISCA %s error.  Resynchronizing.\n",
+                    message->payload[1] == 0x01 ? "sequence number" : "message");
+        }
+        if (!engine->awaitingReset) {
+            engine->resyncNeeded = true;
+        }
+    }
+}
+
+bool requeueVISCAStop(viscaQueue_t *queue, const viscaRequest_t *request, viscaCommandStats_t *stats,
+                      uint64_t heldUntilTick);
+void releaseHeldVISCAStops(viscaQueue_t *queue);
+
+// Handles one message from the camera.  hasHeader is true for VISCA over IP (UDP).
+void handleVISCAResponse(viscaEngine_t *engine, const uint8_t *data, ssize_t length, bool hasHeader) {
+    viscaMessage_t message;
+    if (!parseVISCAMessage(data, length, hasHeader, &message)) {
+        if (enable_verbose_debugging) {
+            fprintf(stderr, "Malformed VISCA response %s\n", fmtbuf(data, length));
+        }
+        return;
+    }
+    if (message.payloadType == VISCA_PAYLOAD_TYPE_CONTROL_REPLY) {
+        handleVISCAControlReply(engine, &message);
+        return;
+    }
+    if (message.payloadType != VISCA_PAYLOAD_TYPE_REPLY) {
+        if (enable_verbose_debugging) {
+            fprintf(stderr, "Ignoring VISCA packet %s\n", fmtbuf(data, length));
+        }
+        return;
+    }
+
+    int index = -1;
+    if (message.hasSequenceNumber) {
+        // Only the request with exactly this sequence number will do.
+        index = (int)(message.sequenceNumber % VISCA_IN_FLIGHT_TABLE_SIZE);
+        if (engine->inFlight[index].state == kVISCARequestFree ||
+            engine->inFlight[index].sequenceNumber != message.sequenceNumber) {
+            // An answer to a request that has already timed out or been abandoned.
+            if (enable_verbose_debugging) {
+                fprintf(stderr, "Late VISCA response %s (sequence number %u)\n",
+                        fmtbuf(message.payload, message.length), message.sequenceNumber);
+            }
+            return;
+        }
+    }
+
+    data = message.payload;
+    length = message.length;
+    int responseType = message.responseType;
+    int cameraSocket = message.cameraSocket;
+    if (index == -1 && (responseType == 5 || responseType == 6) && cameraSocket != 0) {
+        index = oldestVISCARequest(engine, kVISCARequestAwaitingCompletion, cameraSocket);
+    }
+    if (index == -1) {
+        index = oldestVISCARequest(engine, kVISCARequestAwaitingAck, 0);
+    }
+    if (index == -1) {
+        if (enable_verbose_debugging) {
+            fprintf(stderr, "Unmatched VISCA response %s\n", fmtbuf(data, length));
+        }
+        return;
+    }
+
+    engine->missedAcks = 0;
+    engine->cameraAnswered = true;
+    engine->reconnectDelayUsec = 0;
+    viscaRequest_t *request = &engine->inFlight[index];
+    switch (responseType) {
+        case 4:
+            // Accepted.  Wait (without holding up other commands) for it to finish.
+            if (request->state == kVISCARequestAwaitingAck && !request->isInquiry) {
+                cancelVISCATimeout(engine, index);
+                request->state = kVISCARequestAwaitingCompletion;
+                request->cameraSocket = cameraSocket;
+                engine->awaitingAck--;
+                scheduleVISCATimeout(engine, index, VISCA_COMPLETION_TIMEOUT);
+            }
+            break;
+        case 5:
+            finishVISCARequest(engine, index, data, length);
+            if (engine->stopRetryTick != 0) {
+                // The camera has room for the stop now.
+                engine->stopRetryTick = 0;
+                pthread_mutex_lock(&g_viscaQueueMutex);
+                releaseHeldVISCAStops(&g_viscaQueue);
+                pthread_mutex_unlock(&g_viscaQueueMutex);
+            }
+            break;
+        case 6: {
+            if (enable_verbose_debugging) {
+                fprintf(stderr, "VISCA error 0x%02x for %s\n", data[2], fmtbuf(request->packet, request->length));
+            }
+            // A stop must not be lost just because the camera was busy.  Try it again once
+            // a command finishes, or after a short delay, because the buffer won't empty sooner.
+            viscaRequest_t failed = *request;
+            finishVISCARequest(engine, index, NULL, 0);
+            if (failed.isStop && data[2] == VISCA_ERROR_BUFFER_FULL) {
+                uint64_t retryTick = engine->currentTick + viscaTicksForUsec(VISCA_STOP_RETRY_DELAY);
+                pthread_mutex_lock(&g_viscaQueueMutex);
+                bool requeued = requeueVISCAStop(&g_viscaQueue, &failed, &g_viscaStats, retryTick);
+                pthread_mutex_unlock(&g_viscaQueueMutex);
+                if (requeued) {
+                    engine->stopRetryTick = retryTick;
+                }
+            }
+            break;
+        }
+        default:
+            if (enable_verbose_debugging) {
+                fprintf(stderr, "Unexpected VISCA response %s\n", fmtbuf(data, length));
+            }
+            break;
+    }
+}
+
+// Advances the wheel to tick, giving up on every request whose time has run out.
+void expireVISCARequests(viscaEngine_t *engine, uint64_t tick) {
+    if (tick > engine->currentTick + VISCA_TIMER_WHEEL_SIZE) {
+        // Long asleep.  One turn of the wheel still visits every slot.
+        engine->currentTick = tick - VISCA_TIMER_WHEEL_SIZE;
+    }
+    while (engine->currentTick < tick) {
+        engine->currentTick++;
+        int slot = (int)(engine->currentTick % VISCA_TIMER_WHEEL_SIZE);
+        int index = engine->timerWheel[slot];
+        engine->timerWheel[slot] = -1;
+        while (index != -1) {
+            viscaRequest_t *request = &engine->inFlight[index];
+            int next = request->nextTimer;
+            if (request->deadlineTick <= engine->currentTick) {
+                if (enable_verbose_debugging) {
+                    fprintf(stderr, "VISCA %s timed out: %s\n",
+                            request->state == kVISCARequestAwaitingAck ? "ack" : "completion",
+                            fmtbuf(request->packet, request->length));
                 }
-                valid = false;
+                if (request->state == kVISCARequestAwaitingAck &&
+                        ++engine->missedAcks >= VISCA_MISSED_ACKS_BEFORE_RESYNC && !engine->awaitingReset) {
+                    engine->resyncNeeded = true;
+                    engine->missedAcks = 0;
+                }
+                retireVISCARequest(engine, index, NULL, 0);
+            } else {
+                request->nextTimer = engine->timerWheel[slot];
+                engine->timerWheel[slot] = index;
+            }
+            index = next;
+        }
+    }
+}
+
+viscaRequest_t *viscaQueueEntry(viscaQueue_t *queue, int position) {
+    return &queue->entries[(queue->head + position) % VISCA_QUEUE_SIZE];
+}
+
+// Adds a request to the queue.  A drive command replaces any queued command of its kind,
+// and a stop goes to the front.  If the queue is full, the oldest request is pushed out
+// into *dropped, and the function returns true.
+bool enqueueVISCARequest(viscaQueue_t *queue, const viscaRequest_t *request, viscaCommandStats_t *stats,
+                         viscaRequest_t *dropped) {
+    stats->queued++;
+    if (request->kind != kVISCACommandOther) {
+        int kept = 0;
+        for (int position = 0; position < queue->count; position++) {
+            viscaRequest_t *entry = viscaQueueEntry(queue, position);
+            if (entry->kind == request->kind) {
+                stats->coalesced++;
+            } else {
+                *viscaQueueEntry(queue, kept++) = *entry;
+            }
+        }
+        queue->count = kept;
+    }
+
+    bool droppedOne = false;
+    if (queue->count == VISCA_QUEUE_SIZE) {
+        *dropped = *viscaQueueEntry(queue, 0);
+        queue->head = (queue->head + 1) % VISCA_QUEUE_SIZE;
+        queue->count--;
+        stats->dropped++;
+        droppedOne = true;
+    }
+    if (request->isStop) {
+        queue->head = (queue->head + VISCA_QUEUE_SIZE - 1) % VISCA_QUEUE_SIZE;
+        *viscaQueueEntry(queue, 0) = *request;
+    } else {
+        *viscaQueueEntry(queue, queue->count) = *request;
+    }
+    queue->count++;
+    return droppedOne;
+}
+
+// Puts a stop that the camera had no room for back at the front of the queue, held there
+// until heldUntilTick, unless a newer command of its kind has been queued since.  Returns
+// true if it was requeued.
+bool requeueVISCAStop(viscaQueue_t *queue, const viscaRequest_t *request, viscaCommandStats_t *stats,
+                      uint64_t heldUntilTick) {
+    if (request->retries >= VISCA_STOP_RETRIES) return false;
+    for (int position = 0; position < queue->count; position++) {
+        if (viscaQueueEntry(queue, position)->kind == request->kind) return false;
+    }
+    if (queue->count == VISCA_QUEUE_SIZE) {
+        // Drop the newest request instead, because this one has been waiting longest.
+        queue->count--;
+        stats->dropped++;
+    }
+    queue->head = (queue->head + VISCA_QUEUE_SIZE - 1) % VISCA_QUEUE_SIZE;
+    viscaRequest_t *entry = viscaQueueEntry(queue, 0);
+    *entry = *request;
+    entry->retries++;
+    entry->heldUntilTick = heldUntilTick;
+    queue->count++;
+    return true;
+}
+
+// Lets requeued stops go as soon as the engine gets to them.
+void releaseHeldVISCAStops(viscaQueue_t *queue) {
+    for (int position = 0; position < queue->count; position++) {
+        viscaQueueEntry(queue, position)->heldUntilTick = 0;
+    }
+}
+
+// Removes the next request to send, unless it is being held until after tick.  Only a
+// stop may be sent while the window is full.
+bool dequeueVISCARequest(viscaQueue_t *queue, bool windowFull, uint64_t tick, viscaRequest_t *request) {
+    viscaRequest_t *next = viscaQueueEntry(queue, 0);
+    if (queue->count == 0 || (windowFull && !next->isStop) || next->heldUntilTick > tick) {
+        return false;
+    }
+    *request = *viscaQueueEntry(queue, 0);
+    queue->head = (queue->head + 1) % VISCA_QUEUE_SIZE;
+    queue->count--;
+    return true;
+}
+
+// Gives up on drive commands of the given kind that the camera hasn't finished with,
+// because a stop is about to overtake them.  Returns the number abandoned.
+int preemptVISCADriveRequests(viscaEngine_t *engine, viscaCommandKind_t kind) {
+    int preempted = 0;
+    for (int index = 0; index < VISCA_IN_FLIGHT_TABLE_SIZE; index++) {
+        if (engine->inFlight[index].state != kVISCARequestFree && engine->inFlight[index].kind == kind) {
+            finishVISCARequest(engine, index, NULL, 0);
+            preempted++;
+        }
+    }
+    return preempted;
+}
+
+void printVISCAStats(const viscaCommandStats_t *stats) {
+    fprintf(stderr, "VISCA commands queued: %llu  sent: %llu  coalesced: %llu  preempted by stops: %llu  "
+            "dropped: %llu  resyncs: %llu\n",
+            (unsigned long long)stats->queued, (unsigned long long)stats->sent,
+            (unsigned long long)stats->coalesced, (unsigned long long)stats->preempted,
+            (unsigned long long)stats->dropped, (unsigned long long)stats->resyncs);
+}
+
+void dropVISCASocket(int sock);
+
+// Reports a TCP write error, and gives up on the socket if the camera has gone away.
+void handleVISCAWriteError(int sock) {
+    perror("write failed.");
+    if (errno == EPIPE || errno == ECONNRESET || errno == ETIMEDOUT) {
+        dropVISCASocket(sock);
+    }
+}
+
+// Writes to a TCP camera without blocking.  Whatever the socket has no room for yet is
+// kept, and sent ahead of anything newer as soon as there is room.  Returns false if the
+// bytes could be neither sent nor kept.
+bool writeVISCAStream(viscaEngine_t *engine, int sock, const uint8_t *bytes, ssize_t length) {
+    ssize_t written = 0;
+    if (engine->unsentLength == 0) {
+        written = send(sock, bytes, length, VISCA_SEND_FLAGS);
+        if (written == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                handleVISCAWriteError(sock);
+                return false;
+            }
+            written = 0;
+        }
+    }
+    if (written == length) return true;
+
+    // A partly written packet always fits, because the buffer was empty.
+    if (length - written > VISCA_UNSENT_BUFFER_SIZE - engine->unsentLength) {
+        fprintf(stderr, "VISCA send buffer full.\n");
+        return false;
+    }
+    memcpy(engine->unsent + engine->unsentLength, bytes + written, length - written);
+    engine->unsentLength += length - written;
+    return true;
+}
+
+// Sends as much of what writeVISCAStream kept as the socket has room for.
+void flushVISCAStream(viscaEngine_t *engine, int sock) {
+    if (engine->unsentLength == 0 || sock == -1) return;
+    ssize_t written = send(sock, engine->unsent, engine->unsentLength, VISCA_SEND_FLAGS);
+    if (written == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            handleVISCAWriteError(sock);
+        }
+        return;
+    }
+    memmove(engine->unsent, engine->unsent + written, engine->unsentLength - written);
+    engine->unsentLength -= written;
+}
+
+bool sendVISCARequest(viscaEngine_t *engine, int sock, const viscaRequest_t *request, uint32_t sequenceNumber) {
+    if (g_visca_use_udp) {
+        uint8_t udpbuf[VISCA_HEADER_SIZE + VISCA_MAX_PACKET_SIZE];
+        encodeVISCAHeader(udpbuf, request->isInquiry ? VISCA_PAYLOAD_TYPE_INQUIRY : VISCA_PAYLOAD_TYPE_COMMAND,
+                          request->length, sequenceNumber);
+        bcopy(request->packet, udpbuf + VISCA_HEADER_SIZE, request->length);
+        ssize_t udpbufsize = request->length + VISCA_HEADER_SIZE;
+        if (sendto(sock, udpbuf, udpbufsize, 0,
+                   (sockaddr *)&g_visca_addr, sizeof(struct sockaddr_in)) != udpbufsize) {
+            perror("write failed.");
+            return false;
+        }
+        if (enable_verbose_debugging) {
+            fprintf(stderr, "Sent %s\n", fmtbuf(udpbuf, udpbufsize));
+        }
+    } else if (!writeVISCAStream(engine, sock, request->packet, request->length)) {
+        return false;
+    }
+    return true;
+}
+
+// Sends queued requests while the camera has room for them.
+void sendQueuedVISCARequests(viscaEngine_t *engine, int sock) {
+    while (!engine->awaitingReset) {
+        viscaRequest_t request;
+        pthread_mutex_lock(&g_viscaQueueMutex);
+        bool haveRequest = dequeueVISCARequest(&g_viscaQueue, engine->awaitingAck >= VISCA_SEND_WINDOW,
+                                               engine->currentTick, &request);
+        pthread_mutex_unlock(&g_viscaQueueMutex);
+        if (!haveRequest) return;
+
+        int preempted = request.isStop ? preemptVISCADriveRequests(engine, request.kind) : 0;
+        uint32_t sequenceNumber = g_visca_sequence_number;
+        bool sent = (request.sock == sock && sock != -1 && sendVISCARequest(engine, sock, &request, sequenceNumber));
+        if (sent) {
+            g_visca_sequence_number++;
+            trackVISCARequest(engine, &request, sequenceNumber);
+        } else if (request.isInquiry && request.handler != NULL) {
+            request.handler(NULL, 0);
+        }
+
+        pthread_mutex_lock(&g_viscaQueueMutex);
+        g_viscaStats.preempted += preempted;
+        g_viscaStats.sent += sent ? 1 : 0;
+        viscaCommandStats_t stats = g_viscaStats;
+        pthread_mutex_unlock(&g_viscaQueueMutex);
+        if (sent && (enable_ptz_debugging || enable_verbose_debugging) && (stats.sent % 100) == 0) {
+            printVISCAStats(&stats);
+        }
+    }
+}
+
+// Sends (or resends) the RESET control command.  The first attempt abandons everything in
+// flight, because the camera's answers to it can no longer be matched.
+void sendVISCAReset(viscaEngine_t *engine, int sock) {
+    engine->resyncNeeded = false;
+    if (!engine->awaitingReset) {
+        abandonVISCARequests(engine);
+        engine->resetAttempts = 0;
+        pthread_mutex_lock(&g_viscaQueueMutex);
+        g_viscaStats.resyncs++;
+        pthread_mutex_unlock(&g_viscaQueueMutex);
+    }
+    if (engine->resetUnsupported) {
+        // Abandoning what was in flight is all that can be done.
+        return;
+    }
+    if (engine->resetAttempts >= VISCA_RESET_ATTEMPTS) {
+        // The camera doesn't support control commands, or isn't answering.  Carry on.  If it
+        // answers everything else, don't hold commands up waiting for it again.
+        engine->awaitingReset = false;
+        engine->resetUnsupported = engine->cameraAnswered && !engine->cameraAckedReset;
+        return;
+    }
+    engine->resetAttempts++;
+    engine->awaitingReset = true;
+    engine->resetDeadlineTick = engine->currentTick + viscaTicksForUsec(VISCA_RESET_TIMEOUT);
+
+    uint8_t packet[VISCA_RESET_PACKET_SIZE];
+    encodeVISCAReset(packet, g_visca_sequence_number);
+    if (sendto(sock, packet, sizeof(packet), 0,
+               (sockaddr *)&g_visca_addr, sizeof(struct sockaddr_in)) != sizeof(packet)) {
+        perror("VISCA reset failed");
+    } else if (enable_verbose_debugging) {
+        fprintf(stderr, "Sent %s\n", fmtbuf(packet, sizeof(packet)));
+    }
+}
+
+// Starts a resync if one is needed, or retries an unanswered RESET.
+void serviceVISCAResync(viscaEngine_t *engine, int sock) {
+    if (sock == -1 || !g_visca_use_udp) {
+        engine->resyncNeeded = false;
+        engine->awaitingReset = false;
+        return;
+    }
+    if (engine->resyncNeeded || (engine->awaitingReset && engine->currentTick >= engine->resetDeadlineTick)) {
+        sendVISCAReset(engine, sock);
+    }
+}
+
+// Each UDP datagram is one message.  Over TCP, messages are reassembled from the stream.
+void receiveVISCAResponses(viscaEngine_t *engine, int sock) {
+    static uint8_t buf[65535];
+    while (true) {
+        uint8_t *readPointer = buf;
+        ssize_t space = sizeof(buf);
+        if (!g_visca_use_udp) {
+            readPointer = viscaStreamReadSpace(&engine->stream, &space);
+        }
+        ssize_t received_length = recvfrom(sock, readPointer, space, 0, NULL, NULL);
+        if (received_length <= 0) {
+            if (received_length == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("VISCA receive failed");
+                if (!g_visca_use_udp) dropVISCASocket(sock);
+            } else if (received_length == 0 && !g_visca_use_udp) {
+                fprintf(stderr, "VISCA camera closed the connection.\n");
+                dropVISCASocket(sock);
+            }
+            return;
+        }
+        if (enable_verbose_debugging) {
+            fprintf(stderr, "Received %s\n", fmtbuf(readPointer, received_length));
+        }
+        if (g_visca_use_udp) {
+            handleVISCAResponse(engine, buf, received_length, true);
+            continue;
+        }
+        viscaStreamDidRead(&engine->stream, received_length);
+        const uint8_t *message;
+        ssize_t length;
+        while (nextVISCAStreamMessage(&engine->stream, &message, &length)) {
+            handleVISCAResponse(engine, message, length, false);
+        }
+    }
+}
+
+#ifdef __linux__
+int g_viscaEpollFd = -1;
+#endif  // __linux__
+
+// Switches the engine to a new socket.  Requests sent on the old one are abandoned, and
+// the old one is closed, here on the thread that reads from it.
+void adoptVISCASocket(viscaEngine_t *engine, int *sock, int newSock) {
+    abandonVISCARequests(engine);
+    resetVISCAStreamParser(&engine->stream);
+    engine->unsentLength = 0;
+    engine->watchingWritable = false;
+    engine->reconnectPending = false;
+    engine->awaitingReset = false;
+    engine->resyncNeeded = (newSock != -1);
+    if (engine->cameraAddress.sin_addr.s_addr != g_visca_addr.sin_addr.s_addr ||
+            engine->cameraAddress.sin_port != g_visca_addr.sin_port) {
+        // A different camera.
+        engine->cameraAddress = g_visca_addr;
+        engine->cameraAnswered = false;
+        engine->cameraAckedReset = false;
+        engine->resetUnsupported = false;
+    }
+    if (*sock != -1 && *sock != newSock) {
+#ifdef __linux__
+        epoll_ctl(g_viscaEpollFd, EPOLL_CTL_DEL, *sock, NULL);
+#endif  // __linux__
+        close(*sock);
+    }
+    *sock = newSock;
+    if (newSock != -1) {
+        fcntl(newSock, F_SETFL, fcntl(newSock, F_GETFL) | O_NONBLOCK);
+        if (!g_visca_use_udp) {
+            // Remembered in case the camera hangs up.
+            socklen_t addressLength = sizeof(engine->peerAddress);
+            engine->havePeerAddress =
+                (getpeername(newSock, (struct sockaddr *)&engine->peerAddress, &addressLength) == 0);
+        }
+#ifdef __linux__
+        struct epoll_event event;
+        bzero(&event, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = newSock;
+        if (epoll_ctl(g_viscaEpollFd, EPOLL_CTL_ADD, newSock, &event) != 0 && errno != EEXIST) {
+            perror("cameracontroller: could not watch VISCA socket");
+        }
+#endif  // __linux__
+    }
+}
+
+// Returns how many milliseconds the engine can sleep before its next timeout comes due,
+// or -1 if nothing in flight, no RESET, no held stop, and no reconnection is waiting on a
+// timer.
+int viscaEngineWaitMsec(const viscaEngine_t *engine, double now) {
+    uint64_t deadlineTick = engine->awaitingReset ? engine->resetDeadlineTick : UINT64_MAX;
+    if (engine->reconnectPending) {
+        deadlineTick = MIN(deadlineTick, engine->reconnectTick);
+    }
+    if (engine->stopRetryTick > engine->currentTick) {
+        deadlineTick = MIN(deadlineTick, engine->stopRetryTick);
+    }
+    for (int index = 0; index < VISCA_IN_FLIGHT_TABLE_SIZE; index++) {
+        if (engine->inFlight[index].state != kVISCARequestFree) {
+            deadlineTick = MIN(deadlineTick, engine->inFlight[index].deadlineTick);
+        }
+    }
+    if (deadlineTick == UINT64_MAX) return -1;
+    double msec = (double)deadlineTick * VISCA_TIMER_TICK_MSEC - now * 1000.0;
+    return (msec > 0) ? (int)ceil(msec) : 0;
+}
+
+// Waits up to timeoutMsec (or forever, if -1) for a response, a newly queued request, or
+// (if TCP bytes are waiting to be sent) room in the socket.  Returns true if the socket is
+// readable.
+bool waitForVISCAEvents(viscaEngine_t *engine, int sock, int timeoutMsec) {
+    bool readable = false;
+    bool writable = (engine->unsentLength > 0);
+#ifdef __linux__
+    if (sock != -1 && writable != engine->watchingWritable) {
+        struct epoll_event event;
+        bzero(&event, sizeof(event));
+        event.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+        event.data.fd = sock;
+        if (epoll_ctl(g_viscaEpollFd, EPOLL_CTL_MOD, sock, &event) == 0) {
+            engine->watchingWritable = writable;
+        }
+    }
+    struct epoll_event events[2];
+    int count = epoll_wait(g_viscaEpollFd, events, 2, timeoutMsec);
+    for (int i = 0; i < count; i++) {
+        if (events[i].data.fd == sock && sock != -1 && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+            readable = true;
+        }
+    }
+#else  // ! __linux__
+    struct pollfd fds[2] = { { g_viscaWakePipe[0], POLLIN, 0 },
+                             { sock, (short)(POLLIN | (writable ? POLLOUT : 0)), 0 } };
+    if (poll(fds, (sock != -1) ? 2 : 1, timeoutMsec) > 0) {
+        readable = (sock != -1) && (fds[1].revents & (POLLIN | POLLERR | POLLHUP));
+    }
+#endif  // __linux__
+    uint8_t drain[16];
+    while (read(g_viscaWakePipe[0], drain, sizeof(drain)) > 0) {
+    }
+    return readable;
+}
+
+// Tries the TCP camera that hung up again after a delay that doubles each time, up to
+// VISCA_RECONNECT_MAX_DELAY, until it answers.
+void scheduleVISCAReconnect(viscaEngine_t *engine) {
+    if (!engine->havePeerAddress) return;
+    engine->reconnectDelayUsec = (engine->reconnectDelayUsec == 0) ? VISCA_RECONNECT_MIN_DELAY :
+        MIN(engine->reconnectDelayUsec * 2, VISCA_RECONNECT_MAX_DELAY);
+    engine->reconnectPending = true;
+    engine->reconnectTick = engine->currentTick + viscaTicksForUsec(engine->reconnectDelayUsec);
+    fprintf(stderr, "Reconnecting to the VISCA camera in %.1f seconds.\n", engine->reconnectDelayUsec / 1000000.0);
+}
+
+// Reconnects once the delay has passed, unless another socket has replaced the old one.
+// The connect blocks, but with no socket, the engine has nothing else to do meanwhile.
+void serviceVISCAReconnect(viscaEngine_t *engine, int sock) {
+    if (!engine->reconnectPending || sock != -1 || engine->currentTick < engine->reconnectTick) return;
+    engine->reconnectPending = false;
+    int newSock = connectToVISCAPortWithAddress((struct sockaddr *)&engine->peerAddress);
+    if (newSock == -1) {
+        scheduleVISCAReconnect(engine);
+        return;
+    }
+    pthread_mutex_lock(&g_viscaQueueMutex);
+    bool wanted = (g_viscaReconnectWanted && g_visca_sock == -1);
+    if (wanted) {
+        g_visca_sock = newSock;
+        g_viscaSocketGeneration++;
+        g_viscaReconnectWanted = false;
+    }
+    pthread_mutex_unlock(&g_viscaQueueMutex);
+    if (!wanted) {
+        close(newSock);
+    }
+}
+
+void *runVISCAEngineThread(void *argIgnored) {
+    viscaEngine_t *engine = &g_viscaEngine;
+    uint64_t generation = 0;
+    int sock = -1;
+    initVISCAEngine(engine, viscaTickForTime(monotonicSeconds()));
+
+    while (true) {
+        pthread_mutex_lock(&g_viscaQueueMutex);
+        bool socketChanged = (generation != g_viscaSocketGeneration);
+        int newSock = g_visca_sock;
+        generation = g_viscaSocketGeneration;
+        bool resyncRequested = g_viscaResyncRequested;
+        g_viscaResyncRequested = false;
+        bool reconnectWanted = g_viscaReconnectWanted;
+        pthread_mutex_unlock(&g_viscaQueueMutex);
+        if (socketChanged) {
+            adoptVISCASocket(engine, &sock, newSock);
+            if (newSock == -1 && reconnectWanted) {
+                scheduleVISCAReconnect(engine);
             }
         }
-        if (response[1 + udp_offset] != 0x50) {
-            if (localDebug) {
-                fprintf(stderr, "Unexpected response packet[2] %s\n", fmtbuf(response, localResponseLength));
-            }
-            valid = false;
+        if (resyncRequested && !engine->awaitingReset) {
+            engine->resyncNeeded = true;
         }
-        if (!valid) {
-            free(response);
-            response = get_ack_data(sock, VISCA_ACK_TIMEOUT, &localResponseLength);
+
+        serviceVISCAReconnect(engine, sock);
+        serviceVISCAResync(engine, sock);
+        flushVISCAStream(engine, sock);
+        sendQueuedVISCARequests(engine, sock);
+        if (waitForVISCAEvents(engine, sock, viscaEngineWaitMsec(engine, monotonicSeconds()))) {
+            receiveVISCAResponses(engine, sock);
         }
+        expireVISCARequests(engine, viscaTickForTime(monotonicSeconds()));
     }
-    uint8_t *returnValue = (uint8_t *)malloc(localResponseLength - udp_offset);
-    bcopy(response + udp_offset, returnValue, localResponseLength - udp_offset);
-    free(response);
-    *responseLength = localResponseLength - udp_offset;
-    return returnValue;
+    return NULL;
 }
 
-void send_visca_packet(int sock, uint8_t *buf, ssize_t bufsize, int timeout_usec) {
-    send_visca_packet_raw(sock, buf, bufsize, timeout_usec, false);
+void wakeVISCAEngine(void) {
+    uint8_t byte = 0;
+    if (g_viscaWakePipe[1] != -1 && write(g_viscaWakePipe[1], &byte, 1) < 0 && errno != EAGAIN) {
+        perror("cameracontroller: could not wake VISCA engine");
+    }
 }
 
-void send_visca_packet_raw(int sock, uint8_t *buf, ssize_t bufsize, int timeout_usec, bool isInquiry) {
-    // fprintf(stderr, "Sending VISCA packet on sock %d size %d\n", sock, (int)bufsize);
-    if (sock == -1) {
-        return;
+// Starts the engine thread if it isn't running.  Call with g_viscaQueueMutex held.
+bool startVISCAEngineLocked(void) {
+    if (g_viscaEngineStarted) return true;
+    if (pipe(g_viscaWakePipe) != 0) {
+        perror("cameracontroller: could not create VISCA wake pipe");
+        return false;
     }
-
-    if (g_visca_use_udp) {
-        ssize_t udpbufsize = bufsize + 8;
-        uint8_t *udpbuf = (uint8_t *)malloc(udpbufsize);
-        udpbuf[0] = 0x01;
-        udpbuf[1] = isInquiry ? 0x10 : 0x00;
-        udpbuf[2] = 0x00;
-        udpbuf[3] = bufsize;
-        udpbuf[4] = g_visca_sequence_number >> 24;
-        udpbuf[5] = (g_visca_sequence_number >> 16) & 0xff;
-        udpbuf[6] = (g_visca_sequence_number >> 8) & 0xff;
-        udpbuf[7] = g_visca_sequence_number & 0xff;
-        g_visca_sequence_number++;
-        bcopy(buf, udpbuf + 8, bufsize);
-        if (sendto(sock, udpbuf, udpbufsize, 0,
-               (sockaddr *)&g_visca_addr, sizeof(struct sockaddr_in)) != udpbufsize) {
-            perror("write failed.");
-        }
-
-        if (enable_verbose_debugging) {
-            fprintf(stderr, "Sent %s\n", fmtbuf(udpbuf, bufsize + 8));
-        }
-        free(udpbuf);
-    } else {
-        if (write(sock, buf, bufsize) != bufsize) {
-            perror("write failed.");
-        }
+    for (int i = 0; i < 2; i++) {
+        fcntl(g_viscaWakePipe[i], F_SETFL, fcntl(g_viscaWakePipe[i], F_GETFL) | O_NONBLOCK);
     }
-
-    if (isInquiry) {
-        // Let the caller handle the read.
-        return;
+#ifdef __linux__
+    g_viscaEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = g_viscaWakePipe[0];
+    if (g_viscaEpollFd == -1 || epoll_ctl(g_viscaEpollFd, EPOLL_CTL_ADD, g_viscaWakePipe[0], &event) != 0) {
+        perror("cameracontroller: could not create VISCA epoll instance");
+        return false;
     }
-
-    uint8_t ack = get_ack(sock, timeout_usec);
-    if (ack == 5) return;
-    else if (ack == 4) get_ack(sock, timeout_usec);
-    if (ack != 5 && enable_verbose_debugging) {
-        fprintf(stderr, "Unexpected ack: %d\n", ack);
+#endif  // __linux__
+    pthread_t engineThread;
+    if (pthread_create(&engineThread, NULL, runVISCAEngineThread, NULL) != 0) {
+        perror("cameracontroller: could not create VISCA thread");
+        return false;
     }
+    g_viscaEngineStarted = true;
+    return true;
 }
 
-uint8_t *get_ack_data(int sock, int timeout_usec, ssize_t *len) {
-    int udp_offset = g_visca_use_udp ? 8 : 0;
-
-    static uint8_t buf[65535];
-
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(sock, &readfds);
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = timeout_usec;
-    ssize_t received_length = 0;
-    bool should_continue = true;
-    int retries = 3;  // Cap retries on Linux, because otherwise this causes
-                      // hangs.  I have no idea why.
-    do {
-        int first_sock = select(sock + 1, &readfds, NULL, NULL, &tv);
-        if (first_sock > 0) {
-            if (enable_verbose_debugging) {
-                fprintf(stderr, "Calling recvfrom\n");
-            }
-            received_length = recvfrom(sock, buf, sizeof(buf),
-               0, NULL, NULL);
-            if (enable_verbose_debugging) {
-                fprintf(stderr, "Done (len = %llu).\n", (unsigned long long)received_length);
-            }
-            break;
-        } else if (first_sock == -1 && errno != EINTR) {
-            fprintf(stderr, "Timed out waiting for ack from camera.\n");
-            *len = 0;
-            return NULL;
-        } else {
-            if (enable_verbose_debugging) { fprintf(stderr, "EINTR\n"); }
-        }
-    } while (!exit_app && retries-- > 0);
+// Replaces the VISCA socket (or, with -1, closes it).  The engine closes the old socket.
+void setVISCASocket(int sock) {
+    pthread_mutex_lock(&g_viscaQueueMutex);
+    int oldSock = g_visca_sock;
+    g_visca_sock = sock;
+    g_viscaSocketGeneration++;
+    g_viscaReconnectWanted = false;
+    bool engineRunning = startVISCAEngineLocked();
+    pthread_mutex_unlock(&g_viscaQueueMutex);
+    if (!engineRunning && oldSock != -1 && oldSock != sock) {
+        close(oldSock);
+    }
+    wakeVISCAEngine();
+}
 
-    if (received_length <= 0) {
-        *len = 0;
-        return NULL;
+// Stops using a TCP socket whose camera has gone away, unless it has already been
+// replaced.  The engine closes it, and then reconnects to the same camera.
+void dropVISCASocket(int sock) {
+    pthread_mutex_lock(&g_viscaQueueMutex);
+    if (g_visca_sock == sock) {
+        g_visca_sock = -1;
+        g_viscaSocketGeneration++;
+        g_viscaReconnectWanted = true;
     }
+    pthread_mutex_unlock(&g_viscaQueueMutex);
+    wakeVISCAEngine();
+}
 
-    uint8_t *ack = (uint8_t *)malloc(received_length);
-    bcopy(buf, ack, received_length);
-    *len = received_length;
-    return ack;
+// Resynchronizes sequence numbers with the camera on the current socket, as after a
+// network outage.  Returns at once.
+void resyncVISCA(void) {
+    pthread_mutex_lock(&g_viscaQueueMutex);
+    g_viscaResyncRequested = true;
+    pthread_mutex_unlock(&g_viscaQueueMutex);
+    wakeVISCAEngine();
 }
 
-uint8_t get_ack(int sock, int timeout_usec) {
-    bool localDebug = enable_verbose_debugging || true;
-    int udp_offset = g_visca_use_udp ? 8 : 0;
-    if (enable_verbose_debugging) {
-        fprintf(stderr, "calling get_ack_data\n");
+// Queues a request for the engine thread and returns at once.  If the queue is full, the
+// oldest request is dropped, because newer joystick positions matter more.
+void queueVISCARequest(int sock, const uint8_t *buf, ssize_t bufsize, int timeout_usec, bool isInquiry,
+                       viscaResponseHandler handler, viscaCommandKind_t kind, bool isStop) {
+    if (sock == -1) return;
+    if (bufsize > VISCA_MAX_PACKET_SIZE) {
+        fprintf(stderr, "VISCA packet too long (%d bytes).\n", (int)bufsize);
+        return;
     }
-    ssize_t len;
-    unsigned char *ack = get_ack_data(sock, timeout_usec, &len);
-    if (len != 3) return 0;
-    if (!ack) return 0;
-    if (ack[0 + udp_offset] != 0x90 && localDebug) {
-        fprintf(stderr, "Unexpected ack address 0x%02x\n", ack[0 + udp_offset]);
+
+    viscaRequest_t request;
+    bzero(&request, sizeof(request));
+    bcopy(buf, request.packet, bufsize);
+    request.length = bufsize;
+    request.isInquiry = isInquiry;
+    request.timeoutUsec = timeout_usec;
+    request.handler = handler;
+    request.sock = sock;
+    request.kind = kind;
+    request.isStop = isStop;
+
+    viscaRequest_t dropped;
+    pthread_mutex_lock(&g_viscaQueueMutex);
+    if (!startVISCAEngineLocked()) {
+        pthread_mutex_unlock(&g_viscaQueueMutex);
+        if (handler != NULL) handler(NULL, 0);
+        return;
     }
-    uint8_t ack_type = ack[1 + udp_offset] >> 4;
-    if (ack_type != 4 && ack_type != 5 && localDebug) {
-        fprintf(stderr, "Unexpected ack type 0x%02x\n", ack[1 + udp_offset]);
+    bool droppedOne = enqueueVISCARequest(&g_viscaQueue, &request, &g_viscaStats, &dropped);
+    pthread_mutex_unlock(&g_viscaQueueMutex);
+
+    if (droppedOne) {
+        if (enable_verbose_debugging) {
+            fprintf(stderr, "VISCA queue full.  Dropping %s\n", fmtbuf(dropped.packet, dropped.length));
+        }
+        if (dropped.isInquiry && dropped.handler != NULL) {
+            dropped.handler(NULL, 0);
+        }
     }
-    if (ack[2 + udp_offset] != 0xff && localDebug) {
-        fprintf(stderr, "Unexpected ack trailer 0x%02x\n", ack[2 + udp_offset]);
+    wakeVISCAEngine();
+}
+
+// Prints the engine's counters, if it ever ran.
+void reportVISCAStats(void) {
+    pthread_mutex_lock(&g_viscaQueueMutex);
+    bool engineStarted = g_viscaEngineStarted;
+    viscaCommandStats_t stats = g_viscaStats;
+    pthread_mutex_unlock(&g_viscaQueueMutex);
+    if (engineStarted) {
+        printVISCAStats(&stats);
     }
-    free(ack);
-    return ack_type;
 }
 
 #pragma mark - PTZ Core
@@ -2407,6 +6510,14 @@ void updatePTZValues() {
     if (enable_ptz_debugging) {
         fprintf(stderr, "\n");
     }
+#ifdef __linux__
+    if (g_magnification > 0) {
+        // Move the magnified window, and hold the camera still.
+        panMagnifiedRegion(newMotionData.xAxisPosition, newMotionData.yAxisPosition);
+        newMotionData.xAxisPosition = 0.0;
+        newMotionData.yAxisPosition = 0.0;
+    }
+#endif  // __linux__
 
     // Determine whether the set button is down.
     newMotionData.setButtonDown = readButton(BUTTON_SET, &newMotionData);
@@ -2424,6 +6535,23 @@ void updatePTZValues() {
     if (newMotionData.setButtonDown && !lastSetButtonDown) {
         newMotionData.setMode = !newMotionData.setMode;
     }
+#ifdef __linux__
+    // Holding the set button steps the magnification instead, and undoes the press.
+    static double setButtonDownTime = 0;
+    static bool setButtonHoldHandled = false;
+    if (newMotionData.setButtonDown && !lastSetButtonDown) {
+        setButtonDownTime = monotonicSeconds();
+        setButtonHoldHandled = false;
+    } else if (newMotionData.setButtonDown && !setButtonHoldHandled &&
+               monotonicSeconds() - setButtonDownTime >= SET_BUTTON_MAGNIFY_SECONDS) {
+        setButtonHoldHandled = true;
+        newMotionData.setMode = !newMotionData.setMode;
+        stepMagnification();
+        if (enable_button_debugging) {
+            fprintf(stderr, "Magnification %d\n", (int)g_magnification);
+        }
+    }
+#endif  // __linux__
     lastSetButtonDown = newMotionData.setButtonDown;
 
     /*
@@ -2745,11 +6873,34 @@ void *runPTZThread(void *argIgnored) {
 
 void free_receiver_item(receiver_array_item_t receiver_item) {
     free(receiver_item->name);
-    free(receiver_item->thread_data->stream_name);
-    free(receiver_item->thread_data);
+    if (receiver_item->thread_data != NULL) {
+        free((void *)receiver_item->thread_data->source.p_ndi_name);
+        free((void *)receiver_item->thread_data->source.p_url_address);
+        free(receiver_item->thread_data->stream_name);
+        free(receiver_item->thread_data);
+    }
     free(receiver_item);
 }
 
+// The finder owns the strings in the sources that it returns, and they go away the next
+// time it looks for sources, so receive threads keep their own copies.
+void copySource(NDIlib_source_t *destination, const NDIlib_source_t *source) {
+    bzero(destination, sizeof(*destination));
+    destination->p_ndi_name = source->p_ndi_name ? strdup(source->p_ndi_name) : NULL;
+    destination->p_url_address = source->p_url_address ? strdup(source->p_url_address) : NULL;
+}
+
+NDIlib_recv_instance_t createReceiver(const NDIlib_source_t *source, bool lowBandwidth) {
+    NDIlib_recv_create_v3_t NDI_recv_create_desc = {
+        *source,
+        receive_yuv ? NDIlib_recv_color_format_UYVY_BGRA : NDIlib_recv_color_format_BGRX_BGRA,
+        lowBandwidth ? NDIlib_recv_bandwidth_lowest : NDIlib_recv_bandwidth_highest,
+        false,
+        "NDIRec"
+    };
+    return NDIlib_recv_create_v3(&NDI_recv_create_desc);
+}
+
 void truncate_name_before_ip(char *name) {
     for (char *pos = &name[strlen(name) - 1] ; pos >= name; pos--) {
         if (*pos == ',') {
@@ -2831,24 +6982,30 @@ bool sourceIsActiveForName(const char *source_name, receiver_array_item_t array)
 
 #pragma mark - Formatting
 
+#define FMTBUF_MAX_BYTES 256
+
 char fmtnibble(uint8_t nibble) {
     if (nibble <= 9) return '0' + nibble;
     return 'A' - 10 + nibble;
 }
 
-char *fmtbuf(uint8_t *buf, ssize_t bufsize) {
-    static char *retval = NULL;
-    if (retval != NULL) {
-        free(retval);
-        retval = NULL;
+// Formats bytes as hex into a per-thread buffer that stays valid until this thread's
+// next call.  Long buffers are truncated with "...".
+const char *fmtbuf(const uint8_t *buf, ssize_t bufsize) {
+    static thread_local char retval[FMTBUF_MAX_BYTES * 3 + 4];
+    ssize_t count = (buf == NULL || bufsize < 0) ? 0 : bufsize;
+    if (count > FMTBUF_MAX_BYTES) count = FMTBUF_MAX_BYTES;
+    char *pos = retval;
+    for (ssize_t i = 0 ; i < count; i++) {
+        *pos++ = fmtnibble(buf[i] >> 4);
+        *pos++ = fmtnibble(buf[i] & 0xf);
+        *pos++ = ' ';
     }
-    retval = (char *)malloc(bufsize * 3);
-    for (ssize_t i = 0 ; i < bufsize; i++) {
-        retval[i * 3] = fmtnibble(buf[i] >> 4);
-        retval[(i * 3) + 1] = fmtnibble(buf[i] & 0xf);
-        retval[(i * 3) + 2] = ' ';
+    if (bufsize > count) {
+        strcpy(pos, "...");
+    } else {
+        pos[count ? -1 : 0] = '\0';
     }
-    retval[(bufsize * 3) - 1] = '\0';
     return retval;
 }
 
@@ -2897,11 +7054,98 @@ void demoPTZValues(void) {
 }
 #endif
 
+#ifdef __linux__
+double benchmarkSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1000000000.0);
+}
+
+// Times full-screen copies into a memory-backed stand-in for the framebuffer, comparing
+// memcpy with the selected streaming-store kernel.  Run with --benchmark.  A real
+// framebuffer is write-combined, so the gap there is usually larger than shown here.
+void runFramebufferCopyBenchmark(void) {
+    const size_t frameSize = 1920 * 1080 * 4;
+    const int iterations = 200;
+
+    selectPixelConversionKernels();
+    unsigned char *source = (unsigned char *)malloc(frameSize);
+    unsigned char *destination = (unsigned char *)mmap(NULL, frameSize, PROT_READ | PROT_WRITE,
+                                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (source == NULL || destination == MAP_FAILED) {
+        perror("cameracontroller");
+        free(source);
+        return;
+    }
+    memset(source, 0x5A, frameSize);
+    memset(destination, 0, frameSize);
+
+    const struct { const char *name; copyToFramebufferFunc copy; } kernels[] = {
+        { "memcpy", copy_to_framebuffer_scalar },
+        { "streaming", g_copyToFramebuffer },
+    };
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        double start = benchmarkSeconds();
+        for (int i = 0; i < iterations; i++) {
+            kernels[k].copy(destination, source, frameSize);
+        }
+        double elapsed = benchmarkSeconds() - start;
+        fprintf(stderr, "%-10s %7.3f ms/frame  %6.2f GB/s\n", kernels[k].name,
+                (elapsed * 1000.0) / iterations, ((double)frameSize * iterations) / elapsed / 1e9);
+    }
+
+    munmap(destination, frameSize);
+    free(source);
+}
+#endif  // __linux__
+
 void testDebounce(void);
+void testPixelConversion(void);
+void testOnScreenLights(void);
+void testAdaptiveBandwidth(void);
+void testStaleFrameDraining(void);
+void testVISCAEngine(void);
+void testVISCACoalescing(void);
+void testVISCACodec(void);
+void testVISCAResync(void);
+void testVISCAStreamParser(void);
+void testVISCAStreamWriter(void);
+void testScalerPlan(void);
+void testScalerPlanCache(void);
+void testSpecializedBlitters(void);
+void testFitModes(void);
+void testYUVBlitters(void);
+void testRotatedBlitters(void);
+void testFramePacing(void);
+void testMultiviewLayout(void);
+void testMirrorOutputs(void);
+void testMagnification(void);
 void runUnitTests(void) {
 #ifndef DEMO_MODE
     testDebounce();
 #endif  // DEMO_MODE
+    testPixelConversion();
+    testOnScreenLights();
+    testAdaptiveBandwidth();
+    testStaleFrameDraining();
+    testVISCAEngine();
+    testVISCACoalescing();
+    testVISCACodec();
+    testVISCAResync();
+    testVISCAStreamParser();
+    testVISCAStreamWriter();
+#ifdef __linux__
+    testScalerPlan();
+    testScalerPlanCache();
+    testSpecializedBlitters();
+    testFitModes();
+    testYUVBlitters();
+    testRotatedBlitters();
+    testFramePacing();
+    testMultiviewLayout();
+    testMirrorOutputs();
+    testMagnification();
+#endif  // __linux__
 }
 
 void testPin(int pin);
@@ -2973,6 +7217,1269 @@ void testDebounce(void) {
 }
 #endif  // DEMO_MODE
 
+// Checks every SIMD row kernel that this CPU can run against the scalar reference,
+// using row lengths that exercise both the vector loop and the scalar tail.
+void testPixelConversionKernel(convertRowTo16bppFunc kernel, const char *kernelName) {
+    uint32_t in[67];
+    uint16_t expected[67], actual[67];
+    for (int i = 0; i < 67; i++) {
+        in[i] = (uint32_t)(i * 0x9E3779B1u);
+    }
+    for (int count = 0; count <= 67; count++) {
+        convert_row_to_16bpp_scalar(in, expected, count);
+        memset(actual, 0, sizeof(actual));
+        kernel(in, actual, count);
+        if (memcmp(expected, actual, count * sizeof(uint16_t))) {
+            fprintf(stderr, "%s pixel conversion mismatch (count %d)\n", kernelName, count);
+            assert(false);
+        }
+    }
+}
+
+void testRowReversalKernel(reverseRow32Func kernel, const char *kernelName) {
+    uint32_t in[37], actual[37];
+    for (int i = 0; i < 37; i++) {
+        in[i] = (uint32_t)(i * 0x9E3779B1u);
+    }
+    for (int count = 0; count <= 37; count++) {
+        memset(actual, 0, sizeof(actual));
+        kernel(in, actual, count);
+        for (int i = 0; i < count; i++) {
+            if (actual[i] != in[count - i - 1]) {
+                fprintf(stderr, "%s row reversal mismatch (count %d)\n", kernelName, count);
+                assert(false);
+            }
+        }
+    }
+}
+
+// Every destination alignment and length around a few cache lines, checking that the
+// bytes on either side of the copy are left alone.
+void testFramebufferCopyKernel(copyToFramebufferFunc kernel, const char *kernelName) {
+    unsigned char in[256], actual[256 + 2 * FRAMEBUFFER_LINE_SIZE] __attribute__((aligned(64)));
+    for (size_t i = 0; i < sizeof(in); i++) {
+        in[i] = (unsigned char)((i * 0x9E3779B1u) >> 11);
+    }
+    for (int offset = 0; offset < FRAMEBUFFER_LINE_SIZE; offset++) {
+        for (int count = 0; count <= (int)sizeof(in) - offset; count += (count < 140) ? 1 : 29) {
+            memset(actual, 0xA5, sizeof(actual));
+            kernel(&actual[offset], &in[offset], count);
+            bool ok = !memcmp(&actual[offset], &in[offset], count);
+            for (int i = 0; i < offset; i++) ok = ok && actual[i] == 0xA5;
+            for (size_t i = offset + count; i < sizeof(actual); i++) ok = ok && actual[i] == 0xA5;
+            if (!ok) {
+                fprintf(stderr, "%s framebuffer copy mismatch (offset %d, count %d)\n", kernelName, offset, count);
+                assert(false);
+            }
+        }
+    }
+}
+
+void testTransposeKernel(transposeBlock32Func kernel, const char *kernelName) {
+    const int inStride = TRANSPOSE_BLOCK_SIZE + 3, outStride = TRANSPOSE_BLOCK_SIZE + 5;
+    uint32_t in[TRANSPOSE_BLOCK_SIZE * inStride], out[TRANSPOSE_BLOCK_SIZE * outStride];
+    for (size_t i = 0; i < sizeof(in) / sizeof(in[0]); i++) {
+        in[i] = (uint32_t)(i * 0x9E3779B1u);
+    }
+    memset(out, 0, sizeof(out));
+    kernel(in, inStride, out, outStride);
+    for (int i = 0; i < TRANSPOSE_BLOCK_SIZE; i++) {
+        for (int j = 0; j < outStride; j++) {
+            uint32_t expected = (j < TRANSPOSE_BLOCK_SIZE) ? in[j * inStride + i] : 0;
+            if (out[i * outStride + j] != expected) {
+                fprintf(stderr, "%s transpose mismatch (%d, %d)\n", kernelName, i, j);
+                assert(false);
+            }
+        }
+    }
+}
+
+void testYUVConversionKernel(convertUYVYRowToBGRXFunc kernel, const char *kernelName) {
+    uint8_t in[68 * 2];
+    uint32_t expected[68], actual[68];
+    for (size_t i = 0; i < sizeof(in); i++) {
+        in[i] = (uint8_t)((i * 0x9E3779B1u) >> 13);
+    }
+    for (int count = 0; count <= 68; count++) {
+        convert_uyvy_row_to_bgrx_scalar(in, expected, count);
+        memset(actual, 0, sizeof(actual));
+        kernel(in, actual, count);
+        if (memcmp(expected, actual, count * sizeof(uint32_t))) {
+            fprintf(stderr, "%s YUV conversion mismatch (count %d)\n", kernelName, count);
+            assert(false);
+        }
+    }
+}
+
+void testPixelConversion(void) {
+    assert(convert_yuv_sample_to_bgrx(235, 128, 128) == 0xFFFFFFFF);
+    assert(convert_yuv_sample_to_bgrx(16, 128, 128) == 0xFF000000);
+    assert(convert_yuv_sample_to_bgrx(255, 128, 128) == 0xFFFFFFFF);
+    assert(convert_yuv_sample_to_bgrx(0, 128, 128) == 0xFF000000);
+    assert(convert_yuv_sample_to_bgrx(126, 128, 128) == 0xFF808080);
+
+    assert(convert_sample_to_16bpp(0x00FF0000) == 0xF800);
+    assert(convert_sample_to_16bpp(0x0000FF00) == 0x07E0);
+    assert(convert_sample_to_16bpp(0x000000FF) == 0x001F);
+    assert(convert_sample_to_16bpp(0xFF808080) == 0x8410);
+
+#if defined(__SSE2__)
+    testPixelConversionKernel(convert_row_to_16bpp_sse2, "SSE2");
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpuSupportsAVX2()) {
+        testPixelConversionKernel(convert_row_to_16bpp_avx2, "AVX2");
+    }
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+    if (cpuSupportsNEON()) {
+        testPixelConversionKernel(convert_row_to_16bpp_neon, "NEON");
+    }
+#endif
+
+#if defined(__SSE2__)
+    testRowReversalKernel(reverse_row_32_sse2, "SSE2");
+    testYUVConversionKernel(convert_uyvy_row_to_bgrx_sse2, "SSE2");
+    testFramebufferCopyKernel(copy_to_framebuffer_sse2, "SSE2");
+    testTransposeKernel(transpose_block_32_sse2, "SSE2");
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+    if (cpuSupportsNEON()) {
+        testRowReversalKernel(reverse_row_32_neon, "NEON");
+        testYUVConversionKernel(convert_uyvy_row_to_bgrx_neon, "NEON");
+        testTransposeKernel(transpose_block_32_neon, "NEON");
+#if defined(__aarch64__)
+        testFramebufferCopyKernel(copy_to_framebuffer_neon, "NEON");
+#endif
+    }
+#endif
+}
+
+// Feeds the bandwidth state machine a number of identical intervals and returns how
+// many of them caused a switch.
+int runAdaptiveBandwidthIntervals(adaptiveBandwidth_t *state, int count, int dropped, int queued,
+                                  int temperature, bool live) {
+    bandwidthSample_t sample = { ADAPTIVE_BANDWIDTH_INTERVAL, 60, dropped, queued, temperature, live };
+    int switches = 0;
+    for (int i = 0; i < count; i++) {
+        if (updateAdaptiveBandwidth(state, &sample)) switches++;
+    }
+    return switches;
+}
+
+static int g_testVISCAResponseCount = 0;
+static ssize_t g_testVISCAResponseLength = -1;
+
+void recordTestVISCAResponse(const uint8_t *response, ssize_t length) {
+    g_testVISCAResponseCount++;
+    g_testVISCAResponseLength = response ? length : -1;
+}
+
+// Acks, completions, errors, and timeouts must each reach the right request, with or
+// without VISCA-over-IP sequence numbers.
+void testVISCAEngine(void) {
+    viscaEngine_t engine;
+    initVISCAEngine(&engine, 1000);
+    viscaRequest_t command, inquiry;
+    bzero(&command, sizeof(command));
+    command.timeoutUsec = 100000;  // 20 ticks.
+    inquiry = command;
+    inquiry.isInquiry = true;
+    inquiry.handler = recordTestVISCAResponse;
+
+    // UDP: the ack and the completion quote the command's sequence number.
+    const uint8_t ack7[] = { 0x01, 0x11, 0x00, 0x03, 0x00, 0x00, 0x00, 0x07, 0x90, 0x41, 0xFF };
+    const uint8_t completion7[] = { 0x01, 0x11, 0x00, 0x03, 0x00, 0x00, 0x00, 0x07, 0x90, 0x51, 0xFF };
+    assert(viscaEngineWaitMsec(&engine, 5.0) == -1);
+    trackVISCARequest(&engine, &command, 7);
+    assert(engine.awaitingAck == 1);
+    // The engine sleeps until the ack is due (tick 1020), and no longer.
+    assert(viscaEngineWaitMsec(&engine, 5.0) == 100 && viscaEngineWaitMsec(&engine, 5.2) == 0);
+    handleVISCAResponse(&engine, ack7, sizeof(ack7), true);
+    assert(engine.awaitingAck == 0 && engine.inFlight[7].state == kVISCARequestAwaitingCompletion);
+    handleVISCAResponse(&engine, completion7, sizeof(completion7), true);
+    assert(engine.inFlight[7].state == kVISCARequestFree);
+
+    // An inquiry's answer goes to its handler, without the header.
+    const uint8_t tally8[] = { 0x01, 0x11, 0x00, 0x04, 0x00, 0x00, 0x00, 0x08, 0x90, 0x50, 0x05, 0xFF };
+    trackVISCARequest(&engine, &inquiry, 8);
+    handleVISCAResponse(&engine, tally8, sizeof(tally8), true);
+    assert(g_testVISCAResponseCount == 1 && g_testVISCAResponseLength == 4);
+    assert(engine.inFlight[8].state == kVISCARequestFree && engine.awaitingAck == 0);
+
+    // A late completion for an abandoned command must not be taken as the answer to a
+    // newer inquiry.
+    trackVISCARequest(&engine, &inquiry, 9);
+    handleVISCAResponse(&engine, completion7, sizeof(completion7), true);
+    assert(g_testVISCAResponseCount == 1 && engine.inFlight[9].state == kVISCARequestAwaitingAck);
+
+    // Unanswered inquiries time out on the wheel, and not before.
+    expireVISCARequests(&engine, 1019);
+    assert(g_testVISCAResponseCount == 1);
+    expireVISCARequests(&engine, 1021);
+    assert(g_testVISCAResponseCount == 2 && g_testVISCAResponseLength == -1 && engine.awaitingAck == 0);
+
+    // TCP: acks go to the oldest request, and completions to the camera socket that was acked.
+    const uint8_t ack1[] = { 0x90, 0x41, 0xFF }, ack2[] = { 0x90, 0x42, 0xFF }, completion2[] = { 0x90, 0x52, 0xFF };
+    trackVISCARequest(&engine, &command, 10);
+    trackVISCARequest(&engine, &command, 11);
+    handleVISCAResponse(&engine, ack1, sizeof(ack1), false);
+    handleVISCAResponse(&engine, ack2, sizeof(ack2), false);
+    assert(engine.inFlight[10].cameraSocket == 1 && engine.inFlight[11].cameraSocket == 2);
+    handleVISCAResponse(&engine, completion2, sizeof(completion2), false);
+    assert(engine.inFlight[10].state == kVISCARequestAwaitingCompletion &&
+           engine.inFlight[11].state == kVISCARequestFree);
+
+    // An error ends the request.  A response that matches nothing is ignored.
+    const uint8_t syntaxError[] = { 0x90, 0x60, 0x02, 0xFF };
+    trackVISCARequest(&engine, &command, 12);
+    handleVISCAResponse(&engine, syntaxError, sizeof(syntaxError), false);
+    assert(engine.inFlight[12].state == kVISCARequestFree && engine.awaitingAck == 0);
+    handleVISCAResponse(&engine, ack1, sizeof(ack1), false);
+    assert(engine.awaitingAck == 0);
+
+    // Completion timeouts are much longer, so the wheel takes several turns.
+    expireVISCARequests(&engine, 1021 + viscaTickForTime(VISCA_COMPLETION_TIMEOUT / 1000000.0) - 1);
+    assert(engine.inFlight[10].state == kVISCARequestAwaitingCompletion);
+    expireVISCARequests(&engine, 1021 + viscaTickForTime(VISCA_COMPLETION_TIMEOUT / 1000000.0) + 1);
+    assert(engine.inFlight[10].state == kVISCARequestFree);
+    assert(viscaEngineWaitMsec(&engine, 7.0) == -1);
+}
+
+// Only the newest drive speed of each kind may wait in the queue, and a stop must overtake
+// everything, including a full window and the drive commands already in flight.
+void testVISCACoalescing(void) {
+    viscaQueue_t queue;
+    viscaCommandStats_t stats;
+    bzero(&queue, sizeof(queue));
+    bzero(&stats, sizeof(stats));
+    viscaRequest_t request, dropped, next;
+    bzero(&request, sizeof(request));
+
+    request.kind = kVISCACommandOther;
+    request.packet[0] = 1;
+    enqueueVISCARequest(&queue, &request, &stats, &dropped);
+    request.kind = kVISCACommandPanTilt;
+    for (int speed = 2; speed <= 4; speed++) {
+        request.packet[0] = speed;
+        enqueueVISCARequest(&queue, &request, &stats, &dropped);
+    }
+    request.kind = kVISCACommandZoom;
+    request.packet[0] = 5;
+    enqueueVISCARequest(&queue, &request, &stats, &dropped);
+    assert(queue.count == 3 && stats.queued == 5 && stats.coalesced == 2);
+
+    // The stop replaces the queued pan speed and goes to the front, even past a full window.
+    request.kind = kVISCACommandPanTilt;
+    request.isStop = true;
+    request.packet[0] = 6;
+    enqueueVISCARequest(&queue, &request, &stats, &dropped);
+    assert(queue.count == 3 && stats.coalesced == 3);
+    assert(dequeueVISCARequest(&queue, true, 0, &next) && next.packet[0] == 6);
+    assert(!dequeueVISCARequest(&queue, true, 0, &next));
+    assert(dequeueVISCARequest(&queue, false, 0, &next) && next.packet[0] == 1);
+    assert(dequeueVISCARequest(&queue, false, 0, &next) && next.packet[0] == 5);
+    assert(!dequeueVISCARequest(&queue, false, 0, &next));
+
+    // A full queue pushes out its oldest request.
+    request.kind = kVISCACommandOther;
+    request.isStop = false;
+    for (int i = 0; i < VISCA_QUEUE_SIZE; i++) {
+        request.packet[0] = i;
+        assert(!enqueueVISCARequest(&queue, &request, &stats, &dropped));
+    }
+    assert(enqueueVISCARequest(&queue, &request, &stats, &dropped) && dropped.packet[0] == 0 && stats.dropped == 1);
+
+    // Sending a stop abandons the in-flight drive commands of its kind, and only those.
+    viscaEngine_t engine;
+    initVISCAEngine(&engine, 0);
+    request.timeoutUsec = 100000;
+    request.kind = kVISCACommandPanTilt;
+    trackVISCARequest(&engine, &request, 1);
+    request.kind = kVISCACommandZoom;
+    trackVISCARequest(&engine, &request, 2);
+    assert(engine.awaitingAck == 2);
+    assert(preemptVISCADriveRequests(&engine, kVISCACommandPanTilt) == 1);
+    assert(engine.awaitingAck == 1 && engine.inFlight[1].state == kVISCARequestFree &&
+           engine.inFlight[2].state == kVISCARequestAwaitingAck);
+
+    // A stop that finds the camera's command buffer full goes back to the front of the
+    // queue, unless a newer command of its kind is already waiting.  It is held there until
+    // a command finishes or the retry delay passes, not sent straight back.  Other errors
+    // end it.
+    const uint8_t bufferFull[] = { 0x90, 0x60, VISCA_ERROR_BUFFER_FULL, 0xFF };
+    const uint8_t syntaxError[] = { 0x90, 0x60, 0x02, 0xFF };
+    viscaQueue_t savedQueue = g_viscaQueue;
+    viscaCommandStats_t savedStats = g_viscaStats;
+    bzero(&g_viscaQueue, sizeof(g_viscaQueue));
+    finishVISCARequest(&engine, 2, NULL, 0);
+    request.kind = kVISCACommandOther;
+    request.packet[0] = 1;
+    enqueueVISCARequest(&g_viscaQueue, &request, &stats, &dropped);
+    request.kind = kVISCACommandPanTilt;
+    request.isStop = true;
+    request.packet[0] = 2;
+    trackVISCARequest(&engine, &request, 3);
+    handleVISCAResponse(&engine, bufferFull, sizeof(bufferFull), false);
+    assert(engine.inFlight[3].state == kVISCARequestFree && g_viscaQueue.count == 2);
+    uint64_t retryTick = viscaTicksForUsec(VISCA_STOP_RETRY_DELAY);
+    assert(!dequeueVISCARequest(&g_viscaQueue, true, retryTick - 1, &next));
+    assert(!dequeueVISCARequest(&g_viscaQueue, false, retryTick - 1, &next));
+    assert(viscaEngineWaitMsec(&engine, 0.0) == VISCA_STOP_RETRY_DELAY / 1000);
+    assert(dequeueVISCARequest(&g_viscaQueue, true, retryTick, &next) && next.packet[0] == 2 && next.retries == 1);
+
+    // A completion means the camera has room, so the stop goes at once.
+    const uint8_t ack1[] = { 0x90, 0x41, 0xFF }, completion1[] = { 0x90, 0x51, 0xFF };
+    request.isStop = false;
+    trackVISCARequest(&engine, &request, 4);
+    handleVISCAResponse(&engine, ack1, sizeof(ack1), false);
+    trackVISCARequest(&engine, &next, 5);
+    handleVISCAResponse(&engine, bufferFull, sizeof(bufferFull), false);
+    assert(!dequeueVISCARequest(&g_viscaQueue, true, 0, &next));
+    handleVISCAResponse(&engine, completion1, sizeof(completion1), false);
+    assert(engine.inFlight[4].state == kVISCARequestFree && engine.stopRetryTick == 0);
+    assert(dequeueVISCARequest(&g_viscaQueue, true, 0, &next) && next.packet[0] == 2 && next.retries == 2);
+    trackVISCARequest(&engine, &next, 6);
+    handleVISCAResponse(&engine, syntaxError, sizeof(syntaxError), false);
+    assert(g_viscaQueue.count == 1);
+
+    request.isStop = false;
+    request.packet[0] = 3;
+    enqueueVISCARequest(&g_viscaQueue, &request, &stats, &dropped);
+    request.isStop = true;
+    trackVISCARequest(&engine, &request, 7);
+    handleVISCAResponse(&engine, bufferFull, sizeof(bufferFull), false);
+    assert(g_viscaQueue.count == 2 && !viscaQueueEntry(&g_viscaQueue, 0)->isStop);
+    g_viscaQueue = savedQueue;
+    g_viscaStats = savedStats;
+}
+
+void testVISCACodec(void) {
+    viscaPanTiltDrive_t panTilt = encodeVISCAPanTiltDrive(-5, 0);
+    const uint8_t expectedPanTilt[] = { 0x81, 0x01, 0x06, 0x01, 0x05, 0x01, 0x02, 0x03, 0xFF };
+    assert(!memcmp(panTilt.bytes, expectedPanTilt, sizeof(expectedPanTilt)));
+
+    viscaExtendedPanTiltDrive_t extended = encodeVISCAExtendedPanTiltDrive(-300, 2);
+    assert(extended.bytes[6] == 0x01 && extended.bytes[7] == 0x2c && extended.bytes[9] == 0x02 &&
+           extended.bytes[10] == 0x02 && extended.bytes[11] == 0x01);
+    assert(encodeVISCAZoomDrive(0).bytes[4] == 0x00 && encodeVISCAZoomDrive(-3).bytes[4] == 0x22);
+    assert(encodeVISCAPreset(true, 7).bytes[4] == 0x01 && encodeVISCAPreset(true, 7).bytes[5] == 7);
+
+    // A completion from socket 2, parsed in place.
+    uint8_t packet[VISCA_HEADER_SIZE + 3];
+    encodeVISCAHeader(packet, VISCA_PAYLOAD_TYPE_REPLY, 3, 0x01020304);
+    packet[8] = 0x90;
+    packet[9] = 0x52;
+    packet[10] = 0xFF;
+    viscaMessage_t message;
+    assert(parseVISCAMessage(packet, sizeof(packet), true, &message));
+    assert(message.payloadType == VISCA_PAYLOAD_TYPE_REPLY && message.sequenceNumber == 0x01020304 &&
+           message.payload == packet + VISCA_HEADER_SIZE && message.length == 3 &&
+           message.responseType == 5 && message.cameraSocket == 2);
+    assert(parseVISCAMessage(packet + VISCA_HEADER_SIZE, 3, false, &message) && !message.hasSequenceNumber);
+    assert(!parseVISCAMessage(packet, sizeof(packet) - 1, true, &message));
+
+    assert(!strcmp(fmtbuf(packet + VISCA_HEADER_SIZE, 3), "90 52 FF") && !strcmp(fmtbuf(NULL, 0), ""));
+}
+
+void testVISCAResync(void) {
+    viscaEngine_t engine;
+    initVISCAEngine(&engine, 1000);
+    viscaRequest_t command;
+    bzero(&command, sizeof(command));
+    command.timeoutUsec = 100000;  // 20 ticks.
+
+    // Several missing acks in a row call for a resync.
+    for (uint32_t sequenceNumber = 1; sequenceNumber <= VISCA_MISSED_ACKS_BEFORE_RESYNC; sequenceNumber++) {
+        trackVISCARequest(&engine, &command, sequenceNumber);
+    }
+    expireVISCARequests(&engine, 1021);
+    assert(engine.resyncNeeded && engine.awaitingAck == 0 && engine.missedAcks == 0);
+
+    // So does a sequence number error from the camera.
+    engine.resyncNeeded = false;
+    const uint8_t sequenceError[] = { 0x02, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x05, 0x0F, 0x01 };
+    handleVISCAResponse(&engine, sequenceError, sizeof(sequenceError), true);
+    assert(engine.resyncNeeded);
+
+    // The RESET's ack ends the hold and starts again from sequence number zero.
+    uint32_t savedSequenceNumber = g_visca_sequence_number;
+    g_visca_sequence_number = 42;
+    engine.resyncNeeded = false;
+    engine.awaitingReset = true;
+    uint8_t resetAck[VISCA_RESET_PACKET_SIZE];
+    encodeVISCAReset(resetAck, 42);
+    resetAck[1] = VISCA_PAYLOAD_TYPE_CONTROL_REPLY & 0xff;
+    handleVISCAResponse(&engine, resetAck, sizeof(resetAck), true);
+    assert(!engine.awaitingReset && g_visca_sequence_number == 0);
+    g_visca_sequence_number = savedSequenceNumber;
+
+    // A camera that answers commands but never acks RESET is remembered, so later resyncs
+    // only abandon what is in flight, and don't hold new commands.  (One that isn't
+    // answering at all may just be unreachable for now.)
+    viscaCommandStats_t savedStats = g_viscaStats;
+    initVISCAEngine(&engine, 1000);
+    engine.awaitingReset = true;
+    engine.resetAttempts = VISCA_RESET_ATTEMPTS;
+    sendVISCAReset(&engine, -1);
+    assert(!engine.awaitingReset && !engine.resetUnsupported);
+    engine.cameraAnswered = true;
+    engine.awaitingReset = true;
+    engine.resetAttempts = VISCA_RESET_ATTEMPTS;
+    sendVISCAReset(&engine, -1);
+    assert(!engine.awaitingReset && engine.resetUnsupported);
+    trackVISCARequest(&engine, &command, 1);
+    sendVISCAReset(&engine, -1);
+    assert(!engine.awaitingReset && engine.inFlight[1].state == kVISCARequestFree);
+
+    // Until it acks one after all.
+    handleVISCAResponse(&engine, resetAck, sizeof(resetAck), true);
+    assert(!engine.resetUnsupported && engine.cameraAckedReset);
+    g_visca_sequence_number = savedSequenceNumber;
+    g_viscaStats = savedStats;
+}
+
+void testVISCAStreamParser(void) {
+    viscaStreamParser_t parser;
+    resetVISCAStreamParser(&parser);
+    const uint8_t *message;
+    ssize_t length, space;
+
+    // An ack and a completion in one read, and then the start of a third message.
+    const uint8_t firstRead[] = { 0x90, 0x41, 0xFF, 0x90, 0x51, 0xFF, 0x90, 0x50 };
+    uint8_t *readPointer = viscaStreamReadSpace(&parser, &space);
+    assert(space == VISCA_STREAM_BUFFER_SIZE);
+    memcpy(readPointer, firstRead, sizeof(firstRead));
+    viscaStreamDidRead(&parser, sizeof(firstRead));
+    assert(nextVISCAStreamMessage(&parser, &message, &length) && length == 3 && message[1] == 0x41);
+    assert(nextVISCAStreamMessage(&parser, &message, &length) && length == 3 && message[1] == 0x51);
+    assert(!nextVISCAStreamMessage(&parser, &message, &length));
+
+    // The rest of the third message arrives in the next read.
+    const uint8_t secondRead[] = { 0x05, 0xFF };
+    readPointer = viscaStreamReadSpace(&parser, &space);
+    assert(readPointer == parser.buffer + 2 && space == VISCA_STREAM_BUFFER_SIZE - 2);
+    memcpy(readPointer, secondRead, sizeof(secondRead));
+    viscaStreamDidRead(&parser, sizeof(secondRead));
+    assert(nextVISCAStreamMessage(&parser, &message, &length) && length == 4 &&
+           message == parser.buffer && message[2] == 0x05);
+    assert(!nextVISCAStreamMessage(&parser, &message, &length));
+
+    // A buffer full of garbage is thrown away.
+    readPointer = viscaStreamReadSpace(&parser, &space);
+    memset(readPointer, 0x42, space);
+    viscaStreamDidRead(&parser, space);
+    assert(!nextVISCAStreamMessage(&parser, &message, &length));
+    viscaStreamReadSpace(&parser, &space);
+    assert(space == VISCA_STREAM_BUFFER_SIZE);
+}
+
+// Whatever a full TCP socket has no room for must be kept, and sent in order, ahead of
+// anything newer, once the camera catches up.
+void testVISCAStreamWriter(void) {
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    viscaEngine_t *engine = (viscaEngine_t *)calloc(1, sizeof(viscaEngine_t));
+
+    // Fill the socket, so that the next packet only partly fits, or not at all.
+    uint8_t filler[256];
+    memset(filler, 0, sizeof(filler));
+    ssize_t filled = 0, written;
+    while ((written = send(fds[0], filler, sizeof(filler), VISCA_SEND_FLAGS)) > 0) {
+        filled += written;
+    }
+    const uint8_t first[] = { 0x81, 0x01, 0x06, 0x01, 0x05, 0x05, 0x03, 0x03, 0xFF };
+    const uint8_t second[] = { 0x81, 0x01, 0x04, 0x07, 0x00, 0xFF };
+    assert(writeVISCAStream(engine, fds[0], first, sizeof(first)) && engine->unsentLength > 0);
+    assert(writeVISCAStream(engine, fds[0], second, sizeof(second)));
+    assert(engine->unsentLength <= (ssize_t)(sizeof(first) + sizeof(second)));
+
+    // Once the camera has read everything, the rest goes out in order.
+    uint8_t received[512];
+    ssize_t drained = 0;
+    while ((written = read(fds[1], received, sizeof(received))) > 0) {
+        drained += written;
+    }
+    assert(drained >= filled);
+    flushVISCAStream(engine, fds[0]);
+    assert(engine->unsentLength == 0);
+    ssize_t tail = read(fds[1], received, sizeof(received));
+    ssize_t expectedTail = (ssize_t)(sizeof(first) + sizeof(second)) - (drained - filled);
+    assert(tail == expectedTail);
+    uint8_t expected[sizeof(first) + sizeof(second)];
+    memcpy(expected, first, sizeof(first));
+    memcpy(expected + sizeof(first), second, sizeof(second));
+    assert(!memcmp(received, expected + sizeof(expected) - expectedTail, expectedTail));
+
+    free(engine);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Steps down only after several bad intervals, steps up only after many good ones,
+// waits longer after a failed step up, and never flaps on alternating intervals.
+void testAdaptiveBandwidth(void) {
+    adaptiveBandwidth_t state;
+    initAdaptiveBandwidth(&state, false);
+    assert(runAdaptiveBandwidthIntervals(&state, ADAPTIVE_BANDWIDTH_STEP_DOWN_INTERVALS - 1, 30, 0, 50000, false) == 0);
+    assert(runAdaptiveBandwidthIntervals(&state, 1, 30, 0, 50000, false) == 1 && state.lowBandwidth);
+
+    // Alternating good and bad intervals never add up to a switch.
+    for (int i = 0; i < 50; i++) {
+        assert(runAdaptiveBandwidthIntervals(&state, 1, 0, 0, 50000, false) == 0);
+        assert(runAdaptiveBandwidthIntervals(&state, 1, 0, 5, 50000, false) == 0);
+    }
+    assert(state.lowBandwidth);
+
+    // A long run of good intervals steps back up.  Trouble soon afterwards steps down
+    // again and doubles the wait.
+    assert(runAdaptiveBandwidthIntervals(&state, ADAPTIVE_BANDWIDTH_STEP_UP_INTERVALS, 0, 0, 50000, false) == 1);
+    assert(!state.lowBandwidth && state.probing);
+    assert(runAdaptiveBandwidthIntervals(&state, ADAPTIVE_BANDWIDTH_STEP_DOWN_INTERVALS + 2, 0, 5, 50000, false) == 1);
+    assert(state.lowBandwidth && state.backoff == 2);
+    assert(runAdaptiveBandwidthIntervals(&state, ADAPTIVE_BANDWIDTH_STEP_UP_INTERVALS, 0, 0, 50000, false) == 0);
+    assert(runAdaptiveBandwidthIntervals(&state, ADAPTIVE_BANDWIDTH_STEP_UP_INTERVALS, 0, 0, 50000, false) == 1);
+
+    // A live camera stays at high bandwidth even when the controller is behind, but not
+    // when the CPU is overheating, and it steps up again as soon as it has cooled off.
+    initAdaptiveBandwidth(&state, false);
+    assert(runAdaptiveBandwidthIntervals(&state, 20, 30, 5, 50000, true) == 0 && !state.lowBandwidth);
+    assert(runAdaptiveBandwidthIntervals(&state, 20, 0, 0, 85000, true) == 1 && state.lowBandwidth);
+    assert(runAdaptiveBandwidthIntervals(&state, 10, 0, 0, 75000, true) == 1 && !state.lowBandwidth);
+
+    // No frames at all (a camera that is off) is neither good nor bad.
+    initAdaptiveBandwidth(&state, true);
+    bandwidthSample_t idle = { ADAPTIVE_BANDWIDTH_INTERVAL, 0, 0, 0, -1, false };
+    for (int i = 0; i < 100; i++) {
+        assert(!updateAdaptiveBandwidth(&state, &idle));
+    }
+}
+
+// A fake NDI receiver for testStaleFrameDraining.  Frames are numbered in p_data, in the
+// order they arrive, and a status change can be queued ahead of the first frame.
+static int g_testQueuedFrames, g_testNextFrame, g_testFramesFreed, g_testLastFrameFreed;
+static bool g_testStatusChangeQueued;
+
+static void testGetQueue(NDIlib_recv_instance_t, NDIlib_recv_queue_t *queue) {
+    queue->video_frames = g_testQueuedFrames;
+}
+
+static NDIlib_frame_type_e testCapture(NDIlib_recv_instance_t, NDIlib_video_frame_v2_t *video,
+                                       NDIlib_audio_frame_v3_t *, NDIlib_metadata_frame_t *, uint32_t) {
+    if (g_testStatusChangeQueued) {
+        g_testStatusChangeQueued = false;
+        return NDIlib_frame_type_status_change;
+    }
+    if (g_testQueuedFrames == 0) return NDIlib_frame_type_none;
+    g_testQueuedFrames--;
+    bzero(video, sizeof(*video));
+    video->p_data = (uint8_t *)(uintptr_t)++g_testNextFrame;
+    return NDIlib_frame_type_video;
+}
+
+static void testFreeVideo(NDIlib_recv_instance_t, const NDIlib_video_frame_v2_t *video) {
+    g_testFramesFreed++;
+    g_testLastFrameFreed = (int)(uintptr_t)video->p_data;
+}
+
+static bool testPTZIsSupported(NDIlib_recv_instance_t) {
+    return true;
+}
+
+void testStaleFrameDraining(void) {
+    const videoQueueFuncs_t funcs = { testGetQueue, testCapture, testFreeVideo, testPTZIsSupported };
+    bool savedLowLatency = low_latency_mode, savedPTZEnabled = g_ptzEnabled;
+    latencyStats_t stats;
+    bzero(&stats, sizeof(stats));
+    NDIlib_video_frame_v2_t video;
+    bzero(&video, sizeof(video));
+
+    // Without low-latency mode, the backlog is only measured.
+    low_latency_mode = false;
+    g_testQueuedFrames = 3;
+    g_testNextFrame = 1;
+    video.p_data = (uint8_t *)(uintptr_t)1;
+    assert(drainStaleVideoFrames(&funcs, NULL, &video, &stats, true) == 0);
+    assert(stats.queueDepth == 3 && stats.maxQueueDepth == 3 && g_testQueuedFrames == 3);
+    assert(video.p_data == (uint8_t *)(uintptr_t)1 && g_testFramesFreed == 0);
+
+    // In low-latency mode, every older frame is freed and the newest one is kept.  A
+    // status change on a tile's receiver leaves the primary camera's PTZ state alone.
+    low_latency_mode = true;
+    g_ptzEnabled = false;
+    g_testStatusChangeQueued = true;
+    assert(drainStaleVideoFrames(&funcs, NULL, &video, &stats, false) == 3);
+    assert(video.p_data == (uint8_t *)(uintptr_t)4 && g_testFramesFreed == 3 && g_testLastFrameFreed == 3);
+    assert(stats.staleFramesSkipped == 3 && stats.framesCaptured == 3 && stats.queueDepth == 0);
+    assert(stats.maxQueueDepth == 3 && !g_ptzEnabled);
+
+    // The primary receiver's status changes do update it.
+    g_testStatusChangeQueued = true;
+    g_testQueuedFrames = 1;
+    assert(drainStaleVideoFrames(&funcs, NULL, &video, &stats, true) == 1);
+    assert(video.p_data == (uint8_t *)(uintptr_t)5 && g_ptzEnabled);
+
+    low_latency_mode = savedLowLatency;
+    g_ptzEnabled = savedPTZEnabled;
+}
+
+#ifdef __linux__
+void testFramePacing(void) {
+    // Standard 1080p60 timings (148.5 MHz pixel clock), and a driver that reports none.
+    assert(fabs(vsyncPeriodForTimings(6734, 1920, 148, 88, 44, 1080, 36, 4, 5) - 1.0 / 60.0) < 0.00001);
+    assert(vsyncPeriodForTimings(0, 1920, 0, 0, 0, 1080, 0, 0, 0) == PACING_DEFAULT_VSYNC_PERIOD);
+
+    // The estimate converges on the measured rate, and a missed blank doesn't throw it off.
+    double period = 1.0 / 60.0;
+    for (int i = 0; i < 500; i++) {
+        period = updateVsyncPeriodEstimate(period, ((i % 50) == 7 ? 2 : 1) * 1001.0 / 60000.0);
+    }
+    assert(fabs(period - 1001.0 / 60000.0) < 0.000001);
+
+    double times[3] = { 1.0, 2.0, 3.0 };
+    assert(choosePacedFrame(times, 3, 0.5) == -1);
+    assert(choosePacedFrame(times, 3, 2.5) == 1);
+
+    // A 59.94 Hz camera on a 60 Hz panel, with up to 6 ms of network jitter and a sender
+    // clock unrelated to ours.  Every frame is shown exactly once, except that once in
+    // 1001 refreshes there is nothing new to show, and no frame waits more than one
+    // refresh longer than it would if drawn as soon as it arrived.
+    const double vsyncPeriod = 1.0 / 60.0;
+    const double framePeriod = 1001.0 / 60000.0;
+    const int frameCount = 3000;
+    pacingClock_t clock;
+    pacingStats_t stats;
+    resetPacingClock(&clock);
+    memset(&stats, 0, sizeof(stats));
+
+    double queueTimes[PACED_FRAME_QUEUE_SIZE];
+    double queueSources[PACED_FRAME_QUEUE_SIZE];
+    double queueArrivals[PACED_FRAME_QUEUE_SIZE];
+    int queued = 0;
+    int nextFrame = 0;
+    unsigned int seed = 1;
+    double nextArrival = 10.0;
+    int shown = 0;
+    for (int vsync = 0; nextFrame < frameCount || queued > 0; vsync++) {
+        double vsyncTime = 10.0 + vsync * vsyncPeriod;
+        while (nextFrame < frameCount && nextArrival <= vsyncTime) {
+            int64_t timestamp = 17000000000000000LL + llround(nextFrame * framePeriod * 10000000.0);
+            double sourceTime = frameSourceTime(timestamp, 0, nextArrival);
+            double offset = updatePacingClock(&clock, &clock, sourceTime, nextArrival);
+            assert(queued < PACED_FRAME_QUEUE_SIZE);
+            queueSources[queued] = sourceTime;
+            queueArrivals[queued] = nextArrival;
+            queueTimes[queued++] = pacedPresentationTime(sourceTime, offset, vsyncPeriod);
+            nextFrame++;
+            nextArrival = 10.0 + nextFrame * framePeriod + (rand_r(&seed) % 6000) / 1000000.0;
+        }
+        double displayTime = vsyncTime + vsyncPeriod;
+        int chosen = choosePacedFrame(queueTimes, queued, displayTime);
+        if (chosen < 0) continue;
+        assert(chosen == 0);
+
+        // Drawn as it arrived, the frame would be up at the refresh after the next blank.
+        double immediateDisplayTime = 10.0 + (ceil((queueArrivals[0] - 10.0) / vsyncPeriod) + 1) * vsyncPeriod;
+        assert(displayTime - immediateDisplayTime <= vsyncPeriod + 0.000001);
+        recordPacedFrame(&stats, queueSources[0], displayTime, vsyncPeriod);
+        shown++;
+        queued--;
+        memmove(queueTimes, queueTimes + 1, queued * sizeof(double));
+        memmove(queueSources, queueSources + 1, queued * sizeof(double));
+        memmove(queueArrivals, queueArrivals + 1, queued * sizeof(double));
+    }
+    assert(shown == frameCount);
+    assert(stats.vsyncsRepeated >= 2 && stats.vsyncsRepeated <= 4);
+    assert(stats.maxAbsoluteError < vsyncPeriod * 1.01);
+    assert(stats.sumAbsoluteError / stats.intervals < 0.0005);
+
+    // A new stream (or a jump in the timestamps) starts a new schedule.
+    double offset = updatePacingClock(&clock, &stats, 5.0, 100.0);
+    assert(offset == 95.0);
+    assert(updatePacingClock(&clock, &stats, 5.0 + framePeriod, 100.0 + framePeriod + 0.002) == 95.0);
+    assert(updatePacingClock(&clock, &stats, 50.0, 101.0) == 51.0);
+}
+
+void testMultiviewLayout(void) {
+    int x, y, width, height;
+
+    // Four cameras in a 2x2 grid.
+    multiviewTileRect(3, 4, 1920, 1080, false, 0, &x, &y, &width, &height);
+    assert(x == 960 && y == 540 && width == 960 && height == 540);
+
+    // Two side by side; turned 90 degrees, the left one is at the top of the screen.
+    multiviewTileRect(0, 2, 1920, 1080, false, 0, &x, &y, &width, &height);
+    assert(x == 0 && y == 0 && width == 960 && height == 1080);
+    multiviewTileRect(0, 2, 1080, 1920, false, 90, &x, &y, &width, &height);
+    assert(x == 0 && y == 0 && width == 1080 && height == 960);
+    multiviewTileRect(0, 2, 1080, 1920, false, 270, &x, &y, &width, &height);
+    assert(x == 0 && y == 960 && width == 1080 && height == 960);
+    multiviewTileRect(0, 2, 1920, 1080, true, 0, &x, &y, &width, &height);
+    assert(x == 960 && y == 0);
+
+    // However many tiles and however the screen is turned, the tiles never overlap and
+    // stay on the screen, even when the sizes don't divide evenly.
+    const int screenXRes = 101, screenYRes = 67;
+    unsigned char *covered = (unsigned char *)malloc(screenXRes * screenYRes);
+    for (int count = 1; count <= MAX_MULTIVIEW_SOURCES; count++) {
+        for (int quarterTurns = 0; quarterTurns < 4; quarterTurns++) {
+            bool flipped = (quarterTurns == 2);
+            int rotation = (quarterTurns % 2) ? quarterTurns * 90 : 0;
+            int coveredPixels = 0;
+            bzero(covered, screenXRes * screenYRes);
+            for (int i = 0; i < count; i++) {
+                multiviewTileRect(i, count, screenXRes, screenYRes, flipped, rotation, &x, &y, &width, &height);
+                assert(x >= 0 && y >= 0 && x + width <= screenXRes && y + height <= screenYRes);
+                for (int row = y; row < y + height; row++) {
+                    for (int column = x; column < x + width; column++) {
+                        assert(!covered[row * screenXRes + column]);
+                        covered[row * screenXRes + column] = 1;
+                        coveredPixels++;
+                    }
+                }
+            }
+            if (count == 1 || count == 4 || count == 9) {
+                assert(coveredPixels == screenXRes * screenYRes);
+            }
+        }
+    }
+    free(covered);
+
+    // The picture-in-picture inset stays in its corner of the picture as the screen turns.
+    pictureInPictureRect(kCornerBottomRight, 1920, 1080, false, 0, &x, &y, &width, &height);
+    assert(x == 1920 - 480 - 60 && y == 1080 - 270 - 60 && width == 480 && height == 270);
+    pictureInPictureRect(kCornerTopLeft, 1920, 1080, true, 0, &x, &y, &width, &height);
+    assert(x == 1920 - 480 - 60 && y == 1080 - 270 - 60);
+    pictureInPictureRect(kCornerTopRight, 1080, 1920, false, 90, &x, &y, &width, &height);
+    assert(x == 1080 - 270 - 60 && y == 1920 - 480 - 60 && width == 270 && height == 480);
+}
+
+// A mirror turned its own way must draw exactly what the primary screen would draw if
+// it were turned that way, whatever -F and -r say.
+void testMirrorOutputs(void) {
+    int quarterTurns;
+    char *devicePath = parseMirrorSpec("/dev/fb1", &quarterTurns);
+    assert(!strcmp(devicePath, "/dev/fb1") && quarterTurns == 0);
+    free(devicePath);
+    devicePath = parseMirrorSpec("/dev/fb1:270", &quarterTurns);
+    assert(!strcmp(devicePath, "/dev/fb1") && quarterTurns == 3);
+    free(devicePath);
+    assert(parseMirrorSpec("/dev/fb1:45", &quarterTurns) == NULL);
+    assert(parseMirrorSpec("/dev/fb1:", &quarterTurns) == NULL);
+    assert(parseMirrorSpec(":90", &quarterTurns) == NULL);
+
+    bool savedFlipped = monitor_flipped;
+    int savedRotation = monitor_rotation;
+    const int frameXRes = 24, frameYRes = 14, screenXRes = 10, screenYRes = 18, bytesPerPixel = 2;
+    const ssize_t stride = screenXRes * bytesPerPixel;
+    uint32_t *source = (uint32_t *)malloc(frameXRes * frameYRes * sizeof(uint32_t));
+    for (int p = 0; p < frameXRes * frameYRes; p++) {
+        source[p] = (uint32_t)(p * 0x9E3779B1u);
+    }
+    NDIlib_video_frame_v2_t frame;
+    bzero(&frame, sizeof(frame));
+    frame.xres = frameXRes;
+    frame.yres = frameYRes;
+    frame.p_data = (uint8_t *)source;
+
+    unsigned char *expected = (unsigned char *)calloc(screenYRes, stride);
+    unsigned char *actual = (unsigned char *)calloc(screenYRes, stride);
+    scalerPlan_t primaryPlan, mirrorPlan;
+    bzero(&primaryPlan, sizeof(primaryPlan));
+    bzero(&mirrorPlan, sizeof(mirrorPlan));
+    for (int turns = 0; turns < 4; turns++) {
+        monitor_flipped = (turns == 2);
+        monitor_rotation = (turns % 2) ? turns * 90 : 0;
+        buildScalerPlan(&primaryPlan, frameXRes, frameYRes, 0, NDIlib_FourCC_type_BGRX,
+                        screenXRes, screenYRes, bytesPerPixel, stride);
+        renderWholeFrame(&frame, expected, &primaryPlan, false);
+
+        monitor_flipped = !monitor_flipped;
+        monitor_rotation = 90 - monitor_rotation;
+        buildOrientedScalerPlan(&mirrorPlan, frameXRes, frameYRes, 0, NDIlib_FourCC_type_BGRX,
+                                screenXRes, screenYRes, bytesPerPixel, stride, turns, 0);
+        assert(orientedScalerPlanMatches(&mirrorPlan, frameXRes, frameYRes, 0, NDIlib_FourCC_type_BGRX,
+                                         screenXRes, screenYRes, bytesPerPixel, stride, turns, 0));
+        assert(!orientedScalerPlanMatches(&mirrorPlan, frameXRes, frameYRes, 0, NDIlib_FourCC_type_BGRX,
+                                          screenXRes, screenYRes, bytesPerPixel, stride, (turns + 1) % 4, 0));
+        renderWholeFrame(&frame, actual, &mirrorPlan, false);
+        assert(!memcmp(expected, actual, screenYRes * stride));
+    }
+    freeScalerPlan(&primaryPlan);
+    freeScalerPlan(&mirrorPlan);
+    free(expected);
+    free(actual);
+    free(source);
+    monitor_flipped = savedFlipped;
+    monitor_rotation = savedRotation;
+}
+
+// A magnified plan must read only its window of the frame, at exactly the magnification,
+// wherever the window has been moved.
+void testMagnification(void) {
+    assert(nextMagnification(0) == 1 && nextMagnification(1) == 2 && nextMagnification(2) == 4 &&
+           nextMagnification(4) == 0);
+
+    const int frameXRes = 40, frameYRes = 30, screenXRes = 24, screenYRes = 18, bytesPerPixel = 4;
+    const ssize_t stride = screenXRes * bytesPerPixel;
+    uint32_t *source = (uint32_t *)malloc(frameXRes * frameYRes * sizeof(uint32_t));
+    for (int p = 0; p < frameXRes * frameYRes; p++) {
+        source[p] = (uint32_t)(p * 0x9E3779B1u);
+    }
+    NDIlib_video_frame_v2_t frame;
+    bzero(&frame, sizeof(frame));
+    frame.xres = frameXRes;
+    frame.yres = frameYRes;
+    frame.p_data = (uint8_t *)source;
+
+    float savedCenterX = g_magnifiedCenterX, savedCenterY = g_magnifiedCenterY;
+    uint32_t *actual = (uint32_t *)malloc(screenYRes * stride);
+    scalerPlan_t plan;
+    bzero(&plan, sizeof(plan));
+    const float centers[][2] = { { 0.5f, 0.5f }, { 0.0f, 0.0f }, { 1.0f, 1.0f }, { 0.25f, 0.75f } };
+    for (int magnification = 1; magnification <= 4; magnification *= 2) {
+        for (size_t c = 0; c < sizeof(centers) / sizeof(centers[0]); c++) {
+            g_magnifiedCenterX = centers[c][0];
+            g_magnifiedCenterY = centers[c][1];
+            buildOrientedScalerPlan(&plan, frameXRes, frameYRes, 0, NDIlib_FourCC_type_BGRX,
+                                    screenXRes, screenYRes, bytesPerPixel, stride, 0, magnification);
+            int windowXRes = MIN(frameXRes, screenXRes / magnification);
+            int windowYRes = MIN(frameYRes, screenYRes / magnification);
+            assert(plan.sourceXRes == windowXRes && plan.sourceYRes == windowYRes);
+            assert(plan.scaleMode == (magnification == 1 ? kScaleIdentity : kScaleInteger));
+
+            int originX = (int)((plan.sourceOffset % plan.sourceStride) / 4);
+            int originY = (int)(plan.sourceOffset / plan.sourceStride);
+            assert(originX >= 0 && originX + windowXRes <= frameXRes);
+            assert(originY >= 0 && originY + windowYRes <= frameYRes);
+            if (c == 1) assert(originX == 0 && originY == 0);
+            if (c == 2) assert(originX == frameXRes - windowXRes && originY == frameYRes - windowYRes);
+
+            memset(actual, 0xAA, screenYRes * stride);
+            renderWholeFrame(&frame, (unsigned char *)actual, &plan, false);
+            int screenX = (int)((plan.screenOffset % stride) / bytesPerPixel);
+            int screenY = (int)(plan.screenOffset / stride);
+            for (int y = 0; y < plan.screenYRes; y++) {
+                for (int x = 0; x < plan.screenXRes; x++) {
+                    uint32_t expected = source[(originY + y / magnification) * frameXRes +
+                                               originX + x / magnification];
+                    assert(actual[(screenY + y) * screenXRes + screenX + x] == expected);
+                }
+            }
+        }
+    }
+    freeScalerPlan(&plan);
+    free(actual);
+    free(source);
+    g_magnifiedCenterX = savedCenterX;
+    g_magnifiedCenterY = savedCenterY;
+}
+#endif  // __linux__
+
+// The span fills must cover exactly the light rectangles from LightConfiguration.h, at
+// either depth and at any starting alignment.
+void testOnScreenLights(void) {
+    const int xres = 203, yres = 119;
+    for (int bytesPerPixel = 2; bytesPerPixel <= 4; bytesPerPixel += 2) {
+        ssize_t bytesPerRow = (xres + 3) * bytesPerPixel;
+        unsigned char *buffer = (unsigned char *)malloc(bytesPerRow * yres);
+        memset(buffer, 0xA5, bytesPerRow * yres);
+
+        onScreenOverlay_t overlay;
+        prepareOnScreenOverlay(&overlay, xres, yres, bytesPerPixel, bytesPerRow, 0);
+        assert(overlay.lights[0].minX == (int)LIGHT_STATUS_X_MIN(xres));
+        assert(overlay.lights[6].maxY == (int)LIGHT_5_Y_MAX(yres));
+        for (int light = 0; light < ON_SCREEN_LIGHT_COUNT; light++) {
+            fillOnScreenLight(&overlay, buffer, light, (enum onScreenColor)(light + 1));
+        }
+
+        for (int y = 0; y < yres; y++) {
+            for (int x = 0; x < xres; x++) {
+                int color = -1;
+                for (int light = 0; light < ON_SCREEN_LIGHT_COUNT; light++) {
+                    const onScreenLightRect_t *rect = &overlay.lights[light];
+                    if (x >= rect->minX && x <= rect->maxX && y >= rect->minY && y <= rect->maxY) {
+                        color = light + 1;
+                    }
+                }
+                unsigned char *pixel = buffer + (y * bytesPerRow) + (x * bytesPerPixel);
+                uint32_t actual = (bytesPerPixel == 4) ? *(uint32_t *)pixel : *(uint16_t *)pixel;
+                uint32_t expected = (color < 0) ? ((bytesPerPixel == 4) ? 0xA5A5A5A5 : 0xA5A5) :
+                    onScreenColorPixelValue((enum onScreenColor)color, 4);
+                if (color >= 0 && bytesPerPixel == 2) {
+                    expected = convert_sample_to_16bpp(expected);
+                }
+                if (actual != expected) {
+                    fprintf(stderr, "On-screen light mismatch at %d, %d (%d bytes per pixel)\n", x, y, bytesPerPixel);
+                    assert(false);
+                }
+            }
+        }
+        free(buffer);
+    }
+
+    // On a screen turned 90 degrees clockwise, the picture's top left corner is at the
+    // screen's top right, and 270 degrees puts it at the bottom left.
+    onScreenOverlay_t upright, rotated;
+    prepareOnScreenOverlay(&upright, yres, xres, 4, yres * 4, 0);
+    prepareOnScreenOverlay(&rotated, xres, yres, 4, xres * 4, 90);
+    assert(rotated.lights[1].minY == upright.lights[1].minX && rotated.lights[1].maxY == upright.lights[1].maxX);
+    assert(rotated.lights[1].maxX == xres - 1 - upright.lights[1].minY);
+    prepareOnScreenOverlay(&rotated, xres, yres, 4, xres * 4, 270);
+    assert(rotated.lights[1].minX == upright.lights[1].minY && rotated.lights[1].maxX == upright.lights[1].maxY);
+    assert(rotated.lights[1].maxY == yres - 1 - upright.lights[1].minX);
+}
+
+#ifdef __linux__
+// A cached geometry reuses its plan, and a new one evicts the least recently used.
+void testScalerPlanCache(void) {
+    scalerPlan_t cache[2];
+    bzero(cache, sizeof(cache));
+    uint64_t clock = 0;
+    bool changed;
+    NDIlib_video_frame_v2_t frames[3];
+    const int sizes[3][2] = { { 1920, 1080 }, { 1280, 720 }, { 640, 360 } };
+    for (int i = 0; i < 3; i++) {
+        bzero(&frames[i], sizeof(frames[i]));
+        frames[i].xres = sizes[i][0];
+        frames[i].yres = sizes[i][1];
+        frames[i].FourCC = NDIlib_FourCC_type_BGRX;
+        frames[i].line_stride_in_bytes = sizes[i][0] * 4;
+    }
+
+    scalerPlan_t *first = scalerPlanForFrame(cache, 2, NULL, &clock, &frames[0], 800, 480, 4, 800 * 4, 0, 0, &changed);
+    assert(changed);
+    assert(scalerPlanForFrame(cache, 2, first, &clock, &frames[0], 800, 480, 4, 800 * 4, 0, 0, &changed) == first &&
+           !changed);
+    scalerPlan_t *second = scalerPlanForFrame(cache, 2, first, &clock, &frames[1], 800, 480, 4, 800 * 4, 0, 0,
+                                              &changed);
+    assert(changed && second != first);
+
+    // Going back to the first geometry is a hit, and makes the second plan the least recently used.
+    assert(scalerPlanForFrame(cache, 2, second, &clock, &frames[0], 800, 480, 4, 800 * 4, 0, 0, &changed) == first &&
+           changed);
+    assert(orientedScalerPlanMatches(second, 1280, 720, 1280 * 4, NDIlib_FourCC_type_BGRX, 800, 480, 4, 800 * 4, 0, 0));
+
+    // So a third geometry rebuilds the second plan and leaves the first one alone.
+    assert(scalerPlanForFrame(cache, 2, first, &clock, &frames[2], 800, 480, 4, 800 * 4, 0, 0, &changed) == second &&
+           changed);
+    assert(orientedScalerPlanMatches(second, 640, 360, 640 * 4, NDIlib_FourCC_type_BGRX, 800, 480, 4, 800 * 4, 0, 0));
+    assert(orientedScalerPlanMatches(first, 1920, 1080, 1920 * 4, NDIlib_FourCC_type_BGRX, 800, 480, 4, 800 * 4, 0, 0));
+
+    freeScalerPlan(&cache[0]);
+    freeScalerPlan(&cache[1]);
+}
+
+// The spans must tile the screen exactly, with no gaps or overlaps, for upscaling and
+// downscaling alike.
+void testScalerPlan(void) {
+    const int geometries[][4] = {
+        { 1920, 1080, 800, 480 }, { 1280, 720, 1920, 1080 }, { 640, 360, 1920, 1080 },
+        { 1920, 1080, 1920, 1080 }, { 3840, 2160, 1024, 600 }
+    };
+    scalerPlan_t plan;
+    bzero(&plan, sizeof(plan));
+    for (size_t i = 0; i < sizeof(geometries) / sizeof(geometries[0]); i++) {
+        const int *g = geometries[i];
+        buildScalerPlan(&plan, g[0], g[1], 0, NDIlib_FourCC_type_BGRX, g[2], g[3], 2, g[2] * 2);
+        assert(scalerPlanMatches(&plan, g[0], g[1], g[0] * 4, NDIlib_FourCC_type_BGRX, g[2], g[3], 2, g[2] * 2));
+        assert(!scalerPlanMatches(&plan, g[0], g[1], 0, NDIlib_FourCC_type_BGRX, g[2], g[3], 4, g[2] * 4));
+        assert(!scalerPlanMatches(&plan, g[0], g[1], g[0] * 4 + 64, NDIlib_FourCC_type_BGRX, g[2], g[3], 2, g[2] * 2));
+        assert(plan.columnStart[0] == 0 && plan.columnStart[g[0]] == g[2]);
+        assert(plan.rowStart[0] == 0 && plan.rowStart[g[1]] == g[3]);
+        for (int x = 0; x < g[0]; x++) {
+            assert(plan.columnStart[x] <= plan.columnStart[x + 1]);
+        }
+        for (int y = 0; y < g[1]; y++) {
+            assert(plan.rowStart[y] <= plan.rowStart[y + 1]);
+        }
+        assert(plan.downscale == (g[0] >= g[2] && g[1] >= g[3]));
+        for (int x = 0; x < g[2]; x++) {
+            assert(plan.sourceColumn[x] >= 0 && plan.sourceColumn[x] < g[0]);
+        }
+        for (int y = 0; y < g[3]; y++) {
+            assert(plan.sourceRow[y] >= 0 && plan.sourceRow[y] < g[1]);
+        }
+    }
+    freeScalerPlan(&plan);
+
+    assert(averageOfFourSamples(0xFF000000, 0xFF000000, 0xFF000000, 0xFF000000) == 0xFF000000);
+    assert(averageOfFourSamples(0x00FF00FF, 0x00FF00FF, 0x00FF00FF, 0x00FF00FF) == 0x00FF00FF);
+    assert(averageOfFourSamples(0x00400000, 0x00000400, 0x00000004, 0x00C0C0C0) == 0x00403131);
+}
+
+// Each specialized upscaling blitter, flipped or not, must match a straightforward
+// per-pixel rendering of the plan's spans, and the 16bpp blitters must match the
+// 32bpp ones after conversion.
+void testSpecializedBlitters(void) {
+    const int geometries[][4] = {
+        { 37, 5, 37, 5 }, { 13, 7, 26, 21 }, { 13, 7, 30, 16 }, { 7, 3, 7, 9 }
+    };
+    const scaleMode_t expectedModes[] = { kScaleIdentity, kScaleInteger, kScaleArbitrary, kScaleInteger };
+    bool savedFlipped = monitor_flipped;
+    scalerPlan_t plan;
+    bzero(&plan, sizeof(plan));
+
+    for (size_t i = 0; i < sizeof(geometries) / sizeof(geometries[0]); i++) {
+        const int *g = geometries[i];
+        uint32_t *source = (uint32_t *)malloc(g[0] * g[1] * sizeof(uint32_t));
+        for (int p = 0; p < g[0] * g[1]; p++) {
+            source[p] = (uint32_t)(p * 0x9E3779B1u);
+        }
+        NDIlib_video_frame_v2_t frame;
+        bzero(&frame, sizeof(frame));
+        frame.xres = g[0];
+        frame.yres = g[1];
+        frame.p_data = (uint8_t *)source;
+
+        uint32_t *expected = (uint32_t *)malloc(g[2] * g[3] * sizeof(uint32_t));
+        uint32_t *actual32 = (uint32_t *)malloc(g[2] * g[3] * sizeof(uint32_t));
+        uint16_t *actual16 = (uint16_t *)malloc(g[2] * g[3] * sizeof(uint16_t));
+        uint16_t *converted = (uint16_t *)malloc(g[2] * sizeof(uint16_t));
+
+        for (int flip = 0; flip < 2; flip++) {
+            monitor_flipped = flip;
+            buildScalerPlan(&plan, g[0], g[1], 0, NDIlib_FourCC_type_BGRX, g[2], g[3], 4, g[2] * 4);
+            assert(plan.scaleMode == expectedModes[i]);
+            for (int y = 0; y < g[1]; y++) {
+                int sourceY = flip ? g[1] - y - 1 : y;
+                for (int x = 0; x < g[0]; x++) {
+                    uint32_t sample = source[sourceY * g[0] + (flip ? g[0] - x - 1 : x)];
+                    for (int outY = plan.rowStart[y]; outY < plan.rowStart[y + 1]; outY++) {
+                        for (int outX = plan.columnStart[x]; outX < plan.columnStart[x + 1]; outX++) {
+                            expected[outY * g[2] + outX] = sample;
+                        }
+                    }
+                }
+            }
+            renderSlice_t slice = { &frame, (unsigned char *)actual32, &plan, 0, sliceRowCount(&plan),
+                                    plan.scratchRow, plan.packedRow, plan.reversedRow, plan.decodedRow, plan.bandRows,
+                                    copy_to_framebuffer_scalar };
+            renderSlice(&slice);
+            assert(!memcmp(expected, actual32, g[2] * g[3] * sizeof(uint32_t)));
+
+            buildScalerPlan(&plan, g[0], g[1], 0, NDIlib_FourCC_type_BGRX, g[2], g[3], 2, g[2] * 2);
+            renderSlice_t slice16 = { &frame, (unsigned char *)actual16, &plan, 0, sliceRowCount(&plan),
+                                      plan.scratchRow, plan.packedRow, plan.reversedRow, plan.decodedRow, plan.bandRows,
+                                      copy_to_framebuffer_scalar };
+            renderSlice(&slice16);
+            for (int outY = 0; outY < g[3]; outY++) {
+                convert_row_to_16bpp_scalar(&expected[outY * g[2]], converted, g[2]);
+                assert(!memcmp(converted, &actual16[outY * g[2]], g[2] * sizeof(uint16_t)));
+            }
+        }
+        free(source);
+        free(expected);
+        free(actual32);
+        free(actual16);
+        free(converted);
+    }
+    freeScalerPlan(&plan);
+    monitor_flipped = savedFlipped;
+}
+
+// Drawing a UYVY frame must give the same result as drawing the same frame after
+// converting it to BGRX, for every blitter, rotated or not.  (The crops here start on even columns,
+// because UYVY crops are rounded to whole pixel pairs.)
+void testYUVBlitters(void) {
+    const int geometries[][4] = {
+        { 38, 6, 38, 6 }, { 14, 8, 28, 24 }, { 14, 8, 30, 17 }, { 40, 20, 12, 7 }
+    };
+    bool savedFlipped = monitor_flipped, savedBoxFilter = use_box_filter;
+    int savedRotation = monitor_rotation;
+    fitMode_t savedFitMode = fit_mode;
+    scalerPlan_t plan;
+    bzero(&plan, sizeof(plan));
+
+    for (size_t i = 0; i < sizeof(geometries) / sizeof(geometries[0]); i++) {
+        const int *g = geometries[i];
+        uint8_t *uyvy = (uint8_t *)malloc(g[0] * g[1] * 2);
+        uint32_t *bgrx = (uint32_t *)malloc(g[0] * g[1] * sizeof(uint32_t));
+        for (int p = 0; p < g[0] * g[1] * 2; p++) {
+            uyvy[p] = (uint8_t)((p * 0x9E3779B1u) >> 11);
+        }
+        convert_uyvy_row_to_bgrx_scalar(uyvy, bgrx, g[0] * g[1]);
+
+        NDIlib_video_frame_v2_t uyvyFrame, bgrxFrame;
+        bzero(&uyvyFrame, sizeof(uyvyFrame));
+        uyvyFrame.xres = g[0];
+        uyvyFrame.yres = g[1];
+        uyvyFrame.FourCC = NDIlib_FourCC_type_UYVY;
+        bgrxFrame = uyvyFrame;
+        bgrxFrame.FourCC = NDIlib_FourCC_type_BGRX;
+        uyvyFrame.p_data = uyvy;
+        bgrxFrame.p_data = (uint8_t *)bgrx;
+
+        ssize_t screenSize = g[2] * g[3] * 4;
+        unsigned char *expected = (unsigned char *)malloc(screenSize);
+        unsigned char *actual = (unsigned char *)malloc(screenSize);
+
+        for (int variant = 0; variant < 32; variant++) {
+            int bytesPerPixel = (variant & 1) ? 2 : 4;
+            monitor_flipped = variant & 2;
+            use_box_filter = variant & 4;
+            fit_mode = (variant & 8) ? kFitCrop : kFitStretch;
+            monitor_rotation = (variant & 16) ? 90 : 0;
+            NDIlib_video_frame_v2_t *frames[2] = { &bgrxFrame, &uyvyFrame };
+            unsigned char *outputs[2] = { expected, actual };
+            for (int f = 0; f < 2; f++) {
+                memset(outputs[f], 0, screenSize);
+                buildScalerPlan(&plan, g[0], g[1], 0, frames[f]->FourCC, g[2], g[3],
+                                bytesPerPixel, g[2] * bytesPerPixel);
+                renderSlice_t slice = { frames[f], outputs[f], &plan, 0, sliceRowCount(&plan),
+                                        plan.scratchRow, plan.packedRow, plan.reversedRow, plan.decodedRow, plan.bandRows,
+                                        copy_to_framebuffer_scalar };
+                renderSlice(&slice);
+            }
+            assert(!memcmp(expected, actual, screenSize));
+        }
+        free(uyvy);
+        free(bgrx);
+        free(expected);
+        free(actual);
+    }
+    freeScalerPlan(&plan);
+    monitor_flipped = savedFlipped;
+    use_box_filter = savedBoxFilter;
+    monitor_rotation = savedRotation;
+    fit_mode = savedFitMode;
+}
+
+// Rotated frames, drawn in several slices, must match a per-pixel rendering that turns
+// each screen pixel back into the picture's orientation.  Flipping a rotated screen
+// turns it the other way.
+void testRotatedBlitters(void) {
+    const int geometries[][4] = {
+        { 20, 12, 12, 20 }, { 13, 7, 24, 40 }, { 40, 22, 9, 17 }, { 16, 9, 12, 20 }, { 9, 16, 40, 24 }
+    };
+    bool savedFlipped = monitor_flipped;
+    int savedRotation = monitor_rotation;
+    fitMode_t savedFitMode = fit_mode;
+    scalerPlan_t plan;
+    bzero(&plan, sizeof(plan));
+
+    for (size_t i = 0; i < sizeof(geometries) / sizeof(geometries[0]); i++) {
+        const int *g = geometries[i];
+        uint32_t *source = (uint32_t *)malloc(g[0] * g[1] * sizeof(uint32_t));
+        for (int p = 0; p < g[0] * g[1]; p++) {
+            source[p] = (uint32_t)(p * 0x9E3779B1u);
+        }
+        NDIlib_video_frame_v2_t frame;
+        bzero(&frame, sizeof(frame));
+        frame.xres = g[0];
+        frame.yres = g[1];
+        frame.p_data = (uint8_t *)source;
+
+        ssize_t screenSize = g[2] * g[3] * 4;
+        unsigned char *actual = (unsigned char *)malloc(screenSize);
+        uint16_t converted;
+
+        for (int variant = 0; variant < 16; variant++) {
+            int bytesPerPixel = (variant & 1) ? 2 : 4;
+            monitor_rotation = (variant & 2) ? 270 : 90;
+            monitor_flipped = variant & 4;
+            fit_mode = (variant & 8) ? kFitLetterbox : kFitStretch;
+            int rotation = ((monitor_rotation == 90) != monitor_flipped) ? 90 : 270;
+            ssize_t stride = g[2] * bytesPerPixel;
+
+            buildScalerPlan(&plan, g[0], g[1], 0, NDIlib_FourCC_type_BGRX, g[2], g[3], bytesPerPixel, stride);
+            assert(plan.scaleMode == kScaleRotated && plan.rotation == rotation && !plan.flipped);
+            assert(plan.outputXRes == plan.screenYRes && plan.outputYRes == plan.screenXRes);
+            if (fit_mode == kFitStretch) {
+                assert(plan.outputXRes == g[2] && plan.outputYRes == g[3] && plan.screenOffset == 0);
+            }
+
+            memset(actual, 0xAA, screenSize);
+            int rowCount = sliceRowCount(&plan);
+            for (int sliceIndex = 0; sliceIndex < 3; sliceIndex++) {
+                renderSlice_t slice = { &frame, actual, &plan, sliceBoundary(&plan, rowCount, sliceIndex, 3),
+                                        sliceBoundary(&plan, rowCount, sliceIndex + 1, 3),
+                                        plan.scratchRow, plan.packedRow, plan.reversedRow, plan.decodedRow,
+                                        plan.bandRows, copy_to_framebuffer_scalar };
+                renderSlice(&slice);
+            }
+
+            int outputX = (int)((plan.screenOffset % stride) / bytesPerPixel);
+            int outputY = (int)(plan.screenOffset / stride);
+            for (int y = 0; y < g[3]; y++) {
+                for (int x = 0; x < g[2]; x++) {
+                    unsigned char *pixel = actual + (y * stride) + (x * bytesPerPixel);
+                    int outX = x - outputX, outY = y - outputY;
+                    if (outX < 0 || outX >= plan.outputXRes || outY < 0 || outY >= plan.outputYRes) {
+                        assert(pixel[0] == 0xAA && pixel[bytesPerPixel - 1] == 0xAA);
+                        continue;
+                    }
+                    int pictureX = (rotation == 90) ? outY : plan.screenXRes - outY - 1;
+                    int pictureY = (rotation == 90) ? plan.screenYRes - outX - 1 : outX;
+                    int sourceX = (int)(((int64_t)(2 * pictureX + 1) * g[0]) / (2 * plan.screenXRes));
+                    int sourceY = (int)(((int64_t)(2 * pictureY + 1) * g[1]) / (2 * plan.screenYRes));
+                    uint32_t expected = source[sourceY * g[0] + sourceX];
+                    if (bytesPerPixel == 4) {
+                        assert(*(uint32_t *)pixel == expected);
+                    } else {
+                        convert_row_to_16bpp_scalar(&expected, &converted, 1);
+                        assert(*(uint16_t *)pixel == converted);
+                    }
+                }
+            }
+        }
+        free(source);
+        free(actual);
+    }
+    freeScalerPlan(&plan);
+    monitor_flipped = savedFlipped;
+    monitor_rotation = savedRotation;
+    fit_mode = savedFitMode;
+}
+
+// Cropping and 1:1 letterboxing of padded frames must come out as plain row copies.
+void testFitModes(void) {
+    fitMode_t savedFitMode = fit_mode;
+    scalerPlan_t plan;
+    bzero(&plan, sizeof(plan));
+
+    fit_mode = kFitLetterbox;
+    buildScalerPlan(&plan, 16, 9, 0, NDIlib_FourCC_type_BGRX, 16, 12, 4, 64);
+    assert(plan.scaleMode == kScaleIdentity && plan.screenOffset == 64);
+    buildScalerPlan(&plan, 8, 4, 0, NDIlib_FourCC_type_BGRX, 16, 12, 2, 32);
+    assert(plan.scaleMode == kScaleInteger && plan.screenYRes == 8 && plan.screenOffset == 2 * 32);
+    buildScalerPlan(&plan, 9, 16, 0, NDIlib_FourCC_type_BGRX, 32, 16, 4, 128);
+    assert(plan.screenXRes == 9 && plan.screenOffset == ((32 - 9) / 2) * 4);
+
+    // A 20x12 frame with padded rows, cropped onto a 16x10 screen with padded rows.
+    const int frameStride = 20 * 4 + 32, screenStride = 16 * 4 + 16;
+    uint8_t frameData[12 * frameStride];
+    uint8_t screen[10 * screenStride];
+    for (size_t i = 0; i < sizeof(frameData); i++) {
+        frameData[i] = (uint8_t)(i * 7);
+    }
+    NDIlib_video_frame_v2_t frame;
+    bzero(&frame, sizeof(frame));
+    frame.xres = 20;
+    frame.yres = 12;
+    frame.line_stride_in_bytes = frameStride;
+    frame.p_data = frameData;
+
+    fit_mode = kFitCrop;
+    buildScalerPlan(&plan, 20, 12, frameStride, NDIlib_FourCC_type_BGRX, 16, 10, 4, screenStride);
+    assert(plan.scaleMode == kScaleIdentity);
+    memset(screen, 0xAA, sizeof(screen));
+    renderSlice_t slice = { &frame, screen, &plan, 0, sliceRowCount(&plan),
+                            plan.scratchRow, plan.packedRow, plan.reversedRow, plan.decodedRow, plan.bandRows,
+                            copy_to_framebuffer_scalar };
+    renderSlice(&slice);
+    for (int y = 0; y < 10; y++) {
+        assert(!memcmp(&screen[y * screenStride], &frameData[(y + 1) * frameStride + 2 * 4], 16 * 4));
+        assert(screen[y * screenStride + 16 * 4] == 0xAA);
+    }
+
+    freeScalerPlan(&plan);
+    fit_mode = savedFitMode;
+}
+#endif  // __linux__
+
 #ifdef USE_MRAA
 
 // This leaks, so don't do it too much.